@@ -0,0 +1,222 @@
+#include <string.h>
+
+#include "checksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSUM_X86
+#endif
+
+/**
+ * Reduces a 64 bit accumulator of 32 bit words to a 32 bit partial sum. Since 2^16 = 1 modulo
+ * 2^16 - 1, summing 32 bit words and folding gives the same one's complement sum as summing
+ * 16 bit words.
+ */
+uint32_t fold64(uint64_t acc) {
+    while (acc >> 32) acc = (acc & 0xffffffff) + (acc >> 32);
+    return (uint32_t) acc;
+}
+
+/**
+ * Adds the last len < 4 octets of a buffer, padded with zero octets.
+ */
+uint64_t csum_tail(const unsigned char* p, size_t len) {
+    uint32_t w = 0;
+    memcpy(&w, p, len);
+    return w;
+}
+
+uint32_t csum_partial_scalar(const void* buf, size_t len, uint32_t sum) {
+    const unsigned char* p = buf;
+    uint64_t acc = sum;
+    uint32_t w;
+
+    for (; len >= 16; len -= 16, p += 16) {
+        uint32_t w0, w1, w2, w3;
+        memcpy(&w0, p, 4);
+        memcpy(&w1, p + 4, 4);
+        memcpy(&w2, p + 8, 4);
+        memcpy(&w3, p + 12, 4);
+        acc += (uint64_t) w0 + w1 + w2 + w3;
+    }
+    for (; len >= 4; len -= 4, p += 4) {
+        memcpy(&w, p, 4);
+        acc += w;
+    }
+    acc += csum_tail(p, len);
+
+    return fold64(acc);
+}
+
+/**
+ * Copies len octets from src to dst and returns the partial sum of the copied data, reading every
+ * octet once.
+ */
+uint32_t csum_copy_scalar(void* dst, const void* src, size_t len, uint32_t sum) {
+    unsigned char* d = dst;
+    const unsigned char* p = src;
+    uint64_t acc = sum;
+    uint32_t w0, w1;
+
+    for (; len >= 8; len -= 8, p += 8, d += 8) {
+        memcpy(&w0, p, 4);
+        memcpy(&w1, p + 4, 4);
+        memcpy(d, &w0, 4);
+        memcpy(d + 4, &w1, 4);
+        acc += (uint64_t) w0 + w1;
+    }
+    if (len >= 4) {
+        memcpy(&w0, p, 4);
+        memcpy(d, &w0, 4);
+        acc += w0;
+        len -= 4;
+        p += 4;
+        d += 4;
+    }
+    memcpy(d, p, len);
+    acc += csum_tail(p, len);
+
+    return fold64(acc);
+}
+
+#ifdef CSUM_X86
+
+__attribute__((target("sse2")))
+uint32_t csum_partial_sse2(const void* buf, size_t len, uint32_t sum) {
+    const unsigned char* p = buf;
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();                 // two 64 bit lanes of 32 bit word sums
+
+    for (; len >= 16; len -= 16, p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+    }
+
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    uint64_t total = (uint64_t) fold64(lanes[0]) + fold64(lanes[1]);
+
+    return csum_partial_scalar(p, len, fold64(total + sum));
+}
+
+__attribute__((target("avx2")))
+uint32_t csum_partial_avx2(const void* buf, size_t len, uint32_t sum) {
+    const unsigned char* p = buf;
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = _mm256_setzero_si256();             // four 64 bit lanes of 32 bit word sums
+    __m256i acc1 = _mm256_setzero_si256();
+
+    for (; len >= 64; len -= 64, p += 64) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *) p);
+        __m256i v1 = _mm256_loadu_si256((const __m256i *) (p + 32));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v0, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v0, zero));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v1, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v1, zero));
+    }
+    for (; len >= 32; len -= 32, p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, _mm256_add_epi64(acc0, acc1));
+    uint64_t total = (uint64_t) fold64(lanes[0]) + fold64(lanes[1]) + fold64(lanes[2]) + fold64(lanes[3]);
+
+    return csum_partial_scalar(p, len, fold64(total + sum));
+}
+
+__attribute__((target("avx2")))
+uint32_t csum_copy_avx2(void* dst, const void* src, size_t len, uint32_t sum) {
+    unsigned char* d = dst;
+    const unsigned char* p = src;
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+
+    for (; len >= 32; len -= 32, p += 32, d += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        _mm256_storeu_si256((__m256i *) d, v);
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, _mm256_add_epi64(acc0, acc1));
+    uint64_t total = (uint64_t) fold64(lanes[0]) + fold64(lanes[1]) + fold64(lanes[2]) + fold64(lanes[3]);
+
+    return csum_copy_scalar(d, p, len, fold64(total + sum));
+}
+
+#endif
+
+uint32_t (*csum_impl)(const void*, size_t, uint32_t) = csum_partial_scalar;
+uint32_t (*csum_copy_impl)(void*, const void*, size_t, uint32_t) = csum_copy_scalar;
+
+/**
+ * Picks the fastest checksum implementation the CPU supports.
+ */
+void csum_init() {
+#ifdef CSUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        csum_impl = csum_partial_avx2;
+        csum_copy_impl = csum_copy_avx2;
+    } else if (__builtin_cpu_supports("sse2")) csum_impl = csum_partial_sse2;
+#endif
+}
+
+/**
+ * Adds the buffer to a running one's complement sum. Buffers can be summed piecewise as long as 
+ * every piece but the last has an even length.
+ * @param buf: start of the data.
+ * @param len: length of the data in octets.
+ * @param sum: partial sum of the preceding pieces, 0 for the first one.
+ */
+uint32_t csum_partial(const void* buf, size_t len, uint32_t sum) {
+    return csum_impl(buf, len, sum);
+}
+
+/**
+ * Copies a buffer and adds it to a running one's complement sum in the same pass, so data that
+ * is both copied and checksummed is only read once. The same piecewise rule as for csum_partial
+ * applies.
+ * @param dst: destination of the copy, must not overlap src.
+ * @param src: start of the data.
+ * @param len: length of the data in octets.
+ * @param sum: partial sum of the preceding pieces, 0 for the first one.
+ */
+uint32_t csum_copy(void* dst, const void* src, size_t len, uint32_t sum) {
+    return csum_copy_impl(dst, src, len, sum);
+}
+
+/**
+ * Folds a partial sum to 16 bits and returns its one's complement, i.e. the checksum.
+ */
+uint16_t csum_fold(uint32_t sum) {
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t) ~sum;
+}
+
+/**
+ * Computes the checksum of a buffer. Over a header that includes its checksum, the result is 0 
+ * iff the checksum is correct.
+ */
+uint16_t ip_checksum(const void* buf, size_t len) {
+    return csum_fold(csum_partial(buf, len, 0));
+}
+
+/**
+ * Updates a checksum after a 16 bit word of the data changed from old to new, without touching
+ * the rest of the data (RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m')).
+ * @param csum: checksum before the change.
+ * @param old: previous value of the word, as read from memory.
+ * @param new: new value of the word, as read from memory.
+ */
+uint16_t csum_update16(uint16_t csum, uint16_t old, uint16_t new) {
+    uint32_t sum = (uint16_t) ~csum + (uint16_t) ~old + new;
+    return csum_fold(sum);
+}
@@ -0,0 +1,27 @@
+#ifndef CHECKSUM
+#define CHECKSUM
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Internet checksum (RFC 1071). Words are summed in host byte order; since the one's complement 
+ * sum is byte order independent, storing the folded result back in host order gives the correct 
+ * value on the wire.
+ */
+
+void csum_init();
+uint32_t csum_partial(const void* buf, size_t len, uint32_t sum);
+uint32_t csum_copy(void* dst, const void* src, size_t len, uint32_t sum);
+uint16_t csum_fold(uint32_t sum);
+uint16_t ip_checksum(const void* buf, size_t len);
+uint16_t csum_update16(uint16_t csum, uint16_t old, uint16_t new);
+
+#ifdef DEBUG_INFO_ENABLED
+
+uint32_t csum_partial_scalar(const void* buf, size_t len, uint32_t sum);
+uint32_t csum_copy_scalar(void* dst, const void* src, size_t len, uint32_t sum);
+
+#endif
+
+#endif
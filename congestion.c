@@ -0,0 +1,152 @@
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "congestion.h"
+
+#define CUBIC_C 0.4                 // scaling constant of the cubic function, segments / s^3
+#define CUBIC_BETA 0.7              // multiplicative decrease factor
+
+/**
+ * Sets up the congestion state of a new connection: initial window of RFC 6928, and a slow start
+ * threshold that leaves slow start to the first loss.
+ * @param ops: algorithm of the connection.
+ * @param mss: sender maximum segment size.
+ */
+void cong_init(CongState* c, const CongOps* ops, uint32_t mss) {
+    uint32_t iw = 2 * mss > 14600 ? 2 * mss : 14600;
+
+    c->ops = ops;
+    c->mss = mss;
+    c->cwnd = iw < 10 * mss ? iw : 10 * mss;
+    c->ssthresh = UINT32_MAX;
+    c->rtt_us = 0;
+    memset(c->priv, 0, sizeof(c->priv));
+    if (ops->init != NULL) ops->init(c);
+}
+
+/**
+ * Slow start (RFC 5681): one segment per acknowledgment at most, so stretch ACKs can't burst.
+ * @return the octets of acked left for congestion avoidance once cwnd reaches ssthresh.
+ */
+uint32_t slow_start(CongState* c, uint32_t acked) {
+    uint32_t inc = acked < c->mss ? acked : c->mss;
+    if (c->cwnd + inc > c->ssthresh) inc = c->ssthresh > c->cwnd ? c->ssthresh - c->cwnd : 0;
+    c->cwnd += inc;
+    return c->cwnd < c->ssthresh ? 0 : acked - inc;
+}
+
+/*
+ * NewReno (RFC 5681, RFC 6582). The loss recovery itself is done by TCP; the algorithm only
+ * sizes the window.
+ */
+typedef struct {
+    uint32_t acked;                 // octets acknowledged since cwnd last grew in congestion avoidance
+} RenoState;
+
+void reno_on_ack(CongState* c, uint32_t acked, uint64_t now_us) {
+    RenoState* s = (RenoState *) c->priv;
+
+    if (c->cwnd < c->ssthresh && (acked = slow_start(c, acked)) == 0) return;
+    s->acked += acked;                  // appropriate byte counting: one MSS per window acknowledged
+    if (s->acked >= c->cwnd) {
+        s->acked -= c->cwnd;
+        c->cwnd += c->mss;
+    }
+}
+
+void reno_on_loss(CongState* c, uint32_t in_flight, uint64_t now_us) {
+    c->ssthresh = in_flight / 2 > 2 * c->mss ? in_flight / 2 : 2 * c->mss;
+    ((RenoState *) c->priv)->acked = 0;
+}
+
+void reno_on_timeout(CongState* c, uint32_t in_flight, uint64_t now_us) {
+    reno_on_loss(c, in_flight, now_us);
+    c->cwnd = c->mss;
+}
+
+const CongOps cong_newreno = {
+    .name = "newreno",
+    .init = NULL,
+    .on_ack = reno_on_ack,
+    .on_loss = reno_on_loss,
+    .on_timeout = reno_on_timeout,
+};
+
+/*
+ * CUBIC (RFC 9438). Windows are kept in segments as doubles, the time since the last reduction
+ * in seconds. Until the RTT is known, the target is not looked ahead by one RTT.
+ */
+typedef struct {
+    double w_max;                   // window before the last reduction
+    double k;                       // time the cubic function takes to reach w_max again
+    double w_est;                   // window Reno would have, for the Reno-friendly region
+    uint64_t epoch_us;              // start of the congestion avoidance epoch, 0 if not started
+} CubicState;
+
+_Static_assert(sizeof(CubicState) <= CONG_PRIV_SIZE, "CubicState does not fit CongState.priv");
+_Static_assert(sizeof(RenoState) <= CONG_PRIV_SIZE, "RenoState does not fit CongState.priv");
+
+void cubic_on_ack(CongState* c, uint32_t acked, uint64_t now_us) {
+    CubicState* s = (CubicState *) c->priv;
+
+    if (c->cwnd < c->ssthresh && (acked = slow_start(c, acked)) == 0) return;
+
+    double cwnd = (double) c->cwnd / c->mss;
+    if (s->epoch_us == 0) {
+        s->epoch_us = now_us;
+        if (cwnd < s->w_max) {
+            s->k = cbrt((s->w_max - cwnd) / CUBIC_C);
+        } else {
+            s->k = 0;
+            s->w_max = cwnd;
+        }
+        s->w_est = cwnd;
+    }
+
+    double t = (double) (now_us - s->epoch_us + c->rtt_us) / 1e6;
+    double target = CUBIC_C * (t - s->k) * (t - s->k) * (t - s->k) + s->w_max;
+    if (target < cwnd) target = cwnd;
+    if (target > 1.5 * cwnd) target = 1.5 * cwnd;
+
+    // Reno-friendly region: grow at least as fast as Reno with the same decrease factor would
+    s->w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * acked / c->cwnd;
+    if (s->w_est > target) target = s->w_est;
+
+    c->cwnd += (uint32_t) ((target - cwnd) * acked / c->cwnd * c->mss);
+}
+
+void cubic_on_loss(CongState* c, uint32_t in_flight, uint64_t now_us) {
+    CubicState* s = (CubicState *) c->priv;
+    double cwnd = (double) c->cwnd / c->mss;
+
+    // fast convergence: release bandwidth to flows that started later
+    s->w_max = cwnd < s->w_max ? cwnd * (1 + CUBIC_BETA) / 2 : cwnd;
+    s->epoch_us = 0;
+
+    uint32_t ssthresh = c->cwnd * CUBIC_BETA;
+    c->ssthresh = ssthresh > 2 * c->mss ? ssthresh : 2 * c->mss;
+}
+
+void cubic_on_timeout(CongState* c, uint32_t in_flight, uint64_t now_us) {
+    cubic_on_loss(c, in_flight, now_us);
+    c->cwnd = c->mss;
+}
+
+const CongOps cong_cubic = {
+    .name = "cubic",
+    .init = NULL,
+    .on_ack = cubic_on_ack,
+    .on_loss = cubic_on_loss,
+    .on_timeout = cubic_on_timeout,
+};
+
+/**
+ * Returns the algorithm with the given name, NULL if there is none.
+ */
+const CongOps* cong_find(const char* name) {
+    const CongOps* all[] = { &cong_newreno, &cong_cubic };
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++)
+        if (strncmp(all[i]->name, name, CONG_NAME_LEN) == 0) return all[i];
+    return NULL;
+}
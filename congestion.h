@@ -0,0 +1,43 @@
+#ifndef CONGESTION
+#define CONGESTION
+
+#include <stdint.h>
+
+#define CONG_PRIV_SIZE 64           // octets of private state an algorithm may keep per connection
+#define CONG_NAME_LEN 16
+
+/*
+ * Congestion window of a connection, in octets. cwnd and ssthresh are read by the TCP output
+ * path; the algorithm in ops owns them otherwise, together with its private state.
+ */
+typedef struct CongState {
+    const struct CongOps* ops;
+    uint32_t cwnd;                  // congestion window
+    uint32_t ssthresh;              // slow start threshold
+    uint32_t mss;                   // sender maximum segment size
+    uint32_t rtt_us;                // smoothed round trip time, 0 while unknown
+    char priv[CONG_PRIV_SIZE] __attribute__((aligned(8)));
+} CongState;
+
+/*
+ * A congestion control algorithm. The hooks are called by tcp_manager only.
+ * on_ack: new data was acknowledged outside of loss recovery.
+ * on_loss: loss was detected by duplicate acknowledgments; sets ssthresh, TCP then enters fast
+ *          recovery with cwnd at ssthresh plus the segments that left the network.
+ * on_timeout: the retransmission timer expired; sets ssthresh and cwnd.
+ */
+typedef struct CongOps {
+    char name[CONG_NAME_LEN];
+    void (*init)(CongState* c);
+    void (*on_ack)(CongState* c, uint32_t acked, uint64_t now_us);
+    void (*on_loss)(CongState* c, uint32_t in_flight, uint64_t now_us);
+    void (*on_timeout)(CongState* c, uint32_t in_flight, uint64_t now_us);
+} CongOps;
+
+extern const CongOps cong_newreno;
+extern const CongOps cong_cubic;
+
+const CongOps* cong_find(const char* name);
+void cong_init(CongState* c, const CongOps* ops, uint32_t mss);
+
+#endif
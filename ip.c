@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -5,12 +7,29 @@
 #include <string.h>
 #include <fcntl.h>
 #include <stdatomic.h>
+#include <stddef.h>
+#include <sched.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/if_tun.h>
 
 #include "ip.h"
 #include "reassembly_store.h"
+#include "tun_io.h"
+#include "checksum.h"
 
 #define FRAGMENTED(hdr) (((hdr)->flags & MF_MORE_FRAGMENTS) | (hdr)->frag_offset)
 
+#define HDR_LEN_WORD offsetof(IpHeader, len)           // octet offset of the total length
+#define HDR_FRAG_WORD (offsetof(IpHeader, id) + 2)     // octet offset of the flags / fragment offset word
+
 
 /**
  * Given an IpStatus, prints the associated error message.
@@ -29,158 +48,1112 @@ void ip_error_message(IpStatus s) {
 
 struct {
     atomic_int killed;
-    atomic_int kill_confirmed;
-    int fd;
-} ip;
+    int kill_efd;                   // written by the last manager to leave a queue, ip_kill blocks on it
+    uint16_t mtu;                   // current MTU of the device
+    size_t slot_size;               // size of the pool slots, the largest MTU usable without ip_init
+    void (*receiver)(PktBuf* buf);  // upper layer complete datagrams are handed to
+    IpPollConfig poll;
+    unsigned nqueues;               // number of tun queues, each with its own managers
+    uint32_t rss[8][256];           // Toeplitz hash of each input octet value at each position
+} ip = { .nqueues = 1 };
+
+_Static_assert(2 * IP_MAX_BATCH <= TIO_QUEUE_DEPTH, "a full read and write batch must fit in the tun_io queue");
 
 typedef struct __attribute__((__packed__))
 {
     uint32_t saddr;                 // source address
     uint32_t daddr;                 // target address
     uint8_t proto;                  // protocol
+    uint16_t id;                    // identification
 } BufId;
 
 typedef struct {
-    char data[MTU];
-    size_t len;
+    char* data;                     // slot memory in the pool arena, ip.slot_size octets
+    size_t len;                     // octets in data: the packet, or only its header if payload is set
+    uint32_t data_csum;             // partial checksum of an inline payload, summed while copying it in
+    IpPayload* payload;             // payload the fragment points into, NULL if it is inline
+    struct iovec iov[2];            // header and payload of a referencing fragment
+    PktBuf* buf;                    // in_pool only: receive buffer data belongs to
 } ip_packet;
 
-struct {
-    pthread_mutex_t lck;
-    uint8_t s; //  
-    uint8_t e; // points to the
-    ip_packet pckts[MAX_MESSAGE_POOL];
-} in_pool;
+_Static_assert((MAX_MESSAGE_POOL & (MAX_MESSAGE_POOL - 1)) == 0, "MAX_MESSAGE_POOL must be a power of two");
 
-struct {
-    pthread_mutex_t lck;
-    uint8_t s; //  
-    uint8_t e; // points to the
-    ip_packet pckts[MAX_MESSAGE_POOL];
-} out_pool;
-
-int in_pool_init() {
-    int s = 0;
-    if ((s = pthread_mutex_init(&in_pool.lck, NULL)) != 0) return s;
-    in_pool.s = 0;
-    in_pool.e = 0;
-    return 0;
+#define POOL_MASK (MAX_MESSAGE_POOL - 1)
+
+/*
+ * Single-producer/single-consumer ring of packet slots. The consumer owns s and the producer
+ * owns e; both are free running and reduced with POOL_MASK on access. Each side keeps a cached
+ * copy of the other side's index, so the remote cache line is only read when the ring looks
+ * full (producer) or empty (consumer).
+ * When a commit makes an empty ring non-empty, the producer signals efd, so an idle consumer can
+ * block on it instead of polling.
+ */
+typedef struct {
+    atomic_size_t s __attribute__((aligned(CACHE_LINE_SIZE)));    // next slot to be consumed
+    size_t cached_e;                                                // consumer's copy of e
+    atomic_size_t e __attribute__((aligned(CACHE_LINE_SIZE)));    // next slot to be produced
+    size_t cached_s;                                                // producer's copy of s
+    int efd;                                                        // consumer wakeup eventfd
+    char* arena;                                                    // backing memory of the slots
+    ip_packet pckts[MAX_MESSAGE_POOL] __attribute__((aligned(CACHE_LINE_SIZE)));
+} PacketRing;
+
+/*
+ * The in_pool arena holds IP_RX_BUFFERS receive buffers, MAX_MESSAGE_POOL of them attached to the
+ * slots. A packet that needs no reassembly is handed up in the buffer it was read into; the input
+ * manager puts a spare buffer in its slot, and the buffer comes back when the upper layer drops 
+ * its last reference. If all spares are held upstream, the packet is copied instead.
+ */
+typedef struct {
+    PktBuf bufs[IP_RX_BUFFERS];
+    PktBuf* spare;                  // spare buffers, only used by the input manager
+    PktBufStack returned;           // buffers dropped by upper layers, on any thread
+} RxPool;
+
+/*
+ * Packets one input manager passes to another, because their flow hashes to the other's queue.
+ * Single producer, single consumer; there is one ring for every ordered pair of queues.
+ */
+typedef struct {
+    atomic_size_t s __attribute__((aligned(CACHE_LINE_SIZE)));    // next buffer to be consumed
+    atomic_size_t e __attribute__((aligned(CACHE_LINE_SIZE)));    // next buffer to be produced
+    PktBuf* bufs[IP_STEER_RING];
+} SteerRing;
+
+_Static_assert((IP_STEER_RING & (IP_STEER_RING - 1)) == 0, "IP_STEER_RING must be a power of two");
+
+/*
+ * Everything one tun queue needs: its fd and io_uring, a traffic manager and an input manager with
+ * the pools between them and the output manager, and a reassembly store.
+ */
+typedef struct {
+    unsigned id;
+    int fd;
+    int epfd;                       // epoll set the traffic manager sleeps on
+    int batched_io;                 // 1 if the traffic manager uses the tun_io backend
+    size_t posted_reads;            // reads handed to tun_io but not yet committed to the in_pool
+    TioRing tio;
+    RasStore* ras;                  // only used by the input manager
+    PacketRing in_pool;             // traffic manager -> input manager
+    PacketRing out_pool;            // output manager -> traffic manager
+    RxPool rx;
+    atomic_uint users;              // managers running on the queue; the last to leave tells ip_kill
+
+    // traffic manager statistics, only written by the traffic manager
+    atomic_uint read_batch;         // current read budget per cycle
+    atomic_uint write_batch;        // current write budget per cycle
+    atomic_ullong packets_in;
+    atomic_ullong packets_out;
+    atomic_ullong sleeps;
+
+    // input manager statistics, only written by the input manager
+    atomic_ullong steered;
+    atomic_ullong steer_drops;
+} IpQueue;
+
+IpQueue queues[IP_MAX_QUEUES];
+SteerRing* steer;               // steer[from * nqueues + to], NULL with a single queue
+
+/**
+ * Resets the ring, allocates its slots and creates its wakeup eventfd.
+ * @param r: ring to be initialized.
+ * @param efd_flags: flags for the eventfd, EFD_NONBLOCK if the consumer waits on it with epoll.
+ * @param slot_size: size of a slot, a multiple of CACHE_LINE_SIZE.
+ * @param nbufs: number of slot sized buffers in the arena, the first MAX_MESSAGE_POOL back the slots.
+ */
+int ring_init(PacketRing* r, int efd_flags, size_t slot_size, size_t nbufs) {
+    atomic_store_explicit(&r->s, 0, memory_order_relaxed);
+    atomic_store_explicit(&r->e, 0, memory_order_relaxed);
+    r->cached_e = 0;
+    r->cached_s = 0;
+    r->efd = -1;
+
+    free(r->arena);
+    r->arena = aligned_alloc(CACHE_LINE_SIZE, nbufs * slot_size);
+    if (r->arena == NULL) return -1;
+    for (int i = 0; i < MAX_MESSAGE_POOL; i++) {
+        r->pckts[i].data = r->arena + i * slot_size;
+        r->pckts[i].len = 0;
+        r->pckts[i].payload = NULL;
+        r->pckts[i].buf = NULL;
+    }
+
+    r->efd = eventfd(0, efd_flags | EFD_CLOEXEC);
+    return r->efd < 0 ? -1 : 0;
+}
+
+void ring_free(PacketRing* r) {
+    free(r->arena);
+    r->arena = NULL;
+    close(r->efd);
 }
 
-int out_pool_init() { 
-    int s = 0;
-    if ((s = pthread_mutex_init(&out_pool.lck, NULL)) != 0) return s;
-    out_pool.s = 0;
-    out_pool.e = 0;
+/**
+ * Wakes the consumer through efd.
+ */
+void ring_wake(PacketRing* r) {
+    uint64_t one = 1;
+    write(r->efd, &one, sizeof(one));
+}
+
+/**
+ * Producer side: wakes the consumer if the commit of slot e_old made the ring non-empty. The
+ * fence pairs with the one in ring_may_sleep: either the consumer sees the new e before it
+ * blocks, or the producer sees that the consumer has caught up with e_old.
+ */
+void ring_notify(PacketRing* r, size_t e_old) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&r->s, memory_order_relaxed) == e_old) ring_wake(r);
+}
+
+/**
+ * Consumer side: returns 1 if the ring is empty, in which case the consumer may block on efd
+ * without missing a commit.
+ */
+int ring_may_sleep(PacketRing* r) {
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load_explicit(&r->e, memory_order_relaxed) 
+        == atomic_load_explicit(&r->s, memory_order_relaxed);
+}
+
+/**
+ * Producer side: returns the slot that will be published by the next ring_commit, or NULL
+ * if the ring is full.
+ * @param r: ring to reserve a slot in.
+ */
+ip_packet* ring_reserve(PacketRing* r) {
+    size_t e = atomic_load_explicit(&r->e, memory_order_relaxed);
+    if (e - r->cached_s == MAX_MESSAGE_POOL) {
+        r->cached_s = atomic_load_explicit(&r->s, memory_order_acquire);
+        if (e - r->cached_s == MAX_MESSAGE_POOL) return NULL;
+    }
+    return &r->pckts[e & POOL_MASK];
+}
+
+/**
+ * Producer side: publishes the slot handed out by the last ring_reserve.
+ * @param r: ring to publish to.
+ */
+void ring_commit(PacketRing* r) {
+    size_t e = atomic_load_explicit(&r->e, memory_order_relaxed);
+    atomic_store_explicit(&r->e, e + 1, memory_order_release);
+    ring_notify(r, e);
+}
+
+/**
+ * Producer side: number of slots that can be reserved without the consumer making progress.
+ * @param r: ring to be examined.
+ */
+size_t ring_free_slots(PacketRing* r) {
+    size_t e = atomic_load_explicit(&r->e, memory_order_relaxed);
+    r->cached_s = atomic_load_explicit(&r->s, memory_order_acquire);
+    return MAX_MESSAGE_POOL - (e - r->cached_s);
+}
+
+/**
+ * Consumer side: returns the oldest published slot, or NULL if the ring is empty.
+ * @param r: ring to read from.
+ */
+ip_packet* ring_peek(PacketRing* r) {
+    size_t s = atomic_load_explicit(&r->s, memory_order_relaxed);
+    if (s == r->cached_e) {
+        r->cached_e = atomic_load_explicit(&r->e, memory_order_acquire);
+        if (s == r->cached_e) return NULL;
+    }
+    return &r->pckts[s & POOL_MASK];
+}
+
+/**
+ * Consumer side: hands the slot returned by the last ring_peek back to the producer.
+ * @param r: ring to release the slot in.
+ */
+void ring_release(PacketRing* r) {
+    size_t s = atomic_load_explicit(&r->s, memory_order_relaxed);
+    atomic_store_explicit(&r->s, s + 1, memory_order_release);
+}
+
+/**
+ * Producer side: number of slots, at most n, that can be reserved starting at e.
+ * @param r: ring to reserve slots in.
+ * @param n: maximum number of slots wanted.
+ */
+size_t ring_reserve_n(PacketRing* r, size_t n) {
+    size_t e = atomic_load_explicit(&r->e, memory_order_relaxed);
+    if (MAX_MESSAGE_POOL - (e - r->cached_s) < n)
+        r->cached_s = atomic_load_explicit(&r->s, memory_order_acquire);
+    size_t free = MAX_MESSAGE_POOL - (e - r->cached_s);
+    return free < n ? free : n;
+}
+
+/**
+ * Producer side: publishes n slots at once.
+ * @param r: ring to publish to.
+ * @param n: number of slots, previously granted by ring_reserve_n.
+ */
+void ring_commit_n(PacketRing* r, size_t n) {
+    if (n == 0) return;
+    size_t e = atomic_load_explicit(&r->e, memory_order_relaxed);
+    atomic_store_explicit(&r->e, e + n, memory_order_release);
+    ring_notify(r, e);
+}
+
+/**
+ * Consumer side: number of published slots, at most n, starting at s.
+ * @param r: ring to read from.
+ * @param n: maximum number of slots wanted.
+ */
+size_t ring_peek_n(PacketRing* r, size_t n) {
+    size_t s = atomic_load_explicit(&r->s, memory_order_relaxed);
+    if (r->cached_e - s < n)
+        r->cached_e = atomic_load_explicit(&r->e, memory_order_acquire);
+    size_t avail = r->cached_e - s;
+    return avail < n ? avail : n;
+}
+
+/**
+ * Consumer side: hands n slots back to the producer at once.
+ * @param r: ring to release the slots in.
+ * @param n: number of slots, previously granted by ring_peek_n.
+ */
+void ring_release_n(PacketRing* r, size_t n) {
+    size_t s = atomic_load_explicit(&r->s, memory_order_relaxed);
+    atomic_store_explicit(&r->s, s + n, memory_order_release);
+}
+
+/**
+ * Returns the slot with free running index idx.
+ */
+ip_packet* ring_slot(PacketRing* r, size_t idx) {
+    return &r->pckts[idx & POOL_MASK];
+}
+
+int ring_empty(PacketRing* r) {
+    return atomic_load_explicit(&r->e, memory_order_acquire) 
+        == atomic_load_explicit(&r->s, memory_order_acquire);
+}
+
+int ring_full(PacketRing* r) {
+    return atomic_load_explicit(&r->e, memory_order_acquire) 
+        - atomic_load_explicit(&r->s, memory_order_acquire) == MAX_MESSAGE_POOL;
+}
+
+void rx_recycle(PktBuf* buf) {
+    IpQueue* q = buf->owner;
+    pktbuf_stack_push(&q->rx.returned, buf);
+}
+
+int in_pool_init(IpQueue* q) {
+    if (ring_init(&q->in_pool, 0, ip.slot_size, IP_RX_BUFFERS) < 0) return -1;  // the input manager blocks on read()
+
+    q->rx.spare = NULL;
+    atomic_store(&q->rx.returned.top, NULL);
+    for (int i = IP_RX_BUFFERS - 1; i >= 0; i--) {
+        pktbuf_init(&q->rx.bufs[i], q->in_pool.arena + i * ip.slot_size, ip.slot_size, rx_recycle, q);
+        if (i < MAX_MESSAGE_POOL) {
+            q->in_pool.pckts[i].buf = &q->rx.bufs[i];
+        } else {
+            q->rx.bufs[i].next = q->rx.spare;
+            q->rx.spare = &q->rx.bufs[i];
+        }
+    }
     return 0;
 }
 
-int in_pool_full() {
-    return (in_pool.e + 1) % MAX_MESSAGE_POOL == in_pool.s;
+int out_pool_init(IpQueue* q) {
+    return ring_init(&q->out_pool, EFD_NONBLOCK, ip.slot_size, MAX_MESSAGE_POOL);    // the traffic manager waits with epoll
+}
+
+/**
+ * Detaches the receive buffer from a consumed in_pool slot, and gives the slot a spare buffer in
+ * its place. Must only be called by the input manager, before the slot is released.
+ * @param slot: slot holding a received packet.
+ * @return the buffer holding the packet with one reference, NULL if there is no spare buffer.
+ */
+PktBuf* rx_detach(IpQueue* q, ip_packet* slot) {
+    if (q->rx.spare == NULL) q->rx.spare = pktbuf_stack_take(&q->rx.returned);
+    PktBuf* spare = q->rx.spare;
+    if (spare == NULL) return NULL;
+    q->rx.spare = spare->next;
+
+    PktBuf* buf = slot->buf;
+    slot->buf = spare;
+    slot->data = spare->head;
+    pktbuf_reset(buf, 0, slot->len);
+    return buf;
+}
+
+/**
+ * Sets the upper layer complete datagrams are passed to. The receiver is called on the input
+ * manager thread, and owns one reference to the buffer, which starts at the IP header.
+ * @param receiver: called for every datagram, NULL to drop them.
+ */
+void ip_set_receiver(void (*receiver)(PktBuf* buf)) {
+    ip.receiver = receiver;
 }
 
-int in_pool_empty() {
-    return in_pool.e == in_pool.s;
+/**
+ * Hands a received datagram to the upper layer, trimming anything read past its total length.
+ */
+void ip_deliver(PktBuf* buf) {
+    if (buf == NULL) return;
+    pktbuf_trim(buf, ((IpHeader *) buf->data)->len);
+    if (ip.receiver != NULL) ip.receiver(buf);
+    else pktbuf_put(buf);
 }
 
-int out_pool_full() {
-    return (out_pool.e + 1) % MAX_MESSAGE_POOL == out_pool.s;
+int in_pool_full(IpQueue* q) {
+    return ring_full(&q->in_pool);
 }
 
+int in_pool_empty(IpQueue* q) {
+    return ring_empty(&q->in_pool);
+}
+
+int out_pool_full(IpQueue* q) {
+    return ring_full(&q->out_pool);
+}
+
+/**
+ * Returns 1 if the out_pools of all queues are empty.
+ */
 int out_pool_empty() {
-    return out_pool.e == out_pool.s;
+    for (unsigned i = 0; i < ip.nqueues; i++)
+        if (!ring_empty(&queues[i].out_pool)) return 0;
+    return 1;
+}
+
+uint16_t hdr_word(IpHeader* hdr, size_t offset) {
+    uint16_t w;
+    memcpy(&w, (char *) hdr + offset, sizeof(w));
+    return w;
+}
+
+/**
+ * Patches the checksum of a header for the words of its fixed part that changed since old was
+ * taken, so a header with a wrong checksum keeps a wrong one.
+ * @param old: the fixed header as it was.
+ */
+void hdr_patch_csum(IpHeader* hdr, const IpHeader* old) {
+    uint16_t csum = hdr->csum;
+    for (size_t off = 0; off < sizeof(IpHeader); off += 2) {
+        if (off == offsetof(IpHeader, csum)) continue;
+        uint16_t was = hdr_word((IpHeader *) old, off), now = hdr_word(hdr, off);
+        if (was != now) csum = csum_update16(csum, was, now);
+    }
+    hdr->csum = csum;
+}
+
+/**
+ * Turns a header read from the device into the form the stack works with: the multi-octet
+ * fields in host byte order, and flags and fragment offset in their bitfields.
+ * @param hdr: header in network byte order, with at least its fixed part readable.
+ */
+void ip_hdr_ntoh(IpHeader* hdr) {
+    IpHeader old = *hdr;
+    uint16_t frag = ntohs(hdr_word(hdr, HDR_FRAG_WORD));
+
+    hdr->len = ntohs(hdr_word(hdr, HDR_LEN_WORD));
+    hdr->id = ntohs(old.id);
+    hdr->flags = frag >> 13;
+    hdr->frag_offset = frag & 0x1fff;
+    hdr->saddr = ntohl(old.saddr);
+    hdr->daddr = ntohl(old.daddr);
+    hdr_patch_csum(hdr, &old);
 }
 
 /**
- * Add new message to the out_pool. Should only be called by the owner of the out_pool.lock
+ * Turns a header of the stack into network byte order, as it goes out on the device. The
+ * reverse of ip_hdr_ntoh.
+ */
+void ip_hdr_hton(IpHeader* hdr) {
+    IpHeader old = *hdr;
+    uint16_t len = htons(old.len);
+    uint16_t id = htons(old.id);
+    uint16_t frag = htons((uint16_t) (old.flags << 13 | old.frag_offset));
+
+    memcpy((char *) hdr + HDR_LEN_WORD, &len, sizeof(len));
+    memcpy((char *) hdr + offsetof(IpHeader, id), &id, sizeof(id));
+    memcpy((char *) hdr + HDR_FRAG_WORD, &frag, sizeof(frag));
+    hdr->saddr = htonl(old.saddr);
+    hdr->daddr = htonl(old.daddr);
+    hdr_patch_csum(hdr, &old);
+}
+
+/**
+ * Add new message to the out_pool of the queue its flow hashes to. The slot holds it as it goes
+ * on the wire, with its header in network byte order. Should only be called by the 
+ * output manager, which is the single producer of the out_pools.
  * @param IpHeader reference to header of package to be sent
  * @param data reference to the data to be attached to the message.
 */
 IpStatus out_pool_append(IpHeader *IpHeader, char *data) {
-    if (out_pool_full()) return IP_ERR_OUT_POOL_FULL;
-    // get checksum
-    char* addr = out_pool.pckts[out_pool.e].data;
+    IpQueue* q = &queues[ip_queue_for(IpHeader)];
+    ip_packet* slot = ring_reserve(&q->out_pool);
+    if (slot == NULL) return IP_ERR_OUT_POOL_FULL;
+    // the checksum is filled in by queue_for_sending
+    char* addr = slot->data;
     memcpy(addr, (void*)IpHeader, IpHeader->ihl * 4);
-    memcpy(addr + IpHeader->ihl * 4, data, IpHeader->len - IpHeader->ihl * 4);
+    slot->data_csum = csum_copy(addr + IpHeader->ihl * 4, data, IpHeader->len - IpHeader->ihl * 4, 0);
+    slot->len = IpHeader->len;
+    slot->payload = NULL;
+    ip_hdr_hton((void *) addr);
 
-    out_pool.e++; 
+    ring_commit(&q->out_pool);
     return IP_SUCCESS;
 }
 
 /**
- * Pops an element of the out_pool, and prints it on std out. This method should only be used for 
- * testing, as it does not provide any error handling.
+ * Add a new message to the out_pool that refers to its payload instead of copying it. Only the 
+ * header is copied into the slot; the traffic manager gathers both with one write.
+ * @param hdr: header of the packet to be sent.
+ * @param payload: payload the packet data lies in, holding a reference for this packet.
+ * @param offset: octet offset of the packet data in the payload.
+ */
+IpStatus out_pool_append_ref(IpHeader* hdr, IpPayload* payload, size_t offset) {
+    IpQueue* q = &queues[ip_queue_for(hdr)];
+    ip_packet* slot = ring_reserve(&q->out_pool);
+    if (slot == NULL) return IP_ERR_OUT_POOL_FULL;
+    memcpy(slot->data, hdr, hdr->ihl * 4);
+    slot->len = hdr->ihl * 4;
+    slot->payload = payload;
+    slot->iov[0].iov_base = slot->data;
+    slot->iov[0].iov_len = slot->len;
+    slot->iov[1].iov_base = payload->data + offset;
+    slot->iov[1].iov_len = hdr->len - hdr->ihl * 4;
+    ip_hdr_hton((IpHeader *) slot->data);
+
+    ring_commit(&q->out_pool);
+    return IP_SUCCESS;
+}
+
+/**
+ * Drops the reference a written out_pool slot holds on its payload, releasing the payload with
+ * the last one.
+ * @param slot: slot that has been written.
+ */
+void slot_put_payload(ip_packet* slot) {
+    IpPayload* payload = slot->payload;
+    if (payload == NULL) return;
+    slot->payload = NULL;
+    if (atomic_fetch_sub_explicit(&payload->refs, 1, memory_order_acq_rel) == 1 && payload->release != NULL)
+        payload->release(payload);
+}
+
+/**
+ * Pops an element of the first non-empty out_pool. This method should only be used for testing, 
+ * as it does not provide any error handling.
  * @param hdr address to which copy the IpHeader data
  * @param data address to which copy the data
 */
 void out_pool_pop(IpHeader* hdr, char* data) {
-    IpHeader* pckt_hdr = (IpHeader *) out_pool.pckts[out_pool.s].data;
-    char* pckt_data = ((char *) out_pool.pckts[out_pool.s].data) + (pckt_hdr->ihl * 4);
-    out_pool.s++;
+    IpQueue* q = queues;
+    while (q < queues + ip.nqueues - 1 && ring_empty(&q->out_pool)) q++;
+    ip_packet* slot = ring_peek(&q->out_pool);
+    IpHeader* pckt_hdr = (IpHeader *) slot->data;
+    ip_hdr_ntoh(pckt_hdr);
+    char* pckt_data = slot->data + (pckt_hdr->ihl * 4);
 
-    u_int8_t l = pckt_hdr->len - pckt_hdr->ihl * 4;
+    uint16_t l = pckt_hdr->len - pckt_hdr->ihl * 4;
 
+    if (slot->payload != NULL) pckt_data = slot->iov[1].iov_base;
     memcpy(hdr, pckt_hdr, pckt_hdr->ihl * 4);
     memcpy(data, pckt_data, l);
+    slot_put_payload(slot);
+    ring_release(&q->out_pool);
 }
 
 
+/**
+ * Sets up the epoll set of the traffic manager: the out_pool wakeup eventfd, plus either the
+ * tun_io completion eventfd or, without tun_io, the tun fd itself (edge triggered).
+ */
+int events_init(IpQueue* q) {
+    struct epoll_event ev = { .events = EPOLLIN };
+
+    if ((q->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) return -1;
+
+    ev.data.fd = q->out_pool.efd;
+    if (epoll_ctl(q->epfd, EPOLL_CTL_ADD, q->out_pool.efd, &ev) < 0) return -1;
+
+    if (q->batched_io) {
+        ev.data.fd = tio_event_fd(&q->tio);
+    } else {
+        if (fcntl(q->fd, F_SETFL, fcntl(q->fd, F_GETFL) | O_NONBLOCK) < 0) return -1;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = q->fd;
+    }
+    return epoll_ctl(q->epfd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+}
+
+/**
+ * Reads the MTU of the tun interface, falling back to IP_DEFAULT_MTU if the interface can't be
+ * queried, and clamps it to IP_MAX_MTU.
+ */
+uint16_t device_mtu() {
+    struct ifreq ifr;
+    int mtu = IP_DEFAULT_MTU;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (sock >= 0) {
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, TUN_IFNAME, IFNAMSIZ - 1);
+        if (ioctl(sock, SIOCGIFMTU, &ifr) == 0) mtu = ifr.ifr_mtu;
+        close(sock);
+    }
+    if (mtu > IP_MAX_MTU) mtu = IP_MAX_MTU;
+    if (mtu < IP_MIN_MTU) mtu = IP_MIN_MTU;
+    return mtu;
+}
+
+/**
+ * Changes the MTU used for fragmenting outgoing packets and reading incoming ones. The pool slots
+ * are sized at ip_init for the device MTU, so the MTU can only be lowered past that.
+ * @param mtu: new MTU in octets.
+ */
+IpStatus ip_set_mtu(uint16_t mtu) {
+    if (mtu < IP_MIN_MTU || mtu > ip.slot_size) return IP_ERR_TOO_LARGE;
+    ip.mtu = mtu;
+    return IP_SUCCESS;
+}
+
+uint16_t ip_get_mtu() {
+    return ip.mtu;
+}
+
+/**
+ * Sets the number of tun queues, each served by its own traffic and input manager. Must be
+ * called before ip_init.
+ * @param n: number of queues, 1 to IP_MAX_QUEUES. With more than one, the device is opened as a
+ * multi-queue tun device.
+ */
+IpStatus ip_set_queues(unsigned n) {
+    if (n < 1 || n > IP_MAX_QUEUES) return IP_ERR_INIT;
+    ip.nqueues = n;
+    return IP_SUCCESS;
+}
+
+unsigned ip_queue_count() {
+    return ip.nqueues;
+}
+
+/**
+ * Returns the 32 bits of the Toeplitz key starting at bit k.
+ */
+uint32_t rss_key_window(const uint8_t* key, int k) {
+    uint64_t w = 0;
+    for (int j = 0; j < 5; j++) w = (w << 8) | key[k / 8 + j];
+    return (uint32_t) (w >> (8 - k % 8));
+}
+
+/**
+ * Fills the Toeplitz tables: rss[i][b] is what octet value b at input position i adds to the
+ * hash, so hashing takes one lookup per input octet instead of one step per bit.
+ */
+void rss_init() {
+    static const uint8_t key[IP_RSS_KEY_LEN] = {
+        0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3,
+        0x8f, 0xb0, 0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3,
+        0x80, 0x30, 0xf2, 0x0c, 0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+    };
+
+    for (int i = 0; i < 8; i++) {
+        for (int b = 0; b < 256; b++) {
+            uint32_t h = 0;
+            for (int bit = 0; bit < 8; bit++)
+                if (b & (0x80 >> bit)) h ^= rss_key_window(key, i * 8 + bit);
+            ip.rss[i][b] = h;
+        }
+    }
+}
+
+/**
+ * Finalizer of splitmix64; every input bit affects every output bit. Keyed hashes xor a random
+ * seed into the input.
+ */
+uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+void sip_round(uint64_t v[4]) {
+    v[0] += v[1]; v[1] = v[1] << 13 | v[1] >> 51; v[1] ^= v[0]; v[0] = v[0] << 32 | v[0] >> 32;
+    v[2] += v[3]; v[3] = v[3] << 16 | v[3] >> 48; v[3] ^= v[2];
+    v[0] += v[3]; v[3] = v[3] << 21 | v[3] >> 43; v[3] ^= v[0];
+    v[2] += v[1]; v[1] = v[1] << 17 | v[1] >> 47; v[1] ^= v[2]; v[2] = v[2] << 32 | v[2] >> 32;
+}
+
+/**
+ * SipHash (Aumasson and Bernstein), a keyed hash: without the key, an attacker can't find inputs
+ * that collide. SipHash-1-3 keys the tables remote hosts fill; SipHash-2-4 is the reference.
+ * @param key: 128 bit secret key.
+ * @param c: compression rounds per 8 octets of input.
+ * @param d: finalization rounds.
+ */
+uint64_t siphash(const uint64_t key[2], const void* data, size_t len, int c, int d) {
+    const uint8_t* p = (const uint8_t *) data;
+    uint64_t v[4] = {
+        key[0] ^ 0x736f6d6570736575ULL, key[1] ^ 0x646f72616e646f6dULL,
+        key[0] ^ 0x6c7967656e657261ULL, key[1] ^ 0x7465646279746573ULL,
+    };
+    size_t end = len & ~(size_t) 7;
+    uint64_t m;
+
+    for (size_t i = 0; i <= end; i += 8) {
+        if (i < end) {                              // little endian words, whatever the host
+            m = 0;
+            for (int j = 7; j >= 0; j--) m = m << 8 | p[i + j];
+        } else {                                    // the last word carries the length
+            m = (uint64_t) len << 56;
+            for (size_t j = 0; j < (len & 7); j++) m |= (uint64_t) p[end + j] << (8 * j);
+        }
+        v[3] ^= m;
+        for (int r = 0; r < c; r++) sip_round(v);
+        v[0] ^= m;
+    }
+    v[2] ^= 0xff;
+    for (int r = 0; r < d; r++) sip_round(v);
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+/**
+ * Toeplitz hash of an address pair. The addresses are ordered before hashing, so both directions
+ * of a flow hash alike.
+ * @param saddr: source address, as found in the header.
+ * @param daddr: target address, as found in the header.
+ */
+uint32_t ip_flow_hash(uint32_t saddr, uint32_t daddr) {
+    uint32_t pair[2] = { saddr < daddr ? saddr : daddr, saddr < daddr ? daddr : saddr };
+    uint8_t* in = (uint8_t *) pair;
+    uint32_t h = 0;
+    for (int i = 0; i < 8; i++) h ^= ip.rss[i][in[i]];
+    return h;
+}
+
+/**
+ * Returns the queue a packet belongs to. Only the addresses are hashed, so all fragments of a
+ * datagram and all packets of a connection, in either direction, map to the same queue.
+ * @param hdr: header of the packet.
+ */
+unsigned ip_queue_for(IpHeader* hdr) {
+    if (ip.nqueues == 1) return 0;
+    return (unsigned) (((uint64_t) ip_flow_hash(hdr->saddr, hdr->daddr) * ip.nqueues) >> 32);
+}
+
+/**
+ * Opens the tun fd of a queue through the clone device. With several queues each one attaches to
+ * the multi-queue device on its own fd.
+ */
+int open_queue(IpQueue* q) {
+    struct ifreq ifr;
+
+    if ((q->fd = open(TUN_CLONE_DEV, O_RDWR | O_CLOEXEC)) < 0) return -1;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, TUN_IFNAME, IFNAMSIZ - 1);
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI | (ip.nqueues > 1 ? IFF_MULTI_QUEUE : 0);
+    return ioctl(q->fd, TUNSETIFF, &ifr);
+}
+
+/**
+ * Opens a queue and sets up its pools, reassembly store, io_uring and epoll set.
+ */
+int queue_init(IpQueue* q, unsigned id) {
+    q->id = id;
+    q->posted_reads = 0;
+    atomic_store(&q->users, 1);                     // the traffic manager
+    atomic_store(&q->read_batch, MAX_CONSECUTIVE_READ);
+    atomic_store(&q->write_batch, MAX_CONSECUTIVE_WRITE);
+    atomic_store(&q->packets_in, 0);
+    atomic_store(&q->packets_out, 0);
+    atomic_store(&q->sleeps, 0);
+    atomic_store(&q->steered, 0);
+    atomic_store(&q->steer_drops, 0);
+
+    if (open_queue(q) < 0) goto err_close;
+    if (in_pool_init(q) < 0) goto err_in_pool;
+    if (out_pool_init(q) < 0 || ras_init(&q->ras) != RAS_SUCCESS) goto err_out_pool;
+
+    struct iovec pools[2] = {
+        { .iov_base = q->in_pool.arena, .iov_len = IP_RX_BUFFERS * ip.slot_size },        // buf_index 0
+        { .iov_base = q->out_pool.arena, .iov_len = MAX_MESSAGE_POOL * ip.slot_size },    // buf_index 1
+    };
+    q->batched_io = tio_init(&q->tio, q->fd, pools, 2) == TIO_SUCCESS;
+
+    q->epfd = -1;
+    if (events_init(q) < 0) goto err_events;
+    return 0;
+
+err_events:
+    close(q->epfd);
+    tio_kill(&q->tio);
+    ras_kill(q->ras);
+    q->ras = NULL;
+err_out_pool:
+    ring_free(&q->out_pool);
+err_in_pool:
+    ring_free(&q->in_pool);
+err_close:
+    close(q->fd);
+    return -1;
+}
+
+/**
+ * Frees everything queue_init set up.
+ */
+void release_queue(IpQueue* q) {
+    tio_kill(&q->tio);
+    ras_kill(q->ras);
+    q->ras = NULL;
+    ring_free(&q->in_pool);
+    ring_free(&q->out_pool);
+    close(q->epfd);
+    close(q->fd);
+}
+
 IpStatus ip_init() {
     atomic_store(&ip.killed, 0);
-    atomic_store(&ip.kill_confirmed, 0);
-
-    /*ip.fd = open(TUN_DEV, O_RDWR);
-    if (ip.fd < 0) {
-        perror("open");
-        return IP_CANT_OPEN_UTUN;
-    }*/
-
-    if(
-           in_pool_init() < 0
-        || out_pool_init() < 0
-        || ras_init() < 0
-    ) { 
-        close(ip.fd); 
-        atomic_store(&ip.killed, 1);
-        return IP_ERR_INIT;
+    csum_init();
+    rss_init();
+    ip.poll = (IpPollConfig) { .busy_poll = 0, .spin_budget_us = 0, .traffic_core = -1, .input_core = -1 };
+
+    ip.mtu = device_mtu();
+    ip.slot_size = (ip.mtu + CACHE_LINE_SIZE - 1) & ~(size_t) (CACHE_LINE_SIZE - 1);
+
+    IpStatus s = IP_ERR_INIT;
+    if ((ip.kill_efd = eventfd(0, EFD_CLOEXEC)) < 0) goto err;
+
+    if (ip.nqueues > 1) {
+        size_t size = ip.nqueues * ip.nqueues * sizeof(SteerRing);
+        if ((steer = aligned_alloc(CACHE_LINE_SIZE, size)) == NULL) {
+            s = IP_MEM_ERR;
+            goto err_kill_efd;
+        }
+        memset(steer, 0, size);
+    }
+
+    for (unsigned i = 0; i < ip.nqueues; i++) {
+        if (queue_init(&queues[i], i) < 0) {
+            while (i-- > 0) release_queue(&queues[i]);
+            goto err_steer;
+        }
     }
+
     return IP_SUCCESS;
+
+err_steer:
+    free(steer);
+    steer = NULL;
+err_kill_efd:
+    close(ip.kill_efd);
+err:
+    atomic_store(&ip.killed, 1);
+    return s;
+}
+
+/**
+ * Sets the run mode of the IP threads. Must be called after ip_init and before the threads are
+ * started.
+ * @param cfg: cores to pin the managers to and busy-poll settings.
+ */
+IpStatus ip_set_poll_config(IpPollConfig* cfg) {
+    ip.poll = *cfg;
+    return IP_SUCCESS;
+}
+
+/**
+ * Copies the current statistics of one queue, including its adaptive batch sizes.
+ * @param queue: index of the queue.
+ * @param stats: where to store the statistics.
+ */
+void ip_get_queue_stats(unsigned queue, IpStats* stats) {
+    IpQueue* q = &queues[queue];
+    stats->read_batch = atomic_load_explicit(&q->read_batch, memory_order_relaxed);
+    stats->write_batch = atomic_load_explicit(&q->write_batch, memory_order_relaxed);
+    stats->packets_in = atomic_load_explicit(&q->packets_in, memory_order_relaxed);
+    stats->packets_out = atomic_load_explicit(&q->packets_out, memory_order_relaxed);
+    stats->sleeps = atomic_load_explicit(&q->sleeps, memory_order_relaxed);
+    stats->steered = atomic_load_explicit(&q->steered, memory_order_relaxed);
+    stats->steer_drops = atomic_load_explicit(&q->steer_drops, memory_order_relaxed);
 }
 
+/**
+ * Copies the current traffic manager statistics, summed over all queues. The batch sizes are the
+ * ones of queue 0.
+ * @param stats: where to store the statistics.
+ */
+void ip_get_stats(IpStats* stats) {
+    IpStats qs;
+
+    ip_get_queue_stats(0, stats);
+    for (unsigned i = 1; i < ip.nqueues; i++) {
+        ip_get_queue_stats(i, &qs);
+        stats->packets_in += qs.packets_in;
+        stats->packets_out += qs.packets_out;
+        stats->sleeps += qs.sleeps;
+        stats->steered += qs.steered;
+        stats->steer_drops += qs.steer_drops;
+    }
+}
+
+/**
+ * Pins the calling thread to the given core.
+ * @param core: id of the core, negative values leave the affinity unchanged.
+ */
+int pin_to_core(int core) {
+    if (core < 0) return 0;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1;
+}
+
+/**
+ * Returns a monotonic timestamp in microseconds.
+ */
+uint64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Adds a manager to the users of a queue, unless the queue has been left by all of them already.
+ * @return 1 if the caller may run on the queue, 0 if it is shutting down.
+ */
+int queue_join(IpQueue* q) {
+    unsigned n = atomic_load(&q->users);
+    do {
+        if (n == 0) return 0;
+    } while (!atomic_compare_exchange_weak(&q->users, &n, n + 1));
+    return 1;
+}
+
+/**
+ * Removes a manager from the users of a queue. The last one out acknowledges on kill_efd.
+ */
+void queue_leave(IpQueue* q) {
+    uint64_t one = 1;
+    if (atomic_fetch_sub(&q->users, 1) == 1) write(ip.kill_efd, &one, sizeof(one));
+}
+
+void release() {
+    for (unsigned i = 0; i < ip.nqueues; i++) release_queue(&queues[i]);
+    free(steer);
+    steer = NULL;
+}
+
+/**
+ * Stops the IP threads, blocks until every manager has left its queue, then releases the queues.
+ * Input managers steer into each other's queues, so nothing is freed before all of them are out.
+ */
 void ip_kill() {
+    uint64_t v, released = 0;
     atomic_store(&ip.killed, 1);
-    while(!atomic_load(&ip.kill_confirmed)) usleep(100);
+    for (unsigned i = 0; i < ip.nqueues; i++) {
+        ring_wake(&queues[i].out_pool);                // wake the traffic manager
+        ring_wake(&queues[i].in_pool);                 // wake the input manager
+    }
+    while (released < ip.nqueues && read(ip.kill_efd, &v, sizeof(v)) == sizeof(v)) released += v;
+    release();
     printf("ip killed");
 }
 
-void release() {
-    ras_kill();
-    atomic_store(&ip.kill_confirmed, 1);
-    close(ip.fd);
+/**
+ * One traffic manager cycle with a syscall per packet. The tun fd is non-blocking and watched
+ * edge triggered, so reads go on until EAGAIN or until the budget runs out.
+ * @param reads: set to the number of packets read.
+ * @param writes: set to the number of packets written.
+ */
+void traffic_cycle(IpQueue* q, unsigned* reads, unsigned* writes) {
+    unsigned r_ctr, w_ctr;
+    unsigned r_max = atomic_load_explicit(&q->read_batch, memory_order_relaxed);
+    unsigned w_max = atomic_load_explicit(&q->write_batch, memory_order_relaxed);
+    ip_packet* slot;
+
+    for (r_ctr = 0; r_ctr < r_max; r_ctr++) {
+        if ((slot = ring_reserve(&q->in_pool)) == NULL) break;
+        ssize_t n = read(q->fd, slot->data, ip.mtu);
+        if (n <= 0) break;
+        slot->len = n;
+        ring_commit(&q->in_pool);
+    }
+
+    for (w_ctr = 0; w_ctr < w_max; w_ctr++) {
+        if ((slot = ring_peek(&q->out_pool)) == NULL) break;
+        if (slot->payload != NULL) writev(q->fd, slot->iov, 2);
+        else write(q->fd, slot->data, slot->len);
+        slot_put_payload(slot);
+        ring_release(&q->out_pool);
+    }
+
+    *reads = r_ctr;
+    *writes = w_ctr;
 }
 
-void* traffic_manager() {
-    int r_ctr, w_ctr;
-    while(!atomic_load(&ip.killed)) {
-        r_ctr = 0;
-        while(r_ctr < MAX_CONSECUTIVE_READ) {
-            if (in_pool_full()) break;
-            char* dstn = in_pool.pckts[in_pool.e].data;
-            in_pool.e++;
-            read(ip.fd, dstn, MTU);
-        }
+#define READ_PENDING ((size_t)-1)   // ip_packet.len of an in_pool slot with a read in flight
+
+/**
+ * One traffic manager cycle on the tun_io backend. Reads are kept in flight on the free in_pool
+ * slots, and every ready out_pool slot is queued for writing; both are handed to the kernel with
+ * a single submission. Reads may complete out of order, so only the completed prefix of the
+ * in_pool is committed. Reads left in flight wake the traffic manager through tio_event_fd.
+ * @param reads: set to the number of packets committed to the in_pool.
+ * @param writes: set to the number of packets written.
+ */
+void batched_traffic_cycle(IpQueue* q, unsigned* reads, unsigned* writes) {
+    uint64_t tags[TIO_QUEUE_DEPTH];
+    int res[TIO_QUEUE_DEPTH];
+    ip_packet* slot;
+
+    *reads = *writes = 0;
 
-        w_ctr = 0;
-        while(w_ctr < MAX_CONSECUTIVE_WRITE) {
-            if (out_pool_empty()) break;
-            write(ip.fd, out_pool.pckts[out_pool.s].data, out_pool.pckts[out_pool.s].len);
-            out_pool.s++;
+    size_t in_e = atomic_load_explicit(&q->in_pool.e, memory_order_relaxed);
+    size_t free = ring_reserve_n(&q->in_pool, atomic_load_explicit(&q->read_batch, memory_order_relaxed));
+    for (; q->posted_reads < free; q->posted_reads++) {
+        slot = ring_slot(&q->in_pool, in_e + q->posted_reads);
+        slot->len = READ_PENDING;
+        if (tio_prep_read(&q->tio, slot->data, ip.mtu, 0, in_e + q->posted_reads) != TIO_SUCCESS) break;
+    }
+
+    size_t out_s = atomic_load_explicit(&q->out_pool.s, memory_order_relaxed);
+    size_t ready = ring_peek_n(&q->out_pool, atomic_load_explicit(&q->write_batch, memory_order_relaxed));
+    size_t queued, written = 0;
+    for (queued = 0; queued < ready; queued++) {
+        slot = ring_slot(&q->out_pool, out_s + queued);
+        uint64_t tag = TIO_WRITE_TAG | (out_s + queued);
+        TioStatus ts = slot->payload != NULL ? tio_prep_writev(&q->tio, slot->iov, 2, tag)
+            : tio_prep_write(&q->tio, slot->data, slot->len, 1, tag);
+        if (ts != TIO_SUCCESS) break;
+    }
+
+    if (tio_submit(&q->tio, queued) != TIO_SUCCESS) return;
+
+    for (;;) {
+        int n = tio_reap(&q->tio, tags, res, TIO_QUEUE_DEPTH);
+        for (int i = 0; i < n; i++) {
+            if (tags[i] & TIO_WRITE_TAG) written++;
+            else ring_slot(&q->in_pool, tags[i])->len = res[i] < 0 ? 0 : res[i];   // empty slots are dropped
         }
+        if (written >= queued) break;
+        if (n == 0 && tio_submit(&q->tio, queued - written) != TIO_SUCCESS) break;
+    }
+    for (size_t i = 0; i < queued; i++) slot_put_payload(ring_slot(&q->out_pool, out_s + i));
+    ring_release_n(&q->out_pool, queued);
 
-        usleep(100);
+    size_t done = 0;
+    while (done < q->posted_reads && ring_slot(&q->in_pool, in_e + done)->len != READ_PENDING) done++;
+    ring_commit_n(&q->in_pool, done);
+    q->posted_reads -= done;
+
+    *reads = done;
+    *writes = queued;
+}
+
+/**
+ * Adapts a batch size to the last cycle: a budget that was used up doubles, one that was less
+ * than half used halves, within [IP_MIN_BATCH, IP_MAX_BATCH].
+ * @param batch: batch size to be adapted.
+ * @param used: number of packets the last cycle moved with it.
+ * @return 1 if the budget was used up.
+ */
+int adapt_batch(atomic_uint* batch, unsigned used) {
+    unsigned b = atomic_load_explicit(batch, memory_order_relaxed);
+    if (used >= b) {
+        if (b < IP_MAX_BATCH) atomic_store_explicit(batch, b * 2 > IP_MAX_BATCH ? IP_MAX_BATCH : b * 2, memory_order_relaxed);
+        return 1;
     }
+    if (used < b / 2 && b > IP_MIN_BATCH)
+        atomic_store_explicit(batch, b / 2 < IP_MIN_BATCH ? IP_MIN_BATCH : b / 2, memory_order_relaxed);
+    return 0;
+}
 
-    release();
+/**
+ * Runs one traffic manager cycle on the active backend and adapts the batch sizes.
+ * @param moved: set to the number of packets moved in either direction.
+ * @return 1 if a budget ran out, so there is likely more work queued.
+ */
+int traffic_step(IpQueue* q, unsigned* moved) {
+    unsigned reads, writes;
+
+    if (q->batched_io) batched_traffic_cycle(q, &reads, &writes);
+    else traffic_cycle(q, &reads, &writes);
+
+    atomic_fetch_add_explicit(&q->packets_in, reads, memory_order_relaxed);
+    atomic_fetch_add_explicit(&q->packets_out, writes, memory_order_relaxed);
+    *moved = reads + writes;
+
+    int busy = adapt_batch(&q->read_batch, reads);
+    return adapt_batch(&q->write_batch, writes) || busy;
+}
+
+/**
+ * Busy-poll mode: keeps running cycles for up to spin_budget_us while nothing moves, so traffic
+ * arriving within the budget is picked up without going through a wakeup.
+ * @return 1 if spinning found work.
+ */
+int traffic_spin(IpQueue* q) {
+    unsigned moved;
+    uint64_t deadline = monotonic_us() + ip.poll.spin_budget_us;
+
+    while (!atomic_load_explicit(&ip.killed, memory_order_relaxed) && monotonic_us() < deadline) {
+        int busy = traffic_step(q, &moved);
+        if (moved) return busy;
+        cpu_relax();
+    }
+    return 0;
+}
+
+/**
+ * Blocks until the traffic manager has something to do. Sleeps indefinitely if the out_pool is
+ * empty and the tun side will raise an event for new packets; returns right away if there is
+ * work left over from the last cycle. If the in_pool is full and no read is in flight, nothing
+ * wakes us when the input manager frees a slot, so we only sleep IP_BACKPRESSURE_WAIT_MS.
+ * @param busy: 1 if the last cycle ran out of budget.
+ */
+void traffic_wait(IpQueue* q, int busy) {
+    struct epoll_event evs[3];
+    uint64_t v;
+    int timeout;
+
+    if (busy || !ring_may_sleep(&q->out_pool)) timeout = 0;
+    else if (q->posted_reads == 0 && in_pool_full(q)) timeout = IP_BACKPRESSURE_WAIT_MS;
+    else timeout = -1;
+
+    if (timeout != 0) atomic_fetch_add_explicit(&q->sleeps, 1, memory_order_relaxed);
+    int n = epoll_wait(q->epfd, evs, 3, timeout);
+    for (int i = 0; i < n; i++)
+        if (evs[i].data.fd != q->fd) read(evs[i].data.fd, &v, sizeof(v));     // reset eventfds
+}
+
+/**
+ * Pins a manager of queue q to its core: queue i runs on core + i.
+ */
+void pin_queue(IpQueue* q, int core) {
+    pin_to_core(core < 0 ? core : core + (int) q->id);
+}
+
+/**
+ * Moves packets between a tun queue and its pools until ip_kill, then leaves the queue.
+ * @param queue: index of the queue, cast to a pointer.
+ */
+void* traffic_manager(void* queue) {
+    IpQueue* q = &queues[(intptr_t) queue];
+    int busy;
+    unsigned moved;
+
+    pin_queue(q, ip.poll.traffic_core);
+
+    while(!atomic_load(&ip.killed)) {
+        busy = traffic_step(q, &moved);
+        if (!busy && ip.poll.busy_poll) busy = traffic_spin(q);
+
+        traffic_wait(q, busy);
+    }
+
+    queue_leave(q);
     return NULL;
 }
 
@@ -198,88 +1171,264 @@ void get_buff_id(IpHeader* hdr, BufId* id) {
     id->saddr = hdr->saddr;
     id->daddr = hdr->daddr;
     id->proto = hdr->proto;
+    id->id = hdr->id;
 }
 
 
-/** 
- * This method takes incoming packets form in_pool, logs them in the reassembly store,
- * and if a packet is complete, passes it to the next level. 
+/**
+ * Logs a fragment in the reassembly store of the queue, and delivers the datagram it completes.
+ * @param packet: fragment, copied by the store.
  */
-void in_traffic_manager() {
-    while(!ip.killed) {
-        while(!in_pool_empty()) {
-            char* packet;
+void reassemble(IpQueue* q, char* packet) {
+    PktBuf* buf = NULL;
+    RasStatus s;
 
-            if (!check_ipv4(packet) && !(check_ipv6(packet))) continue;
+    if ((s = ras_log(q->ras, packet)) == RAS_SUCCESS_RE_COMPLETE) {
+        ras_take_packet(q->ras, (IpHeader *) packet, &buf);   // carries the data checksum for the transport
+    } else if (s != RAS_SUCCESS) {
+        // report error 
+    }
+    ip_deliver(buf);
+}
 
-            IpHeader* hdr = (IpHeader *)packet;
+/**
+ * Passes a packet to the input manager of the queue its flow hashes to. If that queue is too far
+ * behind to take it, the packet is dropped.
+ * @param to: queue the packet belongs to.
+ * @param buf: packet, the reference is handed over.
+ */
+void steer_push(IpQueue* q, IpQueue* to, PktBuf* buf) {
+    if (buf == NULL) return;
+    SteerRing* r = &steer[q->id * ip.nqueues + to->id];
+    size_t e = atomic_load_explicit(&r->e, memory_order_relaxed);
 
-            // check checksum.
+    if (e - atomic_load_explicit(&r->s, memory_order_acquire) == IP_STEER_RING) {
+        pktbuf_put(buf);
+        atomic_fetch_add_explicit(&q->steer_drops, 1, memory_order_relaxed);
+        return;
+    }
+    r->bufs[e & (IP_STEER_RING - 1)] = buf;
+    atomic_store_explicit(&r->e, e + 1, memory_order_release);
+    atomic_fetch_add_explicit(&q->steered, 1, memory_order_relaxed);
 
-            if (!FRAGMENTED(hdr)) {
-                // pass to ip packet queue
-                continue;
-            }
-            RasStatus s;
-            if ((s = ras_log(packet)) == RAS_SUCCESS_RE_COMPLETE) {
-                IpHeader* cmplt_hdr;                   // These need allocated space...
-                char* data;
-                ras_get_packet(cmplt_hdr, data);
-                // pass to ip packet queue
-            } else if (s != RAS_SUCCESS) {
-                // report error 
+    atomic_thread_fence(memory_order_seq_cst);      // pairs with the fence in in_may_sleep
+    if (atomic_load_explicit(&r->s, memory_order_relaxed) == e) ring_wake(&to->in_pool);
+}
+
+/**
+ * Handles the packets other input managers passed to this queue.
+ */
+void steer_drain(IpQueue* q) {
+    for (unsigned from = 0; from < ip.nqueues; from++) {
+        if (from == q->id) continue;
+        SteerRing* r = &steer[from * ip.nqueues + q->id];
+        size_t s = atomic_load_explicit(&r->s, memory_order_relaxed);
+        size_t e = atomic_load_explicit(&r->e, memory_order_acquire);
+
+        for (; s != e; s++) {
+            PktBuf* buf = r->bufs[s & (IP_STEER_RING - 1)];
+            if (FRAGMENTED((IpHeader *) buf->data)) {
+                reassemble(q, buf->data);
+                pktbuf_put(buf);
+            } else {
+                ip_deliver(buf);
             }
         }
-        usleep(100);
+        atomic_store_explicit(&r->s, s, memory_order_release);
+    }
+}
+
+/**
+ * Returns 1 if neither the in_pool nor any steer ring into this queue holds a packet, in which
+ * case the input manager may block on the in_pool efd.
+ */
+int in_may_sleep(IpQueue* q) {
+    if (!ring_may_sleep(&q->in_pool)) return 0;
+    for (unsigned from = 0; steer != NULL && from < ip.nqueues; from++) {
+        SteerRing* r = &steer[from * ip.nqueues + q->id];
+        if (atomic_load_explicit(&r->e, memory_order_relaxed) != atomic_load_explicit(&r->s, memory_order_relaxed))
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Handles one packet read on this queue: drops it if it is malformed, passes it on if its flow
+ * belongs to another queue, and otherwise delivers it or logs it for reassembly.
+ * @param slot: in_pool slot holding the packet, released by the caller.
+ */
+void in_slot(IpQueue* q, ip_packet* slot) {
+    char* packet = slot->data;
+
+    if (slot->len == 0 || !check_ipv4(packet)) return;     // IPv6 is not handled yet
+
+    IpHeader* hdr = (IpHeader *)packet;
+    size_t ihl = (uint8_t) packet[0] & 0xf;
+
+    if (ihl < 5 || ihl * 4 > slot->len || ip_checksum(packet, ihl * 4) != 0)
+        return;                                     // corrupted header
+    ip_hdr_ntoh(hdr);
+    if (hdr->len > slot->len || hdr->len < ihl * 4)
+        return;                                     // truncated, or shorter than its own header
+
+    unsigned target = ip_queue_for(hdr);
+    if (target == q->id && FRAGMENTED(hdr)) {
+        reassemble(q, packet);
+        return;
+    }
+
+    PktBuf* buf;
+    if ((buf = rx_detach(q, slot)) == NULL)         // every spare buffer is held upstream
+        buf = pktbuf_copy(packet, slot->len);
+    if (target != q->id) steer_push(q, &queues[target], buf);
+    else ip_deliver(buf);
+}
+
+/**
+ * Handles a packet on queue 0 as if it had just been read from the device.
+ * @param packet: the datagram as it is on the wire.
+ */
+void in_pool_push(char* packet, size_t len) {
+    IpQueue* q = &queues[0];
+    ip_packet* slot = ring_reserve(&q->in_pool);
+    if (slot == NULL || len > ip.mtu) return;
+    memcpy(slot->data, packet, len);
+    slot->len = len;
+    ring_commit(&q->in_pool);
+    in_slot(q, ring_peek(&q->in_pool));
+    ring_release(&q->in_pool);
+}
+
+/** 
+ * This method takes incoming packets form the in_pool of a queue, logs them in the reassembly 
+ * store, and if a packet is complete, passes it to the next level. Packets whose flow hashes to
+ * another queue are passed to that queue's input manager, so each flow is handled by one thread.
+ * @param queue: index of the queue, cast to a pointer.
+ */
+void* in_traffic_manager(void* queue) {
+    IpQueue* q = &queues[(intptr_t) queue];
+    ip_packet* slot;
+
+    if (!queue_join(q)) return NULL;                // the traffic manager is gone already
+    pin_queue(q, ip.poll.input_core);
+
+    while(!ip.killed) {
+        while((slot = ring_peek(&q->in_pool)) != NULL) {
+            in_slot(q, slot);
+            ring_release(&q->in_pool);
+        }
+        if (steer != NULL) steer_drain(q);
+        if (ip.poll.busy_poll) {
+            uint64_t deadline = monotonic_us() + ip.poll.spin_budget_us;
+            while (in_may_sleep(q) && !ip.killed && monotonic_us() < deadline) cpu_relax();
+        }
+        if (in_may_sleep(q)) {                      // wake up for reassembly timeouts
+            struct pollfd pfd = { .fd = q->in_pool.efd, .events = POLLIN };
+            uint64_t v;
+            if (poll(&pfd, 1, ras_pending(q->ras) ? RAS_TICK_MS : -1) > 0) read(q->in_pool.efd, &v, sizeof(v));
+        }
+        ras_tick(q->ras, monotonic_us());
     }
+    queue_leave(q);
+    return NULL;
+}
+
+/**
+ * Sets the length, flags and fragment offset of a header, and patches its checksum incrementally
+ * instead of recomputing it over the whole header.
+ * @param hdr: header with a valid checksum.
+ */
+void set_fragment(IpHeader* hdr, uint16_t len, uint8_t flags, uint16_t frag_offset) {
+    uint16_t old_len = hdr_word(hdr, HDR_LEN_WORD);
+    uint16_t old_frag = hdr_word(hdr, HDR_FRAG_WORD);
+
+    hdr->len = len;
+    hdr->flags = flags;
+    hdr->frag_offset = frag_offset;
+
+    uint16_t csum = csum_update16(hdr->csum, old_len, hdr_word(hdr, HDR_LEN_WORD));
+    hdr->csum = csum_update16(csum, old_frag, hdr_word(hdr, HDR_FRAG_WORD));
+}
+
+/**
+ * Queues one fragment, copying its data into the slot, or referring to it if ref is set.
+ */
+IpStatus append_fragment(IpHeader* hdr, char* payload_start, size_t offset, IpPayload* ref) {
+    if (ref != NULL) return out_pool_append_ref(hdr, ref, offset);
+    return out_pool_append(hdr, payload_start + offset);
 }
 
 /**
  * Given a header and data pointer, fragments the packet into smaller packets that have smaller size then
- * the MTU.
+ * the MTU. The out_pool is single producer, so this must only be called from the output manager.
  * @param hdr header containing all 'routing information'.
  * @param payload_start pointer to the data chunk associated with the header.
+ * @param ref payload the fragments refer to, NULL to copy the data into the out_pool.
  */
-IpStatus queue_for_sending(IpHeader* hdr, char* payload_start) {
+IpStatus queue_datagram(IpHeader* hdr, char* payload_start, IpPayload* ref) {
 
     IpStatus s;
 
-    if (hdr->len < MTU) {
-        pthread_mutex_lock(&out_pool.lck);
-        if ((s = out_pool_append(hdr, payload_start)) != IP_SUCCESS)
-            return s;
-        pthread_mutex_unlock(&out_pool.lck);
-        return IP_SUCCESS;
+    if (hdr->len <= ip.mtu) {
+        hdr->csum = 0;
+        hdr->csum = ip_checksum(hdr, hdr->ihl * 4);
+        if (ref != NULL) atomic_store_explicit(&ref->refs, 1, memory_order_relaxed);
+        return append_fragment(hdr, payload_start, 0, ref);
     }
 
     if ((hdr->flags & DF_DO_NOT_FRAGMENT) != 0) return IP_ERR_TOO_LARGE; // packet too large but can't be fragmented.
 
     int data_len = hdr->len - hdr->ihl * 4;     // total number of octets of data
-    int nfb = (MTU - hdr->ihl * 4) / 8;         // number of 8 octet blocks per fragment
-    int total_fragments = data_len / (nfb * 8); // total number of fragments
-    int leftover = data_len % (nfb * 8);        // number of octets in the last fragment
+    int nfb = (ip.mtu - hdr->ihl * 4) / 8;      // number of 8 octet blocks per fragment
+    int total_fragments = (data_len - 1) / (nfb * 8); // number of full fragments before the last one
+    int leftover = data_len - total_fragments * nfb * 8; // number of octets in the last fragment
+
+    if (ring_free_slots(&queues[ip_queue_for(hdr)].out_pool) < (size_t) total_fragments + 1)
+        return IP_ERR_OUT_POOL_FULL;            // don't queue a datagram we can't finish
+    if (ref != NULL) atomic_store_explicit(&ref->refs, total_fragments + 1, memory_order_relaxed);
 
     hdr->len = (hdr->ihl * 4) + (nfb * 8);      // new fragment size.
     SET_MORE_FRAGMENTS(hdr);                    // set more_fragments flag to true
+    hdr->frag_offset = 0;
+    hdr->csum = 0;
+    hdr->csum = ip_checksum(hdr, hdr->ihl * 4); // full checksum once, then patched per fragment
 
     int i; 
-    pthread_mutex_lock(&out_pool.lck);
     for (i = 0; i < total_fragments; i++) {
-        hdr->frag_offset = i * nfb;
-        if ((s = out_pool_append(hdr, payload_start + i * nfb * 8)) != IP_SUCCESS)
+        if (i > 0) set_fragment(hdr, hdr->len, hdr->flags, i * nfb);
+        if ((s = append_fragment(hdr, payload_start, i * nfb * 8, ref)) != IP_SUCCESS)
             return s;
     }
         
-    hdr->len = (hdr->ihl * 4) + data_len % (nfb * 8);
-    SET_LAST_FRAGMENT(hdr);
-    hdr->frag_offset = i * nfb;
-    if ((s = out_pool_append(hdr, payload_start + i * nfb * 8)) != IP_SUCCESS)
+    set_fragment(hdr, (hdr->ihl * 4) + leftover, hdr->flags & ~MF_MORE_FRAGMENTS, i * nfb);
+    if ((s = append_fragment(hdr, payload_start, i * nfb * 8, ref)) != IP_SUCCESS)
         return s;
-    pthread_mutex_unlock(&out_pool.lck);
 
     return IP_SUCCESS;
 }
 
+/**
+ * Queues a packet for sending, fragmenting it if needed. The payload is copied into the out_pool,
+ * so the caller can reuse it right away.
+ * @param hdr header containing all 'routing information'.
+ * @param payload_start pointer to the data chunk associated with the header.
+ */
+IpStatus queue_for_sending(IpHeader* hdr, char* payload_start) {
+    return queue_datagram(hdr, payload_start, NULL);
+}
+
+/**
+ * Queues a packet for sending without copying its payload: each fragment carries its header and
+ * a reference into payload->data, and the traffic manager gathers the two with one writev. 
+ * payload->release is called once the last fragment is written. Must only be called from the 
+ * output manager.
+ * @param hdr header containing all 'routing information'.
+ * @param payload payload of the packet, not in use by an earlier send.
+ */
+IpStatus queue_for_sending_zc(IpHeader* hdr, IpPayload* payload) {
+    return queue_datagram(hdr, payload->data, payload);
+}
+
 /**
  * Given a header and data block, prints the content of the packet in human readable form.
  * @param hdr header of the packet
@@ -1,4 +1,7 @@
 #include <stdint.h>
+#include <stdatomic.h>
+
+#include "pktbuf.h"
 
 #ifndef IP
 #define IP
@@ -14,13 +17,25 @@ typedef enum {
 
 void ip_error_message(IpStatus s);
 
-#define MTU 28
+#define IP_DEFAULT_MTU 1500                 // used if the tun interface can't be queried
+#define IP_MAX_MTU 9000                     // jumbo frames
+#define IP_MIN_MTU 28                       // a 20 octet header and one 8 octet fragment block
+
+#define MAX_MESSAGE_POOL 128                // in_pool / out_pool slots, must be a power of two
+#define IP_RX_BUFFERS (2 * MAX_MESSAGE_POOL) // receive buffers, the in_pool slots plus spares for upper layers
+#define CACHE_LINE_SIZE 64
+#define TUN_IFNAME "tun0"
+#define TUN_CLONE_DEV "/dev/net/tun"       // opened once per queue
 
-#define MAX_MESSAGE_POOL 100
-#define TUN_DEV "/dev/tun0"
+#define IP_MAX_QUEUES 8                     // tun queues, each with a traffic and an input manager
+#define IP_STEER_RING 256                   // packets in flight between two input managers, a power of two
+#define IP_RSS_KEY_LEN 40                   // octets of the Toeplitz hash key
 
-#define MAX_CONSECUTIVE_READ    20
+#define MAX_CONSECUTIVE_READ    20          // initial traffic manager batch sizes, adapted at runtime
 #define MAX_CONSECUTIVE_WRITE   20
+#define IP_MIN_BATCH            4
+#define IP_MAX_BATCH            32
+#define IP_BACKPRESSURE_WAIT_MS 1           // traffic manager sleep while the in_pool is full
 
 #define MAX_OUT_POOL_OCCUPY_CYCLES = 30
 
@@ -67,13 +82,48 @@ void ip_error_message(IpStatus s);
 #define IP_SEND_OK          0
 #define IP_CANT_OPEN_UTUN   1
 
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() do {} while (0)
+#endif
+
+typedef struct {
+    int busy_poll;                  // 1 to spin for spin_budget_us before blocking
+    unsigned spin_budget_us;        // how long an idle manager spins before it blocks
+    int traffic_core;               // core the traffic manager is pinned to, -1 for none
+    int input_core;                 // core the input manager is pinned to, -1 for none
+} IpPollConfig;
+
+typedef struct {
+    uint32_t read_batch;            // current read budget of the traffic manager
+    uint32_t write_batch;           // current write budget of the traffic manager
+    uint64_t packets_in;            // packets moved from tun into the in_pool
+    uint64_t packets_out;           // packets written from the out_pool to tun
+    uint64_t sleeps;                // times the traffic manager blocked waiting for events
+    uint64_t steered;               // packets passed to the input manager of another queue
+    uint64_t steer_drops;           // packets dropped because that input manager was too far behind
+} IpStats;
+
 int check_ipv4(char* buff);
 int check_ipv6(char* buff);
 
+/*
+ * Version and header length share the first octet, version in the high nibble as on the wire.
+ * The other fields are in host byte order inside the stack; ip_hdr_ntoh and ip_hdr_hton convert
+ * a header where it is read from or written to the device.
+ */
 typedef struct __attribute__((__packed__))
 {
-    uint8_t ver : 4;                // ip version
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
     uint8_t ihl : 4;                // header length in 32bit words
+    uint8_t ver : 4;                // ip version
+#else
+    uint8_t ver : 4;
+    uint8_t ihl : 4;
+#endif
     uint8_t tos;                    // type of service
     uint16_t len;                   // total length (header + data) in octets
     uint16_t id;                    // 
@@ -88,14 +138,43 @@ typedef struct __attribute__((__packed__))
 
 typedef struct {
     IpHeader IpHeader;
-    char payload[MTU-sizeof(IpHeader)];
+    char payload[];                 // up to the device MTU minus the header
 } ippckt;
 
+/*
+ * Payload sent with queue_for_sending_zc. The queued fragments point into data instead of 
+ * copying it, so data must stay untouched until the traffic manager has written the last of them
+ * and called release.
+ */
+typedef struct IpPayload {
+    char* data;
+    atomic_uint refs;                               // fragments not yet written, set by the IP layer
+    void (*release)(struct IpPayload* payload);     // called once the payload is no longer used, may be NULL
+} IpPayload;
+
+IpStatus ip_set_queues(unsigned n);
+unsigned ip_queue_count();
 IpStatus ip_init();
-void* traffic_manager();
+IpStatus ip_set_mtu(uint16_t mtu);
+uint16_t ip_get_mtu();
+IpStatus ip_set_poll_config(IpPollConfig* cfg);
+void ip_get_stats(IpStats* stats);
+void ip_get_queue_stats(unsigned queue, IpStats* stats);
+uint64_t mix64(uint64_t x);
+uint64_t siphash(const uint64_t key[2], const void* data, size_t len, int c, int d);
+uint32_t ip_flow_hash(uint32_t saddr, uint32_t daddr);
+unsigned ip_queue_for(IpHeader* hdr);
+void ip_hdr_ntoh(IpHeader* hdr);
+void ip_hdr_hton(IpHeader* hdr);
+void* traffic_manager(void* queue);
+void* in_traffic_manager(void* queue);
 void ip_kill();
+int pin_to_core(int core);
+uint64_t monotonic_us();
 IpStatus queue_for_sending(IpHeader* hdr, char* payload_start);
-IpStatus set_packet_target()
+IpStatus queue_for_sending_zc(IpHeader* hdr, IpPayload* payload);
+void ip_set_receiver(void (*receiver)(PktBuf* buf));
+IpStatus set_packet_target();
 
 int ip_empty();
 char* ip_get_packet();
@@ -108,6 +187,7 @@ void release();
 int out_pool_empty();
 IpStatus out_pool_append(IpHeader *IpHeader, char *data);
 void out_pool_pop(IpHeader* hdr, char* data);
+void in_pool_push(char* packet, size_t len);
 
 void print_packet(IpHeader* hdr, char* data);
 
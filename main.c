@@ -1,13 +1,19 @@
 #include "ip.h"
 #include <pthread.h>
+#include <stdint.h>
 #include <unistd.h>
 
 int main() {
 
-    ip_init();
+    IpStatus s = ip_init();
+    if (s != IP_SUCCESS) {
+        ip_error_message(s);
+        return 1;
+    }
 
-    pthread_t t;
-    pthread_create(&t, NULL, traffic_manager, NULL);
+    pthread_t t[IP_MAX_QUEUES];
+    for (unsigned i = 0; i < ip_queue_count(); i++)
+        pthread_create(&t[i], NULL, traffic_manager, (void *) (intptr_t) i);
 
     usleep(1000);
 
@@ -0,0 +1,105 @@
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "mpsc_queue.h"
+
+/**
+ * Initializes an empty queue and creates its wakeup eventfd.
+ * @param q: queue to be initialized.
+ */
+int mpsc_init(MpscQueue* q) {
+    atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&q->head, &q->stub, memory_order_relaxed);
+    q->tail = &q->stub;
+    atomic_store(&q->sleeping, 0);
+    q->efd = eventfd(0, EFD_CLOEXEC);
+    return q->efd < 0 ? -1 : 0;
+}
+
+void mpsc_free(MpscQueue* q) {
+    close(q->efd);
+}
+
+/**
+ * Links a node in behind the current head. Between the exchange and the store of prev->next the
+ * node is not reachable yet; mpsc_pop treats that window as empty, and mpsc_empty as non-empty.
+ */
+void mpsc_link(MpscQueue* q, MpscNode* node) {
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    MpscNode* prev = atomic_exchange_explicit(&q->head, node, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+/**
+ * Appends a node. May be called from any thread. The fence pairs with the one in mpsc_wait:
+ * either the consumer sees the node before it blocks, or we see that it is about to block.
+ * @param node: node to be queued, owned by the queue until it is popped.
+ */
+void mpsc_push(MpscQueue* q, MpscNode* node) {
+    mpsc_link(q, node);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&q->sleeping, memory_order_relaxed)
+        && atomic_exchange_explicit(&q->sleeping, 0, memory_order_relaxed)) {
+        uint64_t one = 1;
+        write(q->efd, &one, sizeof(one));
+    }
+}
+
+/**
+ * Consumer side: takes the oldest node.
+ * @return the node, or NULL if the queue is empty or its next node is still being linked in.
+ */
+MpscNode* mpsc_pop(MpscQueue* q) {
+    MpscNode* tail = q->tail;
+    MpscNode* next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &q->stub) {
+        if (next == NULL) return NULL;
+        q->tail = tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+
+    // tail is the last node linked in; the stub takes its place before it can be handed out
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) return NULL;
+    mpsc_link(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next == NULL) return NULL;
+    q->tail = next;
+    return tail;
+}
+
+/**
+ * Consumer side: returns 1 if no node has been pushed that is not popped yet, including nodes
+ * that are still being linked in.
+ */
+int mpsc_empty(MpscQueue* q) {
+    return q->tail == &q->stub && atomic_load_explicit(&q->head, memory_order_acquire) == &q->stub;
+}
+
+/**
+ * Consumer side: blocks until a node is pushed, unless the queue is non-empty already.
+ */
+void mpsc_wait(MpscQueue* q) {
+    mpsc_wait_timeout(q, -1);
+}
+
+/**
+ * Consumer side: like mpsc_wait, but gives up after timeout_ms.
+ * @param timeout_ms: longest time to block in milliseconds, -1 for no limit.
+ */
+void mpsc_wait_timeout(MpscQueue* q, int timeout_ms) {
+    struct pollfd pfd = { .fd = q->efd, .events = POLLIN };
+    uint64_t v;
+
+    atomic_store_explicit(&q->sleeping, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (mpsc_empty(q) && poll(&pfd, 1, timeout_ms) > 0) read(q->efd, &v, sizeof(v));
+    atomic_store_explicit(&q->sleeping, 0, memory_order_relaxed);
+}
@@ -0,0 +1,35 @@
+#ifndef MPSC_QUEUE
+#define MPSC_QUEUE
+
+#include <stdatomic.h>
+
+#include "ip.h"
+
+/*
+ * Intrusive multi-producer/single-consumer queue (Vyukov). Producers append with one atomic
+ * exchange and never wait for each other or for the consumer; the consumer takes nodes in FIFO
+ * order without any atomic read-modify-write. Queued structures embed an MpscNode.
+ * A consumer that finds the queue empty can block in mpsc_wait; the producer whose push it misses
+ * wakes it through an eventfd.
+ */
+typedef struct MpscNode {
+    _Atomic(struct MpscNode*) next;
+} MpscNode;
+
+typedef struct {
+    _Atomic(MpscNode*) head __attribute__((aligned(CACHE_LINE_SIZE)));    // last node pushed
+    MpscNode* tail __attribute__((aligned(CACHE_LINE_SIZE)));             // next node to pop, consumer only
+    MpscNode stub;                                                          // keeps the list non-empty
+    atomic_int sleeping __attribute__((aligned(CACHE_LINE_SIZE)));        // 1 while the consumer may block
+    int efd;                                                                // consumer wakeup eventfd
+} MpscQueue;
+
+int mpsc_init(MpscQueue* q);
+void mpsc_free(MpscQueue* q);
+void mpsc_push(MpscQueue* q, MpscNode* node);
+MpscNode* mpsc_pop(MpscQueue* q);
+int mpsc_empty(MpscQueue* q);
+void mpsc_wait(MpscQueue* q);
+void mpsc_wait_timeout(MpscQueue* q, int timeout_ms);
+
+#endif
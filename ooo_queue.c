@@ -0,0 +1,84 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "ooo_queue.h"
+
+void ooo_clear(OooQueue* q) {
+    q->n = 0;
+    q->clock = 0;
+}
+
+/**
+ * Records a range that arrived, merging it with the ranges it overlaps or touches. The range it
+ * ends up in becomes the latest.
+ * @param start: first octet of the range.
+ * @param end: octet following the range.
+ * @return false if it would need a range more than the queue holds; nothing is recorded then.
+ */
+bool ooo_add(OooQueue* q, uint32_t start, uint32_t end) {
+    if (!SEQ_LT(start, end)) return true;
+
+    uint32_t i = 0;
+    while (i < q->n && SEQ_LT(q->ranges[i].end, start)) i++;      // ranges entirely below
+
+    uint32_t j = i;
+    while (j < q->n && SEQ_LEQ(q->ranges[j].start, end)) {        // ranges to merge with
+        if (SEQ_LT(q->ranges[j].start, start)) start = q->ranges[j].start;
+        if (SEQ_GT(q->ranges[j].end, end)) end = q->ranges[j].end;
+        j++;
+    }
+
+    if (i == j) {                   // nothing to merge: make room
+        if (q->n == OOO_QUEUE_SIZE) return false;
+        memmove(&q->ranges[i + 1], &q->ranges[i], (q->n - i) * sizeof(SackBlock));
+        memmove(&q->stamps[i + 1], &q->stamps[i], (q->n - i) * sizeof(uint32_t));
+        q->n++;
+    } else if (j > i + 1) {         // several ranges become one
+        memmove(&q->ranges[i + 1], &q->ranges[j], (q->n - j) * sizeof(SackBlock));
+        memmove(&q->stamps[i + 1], &q->stamps[j], (q->n - j) * sizeof(uint32_t));
+        q->n -= j - i - 1;
+    }
+    q->ranges[i] = (SackBlock) { .start = start, .end = end };
+    q->stamps[i] = ++q->clock;
+    return true;
+}
+
+/**
+ * Removes the ranges rcv_nxt reached, all at once: they are contiguous with it, or below it.
+ * @return rcv_nxt moved past them.
+ */
+uint32_t ooo_take(OooQueue* q, uint32_t rcv_nxt) {
+    uint32_t i = 0;
+    while (i < q->n && SEQ_LEQ(q->ranges[i].start, rcv_nxt)) {
+        if (SEQ_GT(q->ranges[i].end, rcv_nxt)) rcv_nxt = q->ranges[i].end;
+        i++;
+    }
+    if (i > 0) {
+        memmove(&q->ranges[0], &q->ranges[i], (q->n - i) * sizeof(SackBlock));
+        memmove(&q->stamps[0], &q->stamps[i], (q->n - i) * sizeof(uint32_t));
+        q->n -= i;
+    }
+    if (q->n == 0) q->clock = 0;
+    return rcv_nxt;
+}
+
+/**
+ * Picks the SACK blocks of an ACK: the latest range first, then the others that grew most
+ * recently (RFC 2018 4).
+ * @param blocks: set to the blocks, room for max.
+ * @return number of blocks.
+ */
+uint8_t ooo_sack(OooQueue* q, SackBlock* blocks, uint8_t max) {
+    uint32_t below = UINT32_MAX;
+    uint8_t k = 0;
+
+    for (; k < max && k < q->n; k++) {
+        uint32_t best = 0;
+        for (uint32_t i = 1; i < q->n; i++) {
+            if (q->stamps[i] < below && (q->stamps[best] >= below || q->stamps[i] > q->stamps[best])) best = i;
+        }
+        blocks[k] = q->ranges[best];
+        below = q->stamps[best];
+    }
+    return k;
+}
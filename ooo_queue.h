@@ -0,0 +1,28 @@
+#ifndef OOO_QUEUE
+#define OOO_QUEUE
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "tcp_options.h"
+
+#define OOO_QUEUE_SIZE 64           // disjoint ranges a connection holds above rcv_nxt
+
+/*
+ * Receiver side record of the data that arrived above rcv_nxt. The data itself is written into
+ * the receive ring at its place; the queue keeps the ranges it covers, sorted, disjoint and never
+ * adjacent, each stamped with when it last grew, so SACK blocks can be reported latest first.
+ */
+typedef struct {
+    SackBlock ranges[OOO_QUEUE_SIZE];
+    uint32_t stamps[OOO_QUEUE_SIZE];
+    uint32_t n;
+    uint32_t clock;                 // stamp of the latest range
+} OooQueue;
+
+void ooo_clear(OooQueue* q);
+bool ooo_add(OooQueue* q, uint32_t start, uint32_t end);
+uint32_t ooo_take(OooQueue* q, uint32_t rcv_nxt);
+uint8_t ooo_sack(OooQueue* q, SackBlock* blocks, uint8_t max);
+
+#endif
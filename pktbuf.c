@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pktbuf.h"
+
+/**
+ * Sets up a buffer over the given memory, empty and unreferenced.
+ * @param buf: buffer to be set up.
+ * @param head: memory of the buffer.
+ * @param size: size of the memory in octets.
+ * @param recycle: called with the buffer when its last reference is dropped.
+ * @param owner: pool the buffer belongs to, left in buf->owner for recycle.
+ */
+void pktbuf_init(PktBuf* buf, char* head, size_t size, void (*recycle)(PktBuf* buf), void* owner) {
+    atomic_store_explicit(&buf->refs, 0, memory_order_relaxed);
+    buf->head = head;
+    buf->data = head;
+    buf->tail = head;
+    buf->end = head + size;
+    buf->csum = 0;
+    buf->csum_valid = 0;
+    buf->recycle = recycle;
+    buf->next = NULL;
+    buf->owner = owner;
+}
+
+/**
+ * Makes the buffer hold len octets after headroom octets, with a single reference to it.
+ * @param buf: buffer to be reset.
+ * @param headroom: octets left in front of the packet.
+ * @param len: length of the packet.
+ */
+void pktbuf_reset(PktBuf* buf, size_t headroom, size_t len) {
+    atomic_store_explicit(&buf->refs, 1, memory_order_relaxed);
+    buf->data = buf->head + headroom;
+    buf->tail = buf->data + len;
+    buf->csum_valid = 0;
+    buf->next = NULL;
+}
+
+void pktbuf_free(PktBuf* buf) {
+    free(buf);
+}
+
+/**
+ * Allocates a buffer holding a copy of the given packet; the fallback when no pooled buffer is
+ * available.
+ * @param data: packet to be copied.
+ * @param len: length of the packet.
+ */
+PktBuf* pktbuf_copy(const char* data, size_t len) {
+    PktBuf* buf = (PktBuf *) malloc(sizeof(PktBuf) + len);
+    if (buf == NULL) return NULL;
+
+    pktbuf_init(buf, (char *) (buf + 1), len, pktbuf_free, NULL);
+    pktbuf_reset(buf, 0, len);
+    memcpy(buf->data, data, len);
+    return buf;
+}
+
+/**
+ * Takes another reference to the buffer.
+ */
+PktBuf* pktbuf_get(PktBuf* buf) {
+    atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+    return buf;
+}
+
+/**
+ * Drops a reference to the buffer, recycling it with the last one.
+ */
+void pktbuf_put(PktBuf* buf) {
+    if (buf != NULL && atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_acq_rel) == 1)
+        buf->recycle(buf);
+}
+
+size_t pktbuf_len(PktBuf* buf) {
+    return buf->tail - buf->data;
+}
+
+size_t pktbuf_headroom(PktBuf* buf) {
+    return buf->data - buf->head;
+}
+
+/**
+ * Strips len octets, e.g. a header that has been processed, off the front of the packet.
+ * @return the new start of the packet, NULL if the packet is shorter than len.
+ */
+char* pktbuf_pull(PktBuf* buf, size_t len) {
+    if (len > pktbuf_len(buf)) return NULL;
+    buf->data += len;
+    return buf->data;
+}
+
+/**
+ * Prepends len octets to the packet, taken from the headroom.
+ * @return the new start of the packet, NULL if the headroom is smaller than len.
+ */
+char* pktbuf_push(PktBuf* buf, size_t len) {
+    if (len > pktbuf_headroom(buf)) return NULL;
+    buf->data -= len;
+    return buf->data;
+}
+
+/**
+ * Cuts the packet down to len octets, e.g. to drop link layer padding.
+ */
+void pktbuf_trim(PktBuf* buf, size_t len) {
+    if (len < pktbuf_len(buf)) buf->tail = buf->data + len;
+}
+
+void pktbuf_stack_push(PktBufStack* s, PktBuf* buf) {
+    PktBuf* top = atomic_load_explicit(&s->top, memory_order_relaxed);
+    do {
+        buf->next = top;
+    } while (!atomic_compare_exchange_weak_explicit(&s->top, &top, buf, memory_order_release, memory_order_relaxed));
+}
+
+/**
+ * Takes every buffer off the stack.
+ * @return the buffers linked through next, NULL if the stack was empty.
+ */
+PktBuf* pktbuf_stack_take(PktBufStack* s) {
+    if (atomic_load_explicit(&s->top, memory_order_relaxed) == NULL) return NULL;
+    return atomic_exchange_explicit(&s->top, NULL, memory_order_acquire);
+}
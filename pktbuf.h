@@ -0,0 +1,51 @@
+#ifndef PKTBUF
+#define PKTBUF
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define PKTBUF_HEADROOM 64          // room in front of a packet for an IPv4 header with options
+
+/*
+ * Reference counted packet buffer. The memory between head and end belongs to the buffer; the
+ * packet occupies [data, tail), leaving headroom in front of it for headers to be prepended and
+ * tailroom behind it. Whoever drops the last reference hands the memory back to its owner through
+ * recycle, which may happen on any thread.
+ */
+typedef struct PktBuf {
+    atomic_uint refs;
+    char* head;                     // start of the buffer memory
+    char* data;                     // first octet of the packet
+    char* tail;                     // one past the last octet of the packet
+    char* end;                      // end of the buffer memory
+    uint32_t csum;                  // partial checksum of the IP payload, if csum_valid
+    uint8_t csum_valid;
+    void (*recycle)(struct PktBuf* buf);    // gives the memory back once refs drops to 0
+    struct PktBuf* next;            // link for free lists, and for queues holding the buffer
+    void* owner;                    // pool the buffer belongs to, for recycle
+} PktBuf;
+
+/*
+ * Stack buffers can be pushed onto from any thread, while a single owner takes them all at once.
+ * Taking everything instead of popping one at a time keeps it free of the ABA problem.
+ */
+typedef struct {
+    _Atomic(PktBuf*) top;
+} PktBufStack;
+
+void pktbuf_init(PktBuf* buf, char* head, size_t size, void (*recycle)(PktBuf* buf), void* owner);
+void pktbuf_reset(PktBuf* buf, size_t headroom, size_t len);
+PktBuf* pktbuf_copy(const char* data, size_t len);
+PktBuf* pktbuf_get(PktBuf* buf);
+void pktbuf_put(PktBuf* buf);
+size_t pktbuf_len(PktBuf* buf);
+size_t pktbuf_headroom(PktBuf* buf);
+char* pktbuf_pull(PktBuf* buf, size_t len);
+char* pktbuf_push(PktBuf* buf, size_t len);
+void pktbuf_trim(PktBuf* buf, size_t len);
+
+void pktbuf_stack_push(PktBufStack* s, PktBuf* buf);
+PktBuf* pktbuf_stack_take(PktBufStack* s);
+
+#endif
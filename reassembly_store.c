@@ -2,8 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdatomic.h>
+#include <sys/random.h>
 
 #include "reassembly_store.h"
+#include "checksum.h"
 
 /**
  * Prints the error message associated with a RasStatus code
@@ -15,74 +18,378 @@ void ras_error_message(RasStatus s) {
         case RAS_MEM_ERR: printf("RAS: Memory error."); break;
         case RAS_ERR_PACKET_NOT_COMPLETE: printf("RAS: Stream exists but not complete."); break;
         case RAS_ERR_PACKET_NOT_FOUND: printf("RAS: Stream not found."); break;
+        case RAS_ERR_SOURCE_LIMIT: printf("RAS: Source exceeded its memory limit."); break;
         case RAS_SUCCESS: break;
         case RAS_SUCCESS_RE_COMPLETE: break;
     }
 }
 
+/*
+ * A datagram is identified by (saddr, daddr, proto, id), as in RFC 791.
+ */
 typedef struct __attribute__((__packed__))
 {
     uint32_t saddr;                 // source address
     uint32_t daddr;                 // target address
     uint8_t proto;                  // protocol
+    uint16_t id;                    // identification
 } BufId;
 
-typedef struct {
-    void* next;           
-    IpHeader* hdr;                     // original packet header
-    BufId* id;                     // buffer id:
+typedef struct re {
+    IpHeader hdr;                   // original packet header
+    BufId id;                       // buffer id
     char* data;                     // data
-    uint8_t bt_len;                 // length of the bit table
-    char* bt;                       // bit table
+    uint64_t* bm;                   // one bit per received 8 octet block, NULL while in order
+    uint16_t received;              // number of distinct 8 octet blocks received
+    uint16_t contig;                // number of blocks received in order from the start
     uint16_t tdl;                   // total data length in 1 byte blocks
-    uint8_t ttl;                    // time to live
-    uint16_t tam;                   // total available memory in 1 byte blocks
+    uint64_t expires;               // tick at which the entry is dropped if still incomplete
+    struct re* tw_next;             // next entry in the same timer wheel slot
+    struct re* tw_prev;             // previous entry in the same timer wheel slot
+    uint32_t tam;                   // total available memory in 1 byte blocks
+    uint8_t size_class;             // size class of data
     uint8_t got_last : 1;           // 1 if got a package with more packets flag not set.
+    uint8_t csum_valid : 1;         // 0 if overlapping fragments made data_csum unusable
+    uint32_t data_csum;             // partial checksum of the data, summed while storing fragments
 } re;
 
-struct {
+typedef struct {
+    uint64_t hash;                  // hash of the entry's BufId
+    re* entry;                      // NULL if the slot is free
+} RasSlot;
+
+/*
+ * Entries and data buffers are recycled instead of freed. Entries are carved out of slabs of
+ * RAS_SLAB_ENTRIES; data buffers come in size classes, each with the bitmap for its blocks
+ * appended, so an entry needs no allocation once the free lists are warm. The store is only 
+ * used by the thread owning it, so the free lists need no locking.
+ */
+#define RAS_SIZE_CLASSES 5
+const uint32_t ras_class_size[RAS_SIZE_CLASSES] = { 256, 1024, 4096, 16384, 65536 };
+
+#define BM_WORDS(octets) (((octets) + 8 * 64 - 1) / (8 * 64))  // bitmap words covering the given octets
+
+/*
+ * A data buffer is preceded by the PktBuf it becomes once the datagram is complete, and by 
+ * PKTBUF_HEADROOM octets for the reassembled header, so ras_take_packet can hand the buffer
+ * over as is.
+ */
+#define RAS_PKTBUF_SIZE ((sizeof(PktBuf) + CACHE_LINE_SIZE - 1) & ~(size_t) (CACHE_LINE_SIZE - 1))
+#define RAS_BUF_PREFIX (RAS_PKTBUF_SIZE + PKTBUF_HEADROOM)
+
+typedef struct RasSlab {
+    struct RasSlab* next;
+    re entries[RAS_SLAB_ENTRIES];
+} RasSlab;
+
+typedef struct {
+    void* free;                     // free buffers, linked through their first word
+    size_t cached;                  // number of buffers on the free list
+} RasSizeClass;
+
+/*
+ * The entries are indexed by an open addressing hash table with linear probing. Removal shifts
+ * the following entries of the probe sequence back, so there are no tombstones and lookups stay
+ * short. The hash is keyed with a random seed, so remote hosts can't pick colliding ids.
+ */
+struct RasStore {
     BufId temp;                    // used to store BufId's temporarily
-    uint8_t entries;                // number of entries in reassembly store
-    re* h;                          // head of the linked list
-} ras;
+    size_t entries;                 // number of entries in reassembly store
+    size_t cap;                     // number of slots in table, a power of two
+    RasSlot* table;
+    uint64_t seed;
+
+    RasSlab* slabs;                 // all slabs, freed at ras_kill
+    re* free_entries;               // free entries, linked through their data pointer
+    RasSizeClass classes[RAS_SIZE_CLASSES];
+    PktBufStack returned;           // handed out buffers dropped by their last user, on any thread
+
+    re* wheel[RAS_WHEEL_SLOTS];     // entries by expiry tick modulo RAS_WHEEL_SLOTS
+    uint64_t tick;                  // last tick swept
+    atomic_ullong expired;
+    atomic_ullong expired_octets;
+
+    atomic_ullong mem;              // bytes held by live entries
+    uint32_t source_mem[RAS_SOURCE_BUCKETS];    // bytes held per bucket of source addresses
+    atomic_ullong evicted;
+    atomic_ullong source_limited;
+};
+
+_Static_assert(RAS_WHEEL_SLOTS * RAS_TICK_MS > RAS_TIMEOUT_MS, "the timer wheel must span the timeout");
+
+/**
+ * Returns the smallest size class that can hold the given number of octets.
+ */
+uint8_t ras_size_class(uint32_t octets) {
+    uint8_t c = 0;
+    while (c < RAS_SIZE_CLASSES - 1 && ras_class_size[c] < octets) c++;
+    return c;
+}
+
+/**
+ * Returns a data buffer to the free list of its size class, unless the list holds
+ * RAS_CACHED_BUFFERS already.
+ */
+void ras_free_buffer(RasStore* rs, char* buf, uint8_t c) {
+    if (rs->classes[c].cached >= RAS_CACHED_BUFFERS) {
+        free(buf - RAS_BUF_PREFIX);
+        return;
+    }
+    memcpy(buf, &rs->classes[c].free, sizeof(void*));
+    rs->classes[c].free = buf;
+    rs->classes[c].cached++;
+}
+
+/**
+ * Recycle callback of handed out buffers; called by whichever thread drops the last reference.
+ */
+void ras_recycle(PktBuf* buf) {
+    RasStore* rs = buf->owner;
+    pktbuf_stack_push(&rs->returned, buf);
+}
+
+/**
+ * Moves the handed out buffers that have been dropped back onto the free lists.
+ */
+void ras_reclaim(RasStore* rs) {
+    PktBuf* buf = pktbuf_stack_take(&rs->returned);
+    while (buf != NULL) {
+        PktBuf* next = buf->next;
+        char* data = (char *) buf + RAS_BUF_PREFIX;
+        ras_free_buffer(rs, data, ras_size_class(buf->end - data));
+        buf = next;
+    }
+}
+
+/**
+ * Takes a data buffer of the given size class, with room for its bitmap, from the free list.
+ */
+char* ras_alloc_buffer(RasStore* rs, uint8_t c) {
+    if (rs->classes[c].free == NULL) ras_reclaim(rs);
+
+    char* buf = rs->classes[c].free;
+    if (buf == NULL) {
+        char* mem = malloc(RAS_BUF_PREFIX + ras_class_size[c] + BM_WORDS(ras_class_size[c]) * sizeof(uint64_t));
+        return mem == NULL ? NULL : mem + RAS_BUF_PREFIX;
+    }
 
-BufId* temp_id;
+    memcpy(&rs->classes[c].free, buf, sizeof(void*));
+    rs->classes[c].cached--;
+    return buf;
+}
+
+/**
+ * Takes an entry from the free list, carving a new slab if it is empty.
+ */
+re* ras_alloc_entry(RasStore* rs) {
+    if (rs->free_entries == NULL) {
+        RasSlab* slab = (RasSlab *) malloc(sizeof(RasSlab));
+        if (slab == NULL) return NULL;
+        slab->next = rs->slabs;
+        rs->slabs = slab;
+        for (int i = 0; i < RAS_SLAB_ENTRIES; i++) {
+            slab->entries[i].data = (char *) rs->free_entries;
+            rs->free_entries = &slab->entries[i];
+        }
+    }
+    re* entry = rs->free_entries;
+    rs->free_entries = (re *) entry->data;
+    return entry;
+}
+
+/**
+ * Creates a reassembly store. A store must only be used by one thread, except for ras_get_stats.
+ * @param store: set to the new store.
+ */
+RasStatus ras_init(RasStore** store) {
+    RasStore* rs = (RasStore *) calloc(1, sizeof(RasStore));
+    if (rs == NULL) return RAS_MEM_ERR;
+    *store = rs;
+
+    rs->entries = 0;
+    rs->slabs = NULL;
+    rs->free_entries = NULL;
+    memset(rs->classes, 0, sizeof(rs->classes));
+    atomic_store(&rs->returned.top, NULL);
+    memset(rs->wheel, 0, sizeof(rs->wheel));
+    rs->tick = monotonic_us() / (RAS_TICK_MS * 1000);
+    atomic_store(&rs->expired, 0);
+    atomic_store(&rs->expired_octets, 0);
+    atomic_store(&rs->mem, 0);
+    memset(rs->source_mem, 0, sizeof(rs->source_mem));
+    atomic_store(&rs->evicted, 0);
+    atomic_store(&rs->source_limited, 0);
+    rs->cap = RAS_INITIAL_SLOTS;
+    rs->table = (RasSlot *) calloc(rs->cap, sizeof(RasSlot));
+    if (rs->table == NULL) {
+        free(rs);
+        return RAS_MEM_ERR;
+    }
+
+    if (getrandom(&rs->seed, sizeof(rs->seed), 0) != sizeof(rs->seed))
+        rs->seed = (uint64_t) (uintptr_t) rs ^ monotonic_us();
+
+    return RAS_SUCCESS;
+}
+
+/**
+ * Frees the store and everything in it. Buffers handed out by ras_take_packet must have been
+ * dropped before.
+ */
+void ras_kill(RasStore* rs) {
+    if (rs == NULL) return;
+    for (size_t i = 0; i < rs->cap; i++) {
+        if (rs->table[i].entry != NULL) free(rs->table[i].entry->data - RAS_BUF_PREFIX);
+    }
+    free(rs->table);
+    rs->table = NULL;
+    rs->entries = 0;
+    memset(rs->wheel, 0, sizeof(rs->wheel));
+    atomic_store(&rs->mem, 0);
+    memset(rs->source_mem, 0, sizeof(rs->source_mem));
+
+    ras_reclaim(rs);
+    for (int c = 0; c < RAS_SIZE_CLASSES; c++) {
+        char* buf = rs->classes[c].free;
+        while (buf != NULL) {
+            char* next;
+            memcpy(&next, buf, sizeof(void*));
+            free(buf - RAS_BUF_PREFIX);
+            buf = next;
+        }
+        rs->classes[c].free = NULL;
+        rs->classes[c].cached = 0;
+    }
 
+    while (rs->slabs != NULL) {
+        RasSlab* next = rs->slabs->next;
+        free(rs->slabs);
+        rs->slabs = next;
+    }
+    free(rs);
+}
+
+/**
+ * Keyed hash of a buffer id.
+ * @param id: buffer id to be hashed.
+ */
+uint64_t ras_hash(RasStore* rs, BufId* id) {
+    uint64_t addrs = ((uint64_t) id->saddr << 32) | id->daddr;
+    uint64_t rest = ((uint64_t) id->id << 8) | id->proto;
+    return mix64(mix64(addrs ^ rs->seed) ^ rest);
+}
 
-RasStatus ras_init() {
-    temp_id = (BufId*)malloc(sizeof(BufId));
-    if (temp_id < 0) return RAS_MEM_ERR;
-    ras.entries = 0;
+/*
+ * Memory is accounted per entry: the entry itself plus its data buffer and bitmap. Sources are
+ * hashed into RAS_SOURCE_BUCKETS buckets with the same seed as the table, each limited to
+ * RAS_SOURCE_LIMIT bytes; sources sharing a bucket share its limit.
+ */
 
+/**
+ * Returns the number of bytes a data buffer of the given size class takes.
+ */
+size_t ras_buffer_bytes(uint8_t c) {
+    return RAS_BUF_PREFIX + ras_class_size[c] + BM_WORDS(ras_class_size[c]) * sizeof(uint64_t);
+}
+
+uint32_t* ras_source(RasStore* rs, uint32_t saddr) {
+    return &rs->source_mem[mix64(saddr ^ rs->seed) & (RAS_SOURCE_BUCKETS - 1)];
+}
+
+/**
+ * Charges memory to a source, unless that would take it over RAS_SOURCE_LIMIT.
+ * @param saddr: source address of the datagram.
+ * @param bytes: bytes to be allocated.
+ */
+RasStatus ras_charge(RasStore* rs, uint32_t saddr, size_t bytes) {
+    uint32_t* src = ras_source(rs, saddr);
+    if (*src + bytes > RAS_SOURCE_LIMIT) {
+        atomic_fetch_add_explicit(&rs->source_limited, 1, memory_order_relaxed);
+        return RAS_ERR_SOURCE_LIMIT;
+    }
+    *src += bytes;
+    atomic_fetch_add_explicit(&rs->mem, bytes, memory_order_relaxed);
     return RAS_SUCCESS;
 }
 
-void free_re(re* entry) {
-    free(entry->next);
-    free(entry->data);
-    free(entry->bt);
-    free(entry);
+void ras_uncharge(RasStore* rs, uint32_t saddr, size_t bytes) {
+    *ras_source(rs, saddr) -= bytes;
+    atomic_fetch_sub_explicit(&rs->mem, bytes, memory_order_relaxed);
+}
+
+/**
+ * Recycles an entry, whose data buffer has been recycled or handed out.
+ */
+void ras_release_entry(RasStore* rs, re* entry) {
+    ras_uncharge(rs, entry->id.saddr, sizeof(re) + ras_buffer_bytes(entry->size_class));
+    entry->data = (char *) rs->free_entries;
+    rs->free_entries = entry;
+}
+
+/**
+ * Recycles an entry and its data buffer.
+ */
+void free_re(RasStore* rs, re* entry) {
+    ras_free_buffer(rs, entry->data, entry->size_class);
+    ras_release_entry(rs, entry);
 }
 
-void ras_kill() {
-    re* current = (re *) ras.h;
-    while (current != NULL) {
-        re* next = (re *) current->next;
-        free_re(current);
-        current = next;
+/**
+ * Finds the slot holding the entry with the given id.
+ * @param id: buffer id to look for.
+ * @param hash: ras_hash(rs, id).
+ * @return index of the slot, or of the free slot ending the probe sequence if not found.
+ */
+size_t ras_find(RasStore* rs, BufId* id, uint64_t hash) {
+    size_t mask = rs->cap - 1;
+    size_t i = hash & mask;
+    while (rs->table[i].entry != NULL) {
+        if (rs->table[i].hash == hash && memcmp(&rs->table[i].entry->id, id, sizeof(BufId)) == 0) break;
+        i = (i + 1) & mask;
     }
+    return i;
 }
 
-int reassembly_store_empty() {
-    return ras.entries == 0;
+/**
+ * Doubles the table once it is half full.
+ */
+RasStatus ras_grow(RasStore* rs) {
+    size_t old_cap = rs->cap;
+    RasSlot* old = rs->table;
+    RasSlot* table = (RasSlot *) calloc(old_cap * 2, sizeof(RasSlot));
+    if (table == NULL) return RAS_MEM_ERR;
+
+    rs->table = table;
+    rs->cap = old_cap * 2;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].entry == NULL) continue;
+        size_t j = old[i].hash & (rs->cap - 1);
+        while (table[j].entry != NULL) j = (j + 1) & (rs->cap - 1);
+        table[j] = old[i];
+    }
+    free(old);
+    return RAS_SUCCESS;
 }
 
-void print_ras_entires() {
-    re* current = (re *) ras.h;
-    while (current != NULL) {
-        re* next = (re *) current->next;
-        
+/**
+ * Removes the entry in slot i from the table, shifting back entries whose probe sequence passes 
+ * through i. Does not free the entry.
+ * @param i: index of an occupied slot.
+ */
+void ras_remove(RasStore* rs, size_t i) {
+    size_t mask = rs->cap - 1;
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (rs->table[j].entry == NULL) break;
+        size_t home = rs->table[j].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {   // slot i lies on j's probe sequence
+            rs->table[i] = rs->table[j];
+            i = j;
+        }
     }
+    rs->table[i].entry = NULL;
+    rs->entries--;
 }
 
 /**
@@ -95,121 +402,295 @@ void get_BufId(IpHeader* hdr, BufId* id) {
     id->saddr = hdr->saddr;
     id->daddr = hdr->daddr;
     id->proto = hdr->proto;
+    id->id = hdr->id;
 }
 
-/**
- * Allocate a new reassembly entry. Upon receiving a packet that has no 
- * resources assigned to it, allocated sufficient memory for storing a 
- * packet of pre-defined size; with provided buffer id.
- * @param id: buffer id of the datagram to be reassembled.
+/*
+ * Incomplete datagrams expire through a hashed timer wheel of RAS_WHEEL_SLOTS slots, each a
+ * doubly linked list of entries. Arming and cancelling are O(1), and a tick only looks at one slot.
+ * The wheel spans the timeout, so a slot only holds entries due on the same tick.
  */
-RasStatus ras_new_datagram(BufId* id) {
-    BufId *local_id = (BufId*) malloc(sizeof(BufId));                // Make a local copy of the buffer id.
-    memcpy(local_id, id, 72);
-    
-    re* new_re = (re *) malloc(sizeof(re));                             // Allocate a new reassembly entry.
-    if (new_re == NULL) return RAS_MEM_ERR;
 
-    new_re->next = ras.h;
+/**
+ * Puts an entry on the timer wheel, to expire RAS_TIMEOUT_MS after the current tick.
+ * @param entry: entry to arm.
+ */
+void ras_arm(RasStore* rs, re* entry) {
+    entry->expires = rs->tick + (RAS_TIMEOUT_MS + RAS_TICK_MS - 1) / RAS_TICK_MS;
+    re** head = &rs->wheel[entry->expires & (RAS_WHEEL_SLOTS - 1)];
+    entry->tw_prev = NULL;
+    entry->tw_next = *head;
+    if (*head != NULL) (*head)->tw_prev = entry;
+    *head = entry;
+}
 
-    new_re->hdr = (IpHeader *) malloc(sizeof(IpHeader));                      // Allocate header
-    if (new_re->hdr == NULL) return RAS_MEM_ERR;
+/**
+ * Takes an entry off the timer wheel.
+ * @param entry: armed entry.
+ */
+void ras_cancel(RasStore* rs, re* entry) {
+    if (entry->tw_prev != NULL) entry->tw_prev->tw_next = entry->tw_next;
+    else rs->wheel[entry->expires & (RAS_WHEEL_SLOTS - 1)] = entry->tw_next;
+    if (entry->tw_next != NULL) entry->tw_next->tw_prev = entry->tw_prev;
+}
 
-    new_re->id = local_id;
+/**
+ * Allocate a new reassembly entry. Upon receiving a packet that has no 
+ * resources assigned to it, picks a buffer size from the fragment: the last fragment gives the
+ * exact length, any other fragment is assumed to be followed by at least one more of its size.
+ * @param id: buffer id of the datagram to be reassembled.
+ * @param slot: free slot of the table, as returned by ras_find, to store the entry in.
+ * @param first: header of the first fragment received.
+ * @param entry: set to the new entry.
+ */
+RasStatus ras_new_datagram(RasStore* rs, BufId* id, size_t slot, IpHeader* first, re** entry) {
+    uint32_t dl8 = first->len - first->ihl * 4;
+    uint32_t expected = first->frag_offset * 8 + dl8 * (GET_MORE_FRAGMENTS(first) ? 2 : 1);
+    uint8_t c = ras_size_class(expected < MIN_PACKET_SIZE ? MIN_PACKET_SIZE : expected);
+
+    RasStatus s;
+    if ((s = ras_charge(rs, id->saddr, sizeof(re) + ras_buffer_bytes(c))) != RAS_SUCCESS) return s;
+
+    re* new_re = ras_alloc_entry(rs);                                     // Allocate a new reassembly entry.
+    char* data = new_re == NULL ? NULL : ras_alloc_buffer(rs, c);
+    if (data == NULL) {
+        if (new_re != NULL) {
+            new_re->data = (char *) rs->free_entries;
+            rs->free_entries = new_re;
+        }
+        ras_uncharge(rs, id->saddr, sizeof(re) + ras_buffer_bytes(c));
+        return RAS_MEM_ERR;
+    }
 
-    new_re->data = (char *) malloc(sizeof(char) * 8 * MIN_PACKET_SIZE); // Allocate minimum requirement
-    if (new_re->data == NULL) return RAS_MEM_ERR;
+    memcpy(&new_re->id, id, sizeof(BufId));
+    new_re->size_class = c;
+    new_re->data = data;
 
-    new_re->bt_len = (MIN_PACKET_SIZE / 8 + (MIN_PACKET_SIZE % 8) != 0);
-    new_re->bt = (char *) malloc(sizeof(char) * new_re->bt_len);       // Allocate bit table
-    if (new_re->bt == NULL) return RAS_MEM_ERR;
+    new_re->bm = NULL;                                                  // Only needed once fragments arrive out of order
+    new_re->received = 0;
+    new_re->contig = 0;
 
     new_re->tdl = 0;
-    // todo: time to live
-    new_re->tam = MIN_PACKET_SIZE;                                      // Set total data 
+    new_re->got_last = 0;
+    new_re->data_csum = 0;
+    new_re->csum_valid = 1;
+    ras_arm(rs, new_re);
+    new_re->tam = ras_class_size[new_re->size_class];                   // Set total data 
     
-    ras.h = new_re;
+    rs->table[slot].hash = ras_hash(rs, id);
+    rs->table[slot].entry = new_re;
+    rs->entries++;
+    *entry = new_re;
 
     return RAS_SUCCESS;
 }
 
+/**
+ * Starts using the bitmap appended to the data buffer of an entry.
+ * @param entry: entry whose fragments stopped arriving in order.
+ */
+void ras_init_bitmap(re* entry) {
+    entry->bm = (uint64_t *) (entry->data + entry->tam);
+    memset(entry->bm, 0, BM_WORDS(entry->tam) * sizeof(uint64_t));
+}
+
 /**
  * Extend the data memory of a given reassembly entry, to size total_data_length.
  * @param entry: Entry to be extended
  */
-RasStatus ras_extend_re(re* entry) {
-    char* new_data_store = malloc(entry->tdl * sizeof(char));
-    if (new_data_store == NULL) return RAS_MEM_ERR;
+RasStatus ras_extend_re(RasStore* rs, re* entry) {
+    uint8_t c = ras_size_class(entry->tdl);
+    size_t grown = ras_buffer_bytes(c) - ras_buffer_bytes(entry->size_class);
 
+    RasStatus s;
+    if ((s = ras_charge(rs, entry->id.saddr, grown)) != RAS_SUCCESS) return s;
+
+    char* new_data_store = ras_alloc_buffer(rs, c);
+    if (new_data_store == NULL) {
+        ras_uncharge(rs, entry->id.saddr, grown);
+        return RAS_MEM_ERR;
+    }
+
+    uint32_t tam = ras_class_size[c];
     memcpy(new_data_store, entry->data, entry->tam);
-    free(entry->data);
-    entry->data = new_data_store;    
-    entry->tam = entry->tdl;
+    if (entry->bm != NULL) {
+        uint64_t* bm = (uint64_t *) (new_data_store + tam);
+        size_t words = BM_WORDS(entry->tam);
+        memcpy(bm, entry->bm, words * sizeof(uint64_t));
+        memset(bm + words, 0, (BM_WORDS(tam) - words) * sizeof(uint64_t));
+        entry->bm = bm;
+    }
 
-    // extend bit table
-    uint8_t new_bt_len = entry->tdl / 8 + (entry->tdl % 8 != 0);
-    char* new_bt = malloc(new_bt_len * sizeof(char));
-    if (new_bt == NULL) return RAS_MEM_ERR;
-    memcpy(new_bt, entry->bt, entry->bt_len);
-    char* old_bt = entry->bt;
-    entry->bt = new_bt;
-    free(old_bt);
+    ras_free_buffer(rs, entry->data, entry->size_class);
+    entry->data = new_data_store;    
+    entry->size_class = c;
+    entry->tam = tam;
 
     return RAS_SUCCESS;
 }
 
 /**
- * Log the received octets in the bit table
- * @param entry entry to set the bit table of
- * @param start id of starting octet
- * @param len number of octets to register as received
+ * Marks a range of 8 octet blocks as received in the bitmap, a word at a time.
+ * @param entry entry to set the bitmap of
+ * @param start id of the first block
+ * @param len number of blocks to mark
+ * @return number of blocks in the range that weren't marked before
  */
-void log_bit_table(re* entry, int start, int len) {
-    for (int i = 0; i < len; i++) {
-        *(entry->bt + (start + i) / 8) |= 1 << (7 - (start + i) % 8);
+uint16_t bitmap_set_range(re* entry, size_t start, size_t len) {
+    size_t end = start + len;
+    uint16_t fresh = 0;
+
+    while (start < end) {
+        size_t bit = start % 64;
+        size_t n = end - start < 64 - bit ? end - start : 64 - bit;
+        uint64_t mask = (n == 64 ? ~0ULL : (1ULL << n) - 1) << bit;
+        uint64_t* word = entry->bm + start / 64;
+
+        fresh += __builtin_popcountll(mask & ~*word);
+        *word |= mask;
+        start += n;
     }
+    return fresh;
 }
 
 /**
- * Checks whether the bit table of a re entry is complete.
- * @param entry entry to check the bit table of
+ * Checks whether every block of a re entry has been received. Needs the last fragment to know 
+ * the total length; after that it is a single comparison.
+ * @param entry entry to check
  */
 int re_complete(re* entry) {
-    uint8_t chunks = entry->tdl / 8 + (entry->tdl % 8 != 0);
-    for (int i = 0; i < chunks; i++) {
-        if ((*(entry->bt + i / 8) & (1 << (7- i % 8))) == 0) return 0;
-    }
-    return 1;
+    return entry->got_last && entry->received == (entry->tdl + 7) / 8;
 }
 
 /**
  * Upon a provided hdr, the function *completes the header from the fully re-
  * covered header that is stored, and load the associated data into data.
+ * The entry is removed from the store once its data has been handed out.
  * @param hdr IpHeader specifying which message stream the caller is asking for
  * @param data location where the stored data is going to be copied.
+ * @param data_csum if not NULL, set to the partial checksum (csum_partial) of the data.
  */
-RasStatus ras_get_packet(IpHeader* hdr, char* data) {
-    BufId* id  = malloc(sizeof(BufId));
-    if (id == NULL) return RAS_MEM_ERR;
-    get_BufId(hdr, id);
+RasStatus ras_get_packet(RasStore* rs, IpHeader* hdr, char* data, uint32_t* data_csum) {
+    PktBuf* buf;
+    RasStatus s;
+    if ((s = ras_take_packet(rs, hdr, &buf)) != RAS_SUCCESS) return s;
+
+    memcpy(hdr, buf->data, sizeof(IpHeader));
+    memcpy(data, buf->data + sizeof(IpHeader), pktbuf_len(buf) - sizeof(IpHeader));
+    if (data_csum != NULL) *data_csum = buf->csum;
+    pktbuf_put(buf);
+
+    return RAS_SUCCESS;
+}
 
-    re* current = ras.h;
-    while (current != NULL && memcmp(id, current->id, sizeof(BufId)))
-        current = current->next;
+/**
+ * Hands the data buffer of a complete datagram over to the caller, without copying it. The 
+ * buffer holds the reassembled datagram: a 20 octet header (options are not kept) followed by
+ * the data, whose partial checksum is in buf->csum. The entry is removed from the store, and the
+ * buffer comes back to it once the last reference is dropped.
+ * @param hdr IpHeader specifying which message stream the caller is asking for
+ * @param buf set to the buffer, holding one reference for the caller.
+ */
+RasStatus ras_take_packet(RasStore* rs, IpHeader* hdr, PktBuf** buf) {
+    get_BufId(hdr, &rs->temp);
+    size_t slot = ras_find(rs, &rs->temp, ras_hash(rs, &rs->temp));
 
+    re* current = rs->table[slot].entry;
     if (current == NULL) return RAS_ERR_PACKET_NOT_FOUND;
     if (!re_complete(current)) return RAS_ERR_PACKET_NOT_COMPLETE;
 
-    current->hdr->len = current->hdr->ihl * 4 +current->tdl;                // Fix flags that could have changed.
-    current->hdr->frag_offset = 0;
-    current->hdr->flags = 0b000;
-
-    memcpy(hdr, current->hdr, sizeof(IpHeader));                               // Here we rather need to pass the ownership of these on...                         
-    memcpy(data, current->data, current->tdl);
+    current->hdr.ihl = sizeof(IpHeader) / 4;
+    current->hdr.len = sizeof(IpHeader) + current->tdl;                      // Fix flags that could have changed.
+    current->hdr.frag_offset = 0;
+    current->hdr.flags = 0b000;
+    current->hdr.csum = 0;
+    current->hdr.csum = ip_checksum(&current->hdr, sizeof(IpHeader));
+
+    PktBuf* b = (PktBuf *) (current->data - RAS_BUF_PREFIX);
+    pktbuf_init(b, (char *) b + RAS_PKTBUF_SIZE, PKTBUF_HEADROOM + ras_class_size[current->size_class], ras_recycle, rs);
+    pktbuf_reset(b, PKTBUF_HEADROOM, current->tdl);
+    memcpy(pktbuf_push(b, sizeof(IpHeader)), &current->hdr, sizeof(IpHeader));
+    b->csum = current->csum_valid ? current->data_csum : csum_partial(current->data, current->tdl, 0);
+    b->csum_valid = 1;
+    *buf = b;
+
+    ras_remove(rs, slot);
+    ras_cancel(rs, current);
+    ras_release_entry(rs, current);
 
     return RAS_SUCCESS;
 }
 
+/**
+ * Drops an incomplete datagram from the store.
+ * @param entry: entry to be dropped.
+ */
+void ras_drop(RasStore* rs, re* entry) {
+    ras_cancel(rs, entry);
+    ras_remove(rs, ras_find(rs, &entry->id, ras_hash(rs, &entry->id)));
+    free_re(rs, entry);
+}
+
+/**
+ * Drops the oldest datagrams until the store holds no more than RAS_MEM_LOW bytes. The timeout
+ * is the same for every entry and the wheel spans it, so walking the wheel from the current
+ * tick visits entries in the order they arrived.
+ */
+void ras_evict(RasStore* rs) {
+    for (uint64_t t = rs->tick + 1; t <= rs->tick + RAS_WHEEL_SLOTS; t++) {
+        re** head = &rs->wheel[t & (RAS_WHEEL_SLOTS - 1)];
+        while (*head != NULL) {
+            if (atomic_load_explicit(&rs->mem, memory_order_relaxed) <= RAS_MEM_LOW) return;
+            atomic_fetch_add_explicit(&rs->evicted, 1, memory_order_relaxed);
+            ras_drop(rs, *head);
+        }
+    }
+}
+
+/**
+ * Advances the timer wheel to the given time, dropping every incomplete datagram whose timeout
+ * has passed. Cheap when called more often than once per tick.
+ * @param now_us: current time, as returned by monotonic_us().
+ */
+void ras_tick(RasStore* rs, uint64_t now_us) {
+    uint64_t target = now_us / (RAS_TICK_MS * 1000);
+    if (target > rs->tick + RAS_WHEEL_SLOTS)                            // One revolution sees every slot
+        rs->tick = target - RAS_WHEEL_SLOTS;
+
+    while (rs->tick < target) {
+        rs->tick++;
+        re* entry = rs->wheel[rs->tick & (RAS_WHEEL_SLOTS - 1)];
+        while (entry != NULL) {
+            re* next = entry->tw_next;
+            if (entry->expires <= rs->tick) {
+                atomic_fetch_add_explicit(&rs->expired, 1, memory_order_relaxed);
+                atomic_fetch_add_explicit(&rs->expired_octets, entry->received * 8, memory_order_relaxed);
+                ras_drop(rs, entry);
+            }
+            entry = next;
+        }
+    }
+}
+
+/**
+ * Returns 1 if the store holds incomplete datagrams, that ras_tick may have to expire.
+ */
+int ras_pending(RasStore* rs) {
+    return rs->entries > 0;
+}
+
+/**
+ * Copies the reassembly statistics. Safe to call from any thread.
+ * @param stats: where to store the statistics.
+ */
+void ras_get_stats(RasStore* rs, RasStats* stats) {
+    stats->expired = atomic_load_explicit(&rs->expired, memory_order_relaxed);
+    stats->expired_octets = atomic_load_explicit(&rs->expired_octets, memory_order_relaxed);
+    stats->evicted = atomic_load_explicit(&rs->evicted, memory_order_relaxed);
+    stats->source_limited = atomic_load_explicit(&rs->source_limited, memory_order_relaxed);
+    stats->mem = atomic_load_explicit(&rs->mem, memory_order_relaxed);
+}
+
 /**
  * Stores the given packet in the given entry. Copies the contents of
  * packet into the memory allocated for the reassembly of a packet.
@@ -219,31 +700,48 @@ RasStatus ras_get_packet(IpHeader* hdr, char* data) {
  * eration was successful, but the package is not yet complete. If an error occured, then the
  * appropriate error code is returned.
  */
-RasStatus ras_store_packet(re* entry, char* packet) { // double check the units here
+RasStatus ras_store_packet(RasStore* rs, re* entry, char* packet) { // double check the units here
     IpHeader* hdr = (IpHeader *) packet;
     
     size_t frag_offset = hdr->frag_offset;
 
     if (frag_offset == 0) {
-        memcpy(entry->hdr, hdr, sizeof(IpHeader));
+        memcpy(&entry->hdr, hdr, sizeof(IpHeader));
     }
 
     char* data_start = packet + hdr->ihl * 4;                           // Both of these are in octets 
     size_t dl8 = hdr->len - hdr->ihl * 4;                               // data length in 1 byte block
 
+    if (frag_offset * 8 + dl8 > IP_MAX_DATAGRAM)                         // Would not fit any datagram
+        return RAS_ERROR;
+
     if (frag_offset * 8 + dl8 > entry->tdl)                             // 
         entry->tdl = frag_offset * 8 + dl8;
 
-    if (entry->tdl > entry->tam)                                        // Check if there is enough memory in re
-        ras_extend_re(entry);                                           // TODO error handling
-
-    memcpy(entry->data + frag_offset * 8, data_start, dl8);             // Copy data into re
+    RasStatus s;
+    if (entry->tdl > entry->tam                                         // Check if there is enough memory in re
+        && (s = ras_extend_re(rs, entry)) != RAS_SUCCESS) return s;
+
+    uint16_t blocks = (dl8 + 7) / 8;
+
+    if (entry->bm == NULL && frag_offset == entry->contig) {            // Fast path: in order, just append
+        entry->contig += blocks;
+        entry->received += blocks;
+    } else {
+        if (entry->bm == NULL) {                                        // First gap or overlap: build the bitmap
+            ras_init_bitmap(entry);
+            bitmap_set_range(entry, 0, entry->contig);
+        }
+        uint16_t fresh = bitmap_set_range(entry, frag_offset, blocks);
+        if (fresh != blocks) entry->csum_valid = 0;                     // Overlapping data would be summed twice
+        entry->received += fresh;
+    }
 
-    log_bit_table(entry, frag_offset, dl8/8 + (entry->tdl % 8 != 0));
+    entry->data_csum = csum_copy(entry->data + frag_offset * 8, data_start, dl8, entry->data_csum); // Copy data into re
 
     if (!GET_MORE_FRAGMENTS(hdr)) entry->got_last = 1;
     
-    if (entry->got_last && re_complete(entry)) return RAS_SUCCESS_RE_COMPLETE;
+    if (re_complete(entry)) return RAS_SUCCESS_RE_COMPLETE;
     return RAS_SUCCESS;
 }
 
@@ -252,21 +750,24 @@ RasStatus ras_store_packet(re* entry, char* packet) { // double check the units
  * Organize a received packet in the Reassembly Store.
  * @param packet: raw packet to be stored
  */
-RasStatus ras_log(char* packet) {
+RasStatus ras_log(RasStore* rs, char* packet) {
     IpHeader* hdr = (IpHeader *) packet;
-    get_BufId(hdr, temp_id);
-
-    re* current = ras.h;
-    while (current != NULL && memcmp(temp_id, current->id, sizeof(BufId))) {
-        current = current->next;
-    }
+    get_BufId(hdr, &rs->temp);
 
     RasStatus result;
+    if (atomic_load_explicit(&rs->mem, memory_order_relaxed) > RAS_MEM_HIGH) ras_evict(rs);
+    if (2 * (rs->entries + 1) > rs->cap && (result = ras_grow(rs)) != RAS_SUCCESS) return result;
+
+    uint64_t hash = ras_hash(rs, &rs->temp);
+    size_t slot = ras_find(rs, &rs->temp, hash);
+    re* current = rs->table[slot].entry;
+
     if (current == NULL) {
-        if ((result = ras_new_datagram(temp_id)) != RAS_SUCCESS) return result;
-        current = ras.h;
+        if ((result = ras_new_datagram(rs, &rs->temp, slot, hdr, &current)) != RAS_SUCCESS) return result;
     }
     
-    return ras_store_packet(current, packet);
+    if ((result = ras_store_packet(rs, current, packet)) == RAS_ERR_SOURCE_LIMIT)
+        ras_drop(rs, current);                                              // could never complete
+    return result;
 }
 
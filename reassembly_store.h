@@ -2,25 +2,52 @@
 #define RAS
 
 #include "ip.h"
+#include "pktbuf.h"
 
 #define MIN_PACKET_SIZE 100 // Allows storing 100 octets of data.
+#define RAS_INITIAL_SLOTS 64 // Initial size of the entry hash table, must be a power of two.
+#define RAS_SLAB_ENTRIES 64  // Entries allocated at once when the free list runs dry.
+#define RAS_CACHED_BUFFERS 32 // Free data buffers kept per size class.
+#define IP_MAX_DATAGRAM 65535 // Largest datagram a total length field can describe.
+#define RAS_TIMEOUT_MS 30000 // Incomplete datagrams are dropped after this long.
+#define RAS_TICK_MS 100      // Resolution of the expiry timer wheel.
+#define RAS_WHEEL_SLOTS 512  // Slots of the expiry timer wheel, a power of two spanning RAS_TIMEOUT_MS.
+#define RAS_MEM_HIGH (4 << 20) // Crossing this many bytes evicts the oldest datagrams...
+#define RAS_MEM_LOW (3 << 20)  // ...until the store is back under this many.
+#define RAS_SOURCE_LIMIT (1 << 20) // Bytes a single source may hold in the store.
+#define RAS_SOURCE_BUCKETS 256 // Buckets the sources are hashed into, must be a power of two.
 
 typedef enum {
     RAS_ERROR,                      // Generic error value
     RAS_MEM_ERR,                    // Error related to allocating memory
     RAS_ERR_PACKET_NOT_COMPLETE,    // Error reported when ras_get_packet called on a not complete packet
     RAS_ERR_PACKET_NOT_FOUND,       // Error reported when ras_get_packet is called with a header that doesn't match any streams
+    RAS_ERR_SOURCE_LIMIT,           // Error reported when the source of a fragment holds RAS_SOURCE_LIMIT bytes already
     RAS_SUCCESS,                    // Returned if the operation was successful
     RAS_SUCCESS_RE_COMPLETE,        // Returned when the packet with which ras_log was called completed the packet
     
 } RasStatus;
 
+typedef struct {
+    uint64_t expired;               // datagrams dropped because they did not complete in time
+    uint64_t expired_octets;        // octets of data dropped with them
+    uint64_t evicted;               // datagrams dropped to bring the store under RAS_MEM_LOW
+    uint64_t source_limited;        // allocations refused because of RAS_SOURCE_LIMIT
+    uint64_t mem;                   // bytes currently held by the store
+} RasStats;
+
 void ras_error_message(RasStatus s);
 
-RasStatus ras_init();
-void ras_kill();
-RasStatus ras_log(char* packet);
-RasStatus ras_get_packet(IpHeader* hdr, char* data);
+typedef struct RasStore RasStore;
+
+RasStatus ras_init(RasStore** store);
+void ras_kill(RasStore* rs);
+RasStatus ras_log(RasStore* rs, char* packet);
+RasStatus ras_get_packet(RasStore* rs, IpHeader* hdr, char* data, uint32_t* data_csum);
+RasStatus ras_take_packet(RasStore* rs, IpHeader* hdr, PktBuf** buf);
+void ras_tick(RasStore* rs, uint64_t now_us);
+int ras_pending(RasStore* rs);
+void ras_get_stats(RasStore* rs, RasStats* stats);
 
 #ifdef DEBUG_INFO_ENABLED
 
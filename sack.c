@@ -0,0 +1,91 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "sack.h"
+
+void sack_clear(SackScoreboard* sb) {
+    sb->n = 0;
+}
+
+/**
+ * Records a SACKed range, merging it with the ranges it overlaps or touches.
+ * @param start: first octet of the range.
+ * @param end: octet following the range.
+ */
+void sack_add(SackScoreboard* sb, uint32_t start, uint32_t end) {
+    if (!SEQ_LT(start, end)) return;
+
+    uint32_t i = 0;
+    while (i < sb->n && SEQ_LT(sb->blocks[i].end, start)) i++;     // ranges entirely below
+
+    uint32_t j = i;
+    while (j < sb->n && SEQ_LEQ(sb->blocks[j].start, end)) {       // ranges to merge with
+        if (SEQ_LT(sb->blocks[j].start, start)) start = sb->blocks[j].start;
+        if (SEQ_GT(sb->blocks[j].end, end)) end = sb->blocks[j].end;
+        j++;
+    }
+
+    if (i == j) {                   // nothing to merge: make room
+        if (i == SACK_SCOREBOARD_SIZE) return;
+        uint32_t keep = sb->n < SACK_SCOREBOARD_SIZE ? sb->n : SACK_SCOREBOARD_SIZE - 1;
+        memmove(&sb->blocks[i + 1], &sb->blocks[i], (keep - i) * sizeof(SackBlock));
+        sb->n = keep + 1;
+    } else if (j > i + 1) {         // several ranges become one
+        memmove(&sb->blocks[i + 1], &sb->blocks[j], (sb->n - j) * sizeof(SackBlock));
+        sb->n -= j - i - 1;
+    }
+    sb->blocks[i] = (SackBlock) { .start = start, .end = end };
+}
+
+/**
+ * Forgets what snd_una moved past.
+ * @param una: new snd_una.
+ */
+void sack_trim(SackScoreboard* sb, uint32_t una) {
+    uint32_t i = 0;
+    while (i < sb->n && SEQ_LEQ(sb->blocks[i].end, una)) i++;
+    if (i > 0) {
+        memmove(&sb->blocks[0], &sb->blocks[i], (sb->n - i) * sizeof(SackBlock));
+        sb->n -= i;
+    }
+    if (sb->n > 0 && SEQ_LT(sb->blocks[0].start, una)) sb->blocks[0].start = una;
+}
+
+/**
+ * Octet following the highest SACKed range, una if nothing is SACKed.
+ */
+uint32_t sack_high(SackScoreboard* sb, uint32_t una) {
+    return sb->n == 0 ? una : sb->blocks[sb->n - 1].end;
+}
+
+/**
+ * Number of SACKed octets in [from, to).
+ */
+uint32_t sack_covered(SackScoreboard* sb, uint32_t from, uint32_t to) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < sb->n && SEQ_LT(sb->blocks[i].start, to); i++) {
+        uint32_t s = SEQ_GT(sb->blocks[i].start, from) ? sb->blocks[i].start : from;
+        uint32_t e = SEQ_LT(sb->blocks[i].end, to) ? sb->blocks[i].end : to;
+        if (SEQ_LT(s, e)) n += e - s;
+    }
+    return n;
+}
+
+/**
+ * Finds the first range at or above from that is not SACKed, but lies below a SACKed one: data
+ * presumed lost.
+ * @param hole: set to the range found.
+ * @return true if there is such a range.
+ */
+bool sack_next_hole(SackScoreboard* sb, uint32_t from, SackBlock* hole) {
+    for (uint32_t i = 0; i < sb->n; i++) {
+        if (SEQ_LEQ(sb->blocks[i].end, from)) continue;
+        if (SEQ_LEQ(sb->blocks[i].start, from)) {
+            from = sb->blocks[i].end;
+            continue;
+        }
+        *hole = (SackBlock) { .start = from, .end = sb->blocks[i].start };
+        return true;
+    }
+    return false;
+}
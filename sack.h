@@ -0,0 +1,28 @@
+#ifndef SACK
+#define SACK
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "tcp_options.h"
+
+#define SACK_SCOREBOARD_SIZE 32     // ranges a sender keeps track of
+
+/*
+ * Sender side record of the octets above snd_una the peer reported with SACK blocks (RFC 6675).
+ * The ranges are sorted, disjoint and never adjacent. If more ranges come in than fit, the
+ * highest ones are forgotten, which only costs needless retransmissions.
+ */
+typedef struct {
+    SackBlock blocks[SACK_SCOREBOARD_SIZE];
+    uint32_t n;
+} SackScoreboard;
+
+void sack_clear(SackScoreboard* sb);
+void sack_add(SackScoreboard* sb, uint32_t start, uint32_t end);
+void sack_trim(SackScoreboard* sb, uint32_t una);
+uint32_t sack_high(SackScoreboard* sb, uint32_t una);
+uint32_t sack_covered(SackScoreboard* sb, uint32_t from, uint32_t to);
+bool sack_next_hole(SackScoreboard* sb, uint32_t from, SackBlock* hole);
+
+#endif
@@ -0,0 +1,182 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/random.h>
+
+#include "ip.h"
+#include "tcb_table.h"
+
+/**
+ * Prints the error message associated with a TcbStatus code
+ * @param s: TcbStatus to be decoded.
+ */
+void tcb_error_message(TcbStatus s) {
+    switch (s) {
+        case TCB_ERROR: printf("TCB: Unspecified error."); break;
+        case TCB_MEM_ERR: printf("TCB: Memory error."); break;
+        case TCB_ERR_EXISTS: printf("TCB: Connection exists already."); break;
+        case TCB_ERR_NOT_FOUND: printf("TCB: Connection not found."); break;
+        case TCB_SUCCESS: break;
+    }
+}
+
+/*
+ * The key is kept in the slot next to its hash, so a lookup compares keys without touching the
+ * Tcb, and a probe usually stays within one cache line.
+ */
+typedef struct {
+    uint64_t hash;                  // hash of key
+    TcbKey key;
+    Tcb* tcb;                       // NULL if the slot is free
+} TcbSlot;
+
+/*
+ * Connections are indexed by an open addressing hash table with linear probing, like the
+ * reassembly store. Removal shifts the following entries of the probe sequence back, so there
+ * are no tombstones and lookups stay short however many connections come and go. The hash is
+ * SipHash-1-3 under a random key, so remote hosts can't pick ports and addresses that collide.
+ * A table belongs to the TCP thread and takes no locks.
+ */
+struct TcbTable {
+    size_t entries;                 // number of connections in the table
+    size_t cap;                     // number of slots in table, a power of two
+    TcbSlot* table;
+    uint64_t key[2];                // SipHash key
+};
+
+/**
+ * Creates an empty table.
+ * @param table: set to the new table.
+ */
+TcbStatus tcb_table_init(TcbTable** table) {
+    TcbTable* t = (TcbTable *) calloc(1, sizeof(TcbTable));
+    if (t == NULL) return TCB_MEM_ERR;
+
+    t->cap = TCB_INITIAL_SLOTS;
+    t->table = (TcbSlot *) calloc(t->cap, sizeof(TcbSlot));
+    if (t->table == NULL) {
+        free(t);
+        return TCB_MEM_ERR;
+    }
+
+    if (getrandom(t->key, sizeof(t->key), 0) != sizeof(t->key)) {
+        t->key[0] = (uint64_t) (uintptr_t) t ^ monotonic_us();
+        t->key[1] = mix64(t->key[0]);
+    }
+
+    *table = t;
+    return TCB_SUCCESS;
+}
+
+/**
+ * Frees the table. The connections in it are not freed.
+ */
+void tcb_table_kill(TcbTable* t) {
+    if (t == NULL) return;
+    free(t->table);
+    free(t);
+}
+
+/**
+ * Keyed hash of a connection key.
+ * @param key: key to be hashed.
+ */
+uint64_t tcb_hash(TcbTable* t, TcbKey* key) {
+    return siphash(t->key, key, sizeof(TcbKey), 1, 3);
+}
+
+/**
+ * Finds the slot holding the connection with the given key.
+ * @param key: key to look for.
+ * @param hash: tcb_hash(t, key).
+ * @return index of the slot, or of the free slot ending the probe sequence if not found.
+ */
+size_t tcb_find(TcbTable* t, TcbKey* key, uint64_t hash) {
+    size_t mask = t->cap - 1;
+    size_t i = hash & mask;
+    while (t->table[i].tcb != NULL) {
+        if (t->table[i].hash == hash && memcmp(&t->table[i].key, key, sizeof(TcbKey)) == 0) break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/**
+ * Doubles the table once it is half full.
+ */
+TcbStatus tcb_grow(TcbTable* t) {
+    size_t old_cap = t->cap;
+    TcbSlot* old = t->table;
+    TcbSlot* table = (TcbSlot *) calloc(old_cap * 2, sizeof(TcbSlot));
+    if (table == NULL) return TCB_MEM_ERR;
+
+    t->table = table;
+    t->cap = old_cap * 2;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].tcb == NULL) continue;
+        size_t j = old[i].hash & (t->cap - 1);
+        while (table[j].tcb != NULL) j = (j + 1) & (t->cap - 1);
+        table[j] = old[i];
+    }
+    free(old);
+    return TCB_SUCCESS;
+}
+
+/**
+ * Returns the connection with the given key, NULL if there is none.
+ * @param key: exact key, wildcards are not expanded.
+ */
+Tcb* tcb_lookup(TcbTable* t, TcbKey* key) {
+    return t->table[tcb_find(t, key, tcb_hash(t, key))].tcb;
+}
+
+/**
+ * Adds a connection to the table.
+ * @param key: key of the connection, not in the table yet.
+ * @param tcb: connection, stays owned by the caller.
+ */
+TcbStatus tcb_insert(TcbTable* t, TcbKey* key, Tcb* tcb) {
+    if ((t->entries + 1) * 2 > t->cap && tcb_grow(t) != TCB_SUCCESS) return TCB_MEM_ERR;
+
+    uint64_t hash = tcb_hash(t, key);
+    size_t i = tcb_find(t, key, hash);
+    if (t->table[i].tcb != NULL) return TCB_ERR_EXISTS;
+
+    t->table[i].hash = hash;
+    t->table[i].key = *key;
+    t->table[i].tcb = tcb;
+    t->entries++;
+    return TCB_SUCCESS;
+}
+
+/**
+ * Removes a connection from the table, shifting back entries whose probe sequence passes through
+ * its slot.
+ * @param key: key of the connection.
+ * @return the connection removed, NULL if there was none.
+ */
+Tcb* tcb_remove(TcbTable* t, TcbKey* key) {
+    size_t mask = t->cap - 1;
+    size_t i = tcb_find(t, key, tcb_hash(t, key));
+    Tcb* tcb = t->table[i].tcb;
+    if (tcb == NULL) return NULL;
+
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (t->table[j].tcb == NULL) break;
+        size_t home = t->table[j].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {   // slot i lies on j's probe sequence
+            t->table[i] = t->table[j];
+            i = j;
+        }
+    }
+    t->table[i].tcb = NULL;
+    t->entries--;
+    return tcb;
+}
+
+size_t tcb_count(TcbTable* t) {
+    return t->entries;
+}
@@ -0,0 +1,41 @@
+#ifndef TCB_TABLE
+#define TCB_TABLE
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TCB_INITIAL_SLOTS 1024      // Initial size of a connection table, must be a power of two.
+
+typedef enum {
+    TCB_ERROR,                      // Generic error value
+    TCB_MEM_ERR,                    // Error related to allocating memory
+    TCB_ERR_EXISTS,                 // A connection with the same key is in the table already
+    TCB_ERR_NOT_FOUND,              // No connection with the given key
+    TCB_SUCCESS,                    // Returned if the operation was successful
+} TcbStatus;
+
+void tcb_error_message(TcbStatus s);
+
+/*
+ * A connection is identified by its 4-tuple. Listening sockets leave the foreign half zero, and
+ * local_ip zero to accept on any local address.
+ */
+typedef struct __attribute__((__packed__))
+{
+    uint32_t local_ip;
+    uint32_t foreign_ip;
+    uint16_t local_port;
+    uint16_t foreign_port;
+} TcbKey;
+
+typedef struct Tcb Tcb;
+typedef struct TcbTable TcbTable;
+
+TcbStatus tcb_table_init(TcbTable** table);
+void tcb_table_kill(TcbTable* t);
+Tcb* tcb_lookup(TcbTable* t, TcbKey* key);
+TcbStatus tcb_insert(TcbTable* t, TcbKey* key, Tcb* tcb);
+Tcb* tcb_remove(TcbTable* t, TcbKey* key);
+size_t tcb_count(TcbTable* t);
+
+#endif
@@ -1,7 +1,20 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 
 #include "ip.h"
 #include "tcp.h"
+#include "tcb_table.h"
+#include "mpsc_queue.h"
+#include "checksum.h"
+#include "congestion.h"
+#include "timer_wheel.h"
+#include "tcp_options.h"
+#include "sack.h"
+#include "ooo_queue.h"
 
 
 typedef enum {
@@ -16,119 +29,1274 @@ typedef struct {
 } CommandWithData;
 
 typedef struct {
-    IpHeader* hdr;
-    char* data;
+    PktBuf* buf;                // holds a reference, starts at the IP header
 } IpPacket;
 
-typedef struct { // If its a command, we might also need to store extra information.
+typedef struct Event { // If its a command, we might also need to store extra information.
+    MpscNode node;              // link in the event queue, must come first
     EventType type;
     union
     {
         CommandWithData c;
         IpPacket p;
     };
-    Event* next;
+    struct EventPool* pool;     // pool the event was taken from
+    struct Event* link;         // next event on a free list or in a return batch
 } Event;
 
+/*
+ * Events come from per-thread pools, so queueing an event does not malloc once the pools are
+ * warm. A thread takes events from its own free list. tcp_manager gathers the events it is done
+ * with by pool and gives each batch back with a single push; the owner takes all returned events 
+ * at once when its free list runs dry.
+ */
+typedef struct EventPool {
+    Event* free;                                                            // owner only
+    _Atomic(Event*) returned __attribute__((aligned(CACHE_LINE_SIZE)));   // pushed by tcp_manager
+} EventPool;
+
+typedef struct {
+    EventPool* pool;            // NULL if the batch is unused
+    Event* first;
+    Event* last;
+} EventBatch;
+
+_Thread_local EventPool* event_pool;    // pool of the calling thread, created on first use
+
+/*
+ * Byte ring of a connection. head and tail count octets of the stream, starting at 0 with the
+ * octet after the SYN, so the octet with sequence number s lives at buf[(s - isn - 1) & (size - 1)].
+ * Each index has one writer: on the send ring the user appends at tail and tcp_manager moves head
+ * as data is acknowledged; on the receive ring tcp_manager appends and the user consumes.
+ */
 typedef struct {
+    char* buf;
+    uint32_t size;              // a power of two
+    atomic_uint head;           // stream offset of the first octet held
+    atomic_uint tail;           // stream offset one past the last octet held
+} TcpRing;
+
+typedef struct Tcb {
     pthread_mutex_t lck;
-    char[10] name;
-    uint16_t local_port;
-    uint16_t foreign_ip;
-    uint32_t foreign_port;
+    char name[10];
+    TcbKey key;                 // local and foreign socket
+    struct Tcb* listener;       // listener that spawned the connection, NULL for active opens
+    MpscQueue* accepts;         // listeners only: established connections not yet accepted
+    MpscNode accept_node;       // link in the accept queue of the listener
+
+    TcpRing snd;                // from snd_una on: sent but unacknowledged, then unsent
+    TcpRing rcv;                // received in sequence, not yet read by the user
+    atomic_uint snd_buf;        // ring sizes; on a listener, of the connections it spawns
+    atomic_uint rcv_buf;
+    uint32_t rcv_adv;           // right edge of the last window advertised
+
+    uint32_t snd_mss;           // largest payload the peer takes, before options
+    bool wscale_ok;             // both SYNs carried a window scale (RFC 7323)
+    uint8_t snd_wscale;         // shift of the windows the peer advertises
+    uint8_t rcv_wscale;         // shift of the windows we advertise
+    bool ts_ok;                 // both SYNs carried timestamps
+    uint32_t ts_recent;         // timestamp to echo, the latest of the peer's in sequence
+    uint64_t ts_recent_us;      // when ts_recent was taken
+    uint32_t last_ack_sent;     // rcv_nxt of the last ACK sent
+    bool sack_ok;               // both SYNs carried SACK-permitted (RFC 2018)
+    SackScoreboard scoreboard;  // send side: octets above snd_una the peer holds
+    uint32_t rexmit_nxt;        // SACK recovery: holes below this were retransmitted already
+    OooQueue ooo;               // receive side: ranges above rcv_nxt, their data held in the ring
+
+    CongState cc;               // congestion window, sized by the algorithm in cc.ops
+    _Atomic(const CongOps*) cc_next;    // algorithm asked for by tcp_set_congestion
+    uint32_t dupacks;           // duplicate acknowledgments in a row
+    bool in_recovery;           // in fast recovery
+    uint32_t recover;           // snd_max when fast recovery was entered (RFC 6582)
+
+    TimerNode rto_timer;        // retransmission, of the SYN and SYN-ACK too
+    TimerNode persist_timer;    // zero window probes
+    TimerNode keepalive_timer;
+    TimerNode time_wait_timer;  // 2MSL
+    TimerNode delack_timer;     // delayed acknowledgment
+    uint32_t srtt_us;           // smoothed round trip time, 0 before the first sample
+    uint32_t rttvar_us;         // round trip time variation
+    uint32_t rto_us;            // retransmission timeout, before backoff
+    uint32_t rtt_seq;           // sequence number whose acknowledgment ends the RTT sample
+    uint64_t rtt_start_us;      // when the timed segment was sent, 0 if none is timed
+    uint32_t backoff;           // consecutive expiries of the retransmission or persist timer
+    uint32_t keepalive_probes;  // keepalive probes sent since the last segment arrived
+    uint64_t last_rcv_us;       // when the last segment arrived
+    atomic_bool keepalive;      // probe the connection when idle, set by tcp_set_keepalive
+
+    uint32_t unacked_segs;      // full sized segments received since the last ACK sent
+    bool ack_now;               // an ACK is owed at the end of the batch
+    bool ack_delayed;           // an ACK is owed within TCP_DELACK_US
+    bool scheduled;             // on the flush list of the current batch
+    struct Tcb* next_scheduled;
 
     uint32_t snd_una;           // send side unacknowledged
     uint32_t snd_nxt;           // send side next
-    uint32_t snd_wnd;           // send window
-    unit32_t snd_up;            // send urgent pointer
-    unit32_t snd_wl1;
-    unit32_t snd_wl2;
-    unit32_t iss;               // initial send sequence number
+    uint32_t snd_max;           // highest sequence number sent, past snd_nxt after a timeout
+    uint32_t snd_wnd;           // send window, scaled
+    uint32_t snd_up;            // send urgent pointer
+    uint32_t snd_wl1;
+    uint32_t snd_wl2;
+    uint32_t iss;               // initial send sequence number
 
-    unit32_t rcv_nxt;           // receive next
-    unit32_t rcv_wnd;           // receive window
-    unit32_t snd_up;            // send urgent pointer
-    unit32_t irs;               // initial receive sequence number
+    uint32_t rcv_nxt;           // receive next
+    uint32_t rcv_wnd;           // receive window last advertised, scaled
+    uint32_t rcv_up;            // receive urgent pointer
+    uint32_t irs;               // initial receive sequence number
 
     TcpState state;
 } Tcb;
 
 
-// How are TCB's stored?
+/*
+ * TCBs are found through two hash tables owned by the tcp_manager thread: conns holds every
+ * connection by its full 4-tuple, listeners the LISTEN sockets by local address and port. 
+ * Segments are demultiplexed without taking a lock, in time independent of the number of connections.
+ * Events reach tcp_manager through a lock-free queue; any thread may add to it.
+ */
 struct {
-    pthread_mutex_t lck;
-    char[100] err;
-    Event* events;
-    Tcb* tc_blocks;
+    char err[100];
+    MpscQueue events;           // consumed by tcp_manager only
+    char segment[IP_MAX_MTU] __attribute__((aligned(CACHE_LINE_SIZE)));   // segment being built
+    uint16_t ip_id;             // identification of the next datagram sent
+    int core;                   // core tcp_manager is pinned to, -1 for none
+    unsigned spin_budget_us;    // how long an idle tcp_manager spins before blocking, 0 to block right away
+    TcbTable* conns;            // synchronized connections, by 4-tuple
+    TcbTable* listeners;        // LISTEN sockets, foreign half of the key zero
+    EventBatch returns[TCP_EVENT_BATCHES];  // processed events not yet given back, tcp_manager only
+    atomic_ullong event_mallocs;
+    atomic_ullong fast_retransmits;
+    atomic_ullong timeouts;
+    atomic_ullong pure_acks;
+    Tcb* scheduled;             // connections to flush at the end of the batch of events
+    TimerWheel timers;          // timers of all connections, tcp_manager only
+    uint64_t now_us;            // time of the current tcp_manager iteration
 } tcp_server;
 
-void add_event(Event* e) {
-    pthread_mutex_lock(&tcp_server.lck);
-    Event* current = tcp_server.events;
+/**
+ * Takes an event from the pool of the calling thread, refilling the pool from the events 
+ * tcp_manager returned, or else with a new slab.
+ * @return the event, NULL if memory ran out.
+ */
+Event* event_alloc() {
+    EventPool* pool = event_pool;
 
-    if (current == NULL) {
-        tcp_server->next_event = e;
-    } else {
-        while(tcp_server.events != NULL)
-            current = current.next_event;
-    
-        current.next_event = e;
+    if (pool == NULL) {
+        if ((pool = (EventPool *) aligned_alloc(CACHE_LINE_SIZE, sizeof(EventPool))) == NULL) return NULL;
+        atomic_fetch_add_explicit(&tcp_server.event_mallocs, 1, memory_order_relaxed);
+        pool->free = NULL;
+        atomic_store_explicit(&pool->returned, NULL, memory_order_relaxed);
+        event_pool = pool;
     }
-    pthread_mutex_unlock(&tcp_server.lck);
+
+    if (pool->free == NULL) 
+        pool->free = atomic_exchange_explicit(&pool->returned, NULL, memory_order_acquire);
+    if (pool->free == NULL) {
+        Event* slab = (Event *) malloc(TCP_EVENT_SLAB * sizeof(Event));
+        if (slab == NULL) return NULL;
+        atomic_fetch_add_explicit(&tcp_server.event_mallocs, 1, memory_order_relaxed);
+        for (int i = 0; i < TCP_EVENT_SLAB; i++) {
+            slab[i].pool = pool;
+            slab[i].link = pool->free;
+            pool->free = &slab[i];
+        }
+    }
+
+    Event* e = pool->free;
+    pool->free = e->link;
+    return e;
 }
 
 /**
- * This method registers an event on the TCP queue for an IP packet.
- * @param hdr: pointer to the IpHeader of the incoming packet.
- * @param data: pointer to the data of the incoming packet.
+ * Gives every gathered batch of events back to its pool. Must only be called by tcp_manager.
  */
-void add_packet_event(IpHeader* hdr, char* data) {
+void event_flush() {
+    for (int i = 0; i < TCP_EVENT_BATCHES; i++) {
+        EventBatch* b = &tcp_server.returns[i];
+        if (b->pool == NULL) continue;
 
-    Event* e = (Event *) malloc(sizeof(Event));
-    e->type = TCP_PACKET;
-    (e->p).hdr = hdr;
-    (e->p).data = data;
+        Event* top = atomic_load_explicit(&b->pool->returned, memory_order_relaxed);
+        do {
+            b->last->link = top;
+        } while (!atomic_compare_exchange_weak_explicit(&b->pool->returned, &top, b->first,
+                    memory_order_release, memory_order_relaxed));
+        b->pool = NULL;
+    }
+}
+
+/**
+ * Drops an event tcp_manager is done with, adding it to the batch of its pool. Must only be 
+ * called by tcp_manager.
+ */
+void event_put(Event* e) {
+    EventBatch* b = NULL;
+
+    for (int i = 0; i < TCP_EVENT_BATCHES && b == NULL; i++)
+        if (tcp_server.returns[i].pool == e->pool) b = &tcp_server.returns[i];
+    if (b != NULL) {
+        e->link = b->first;
+        b->first = e;
+        return;
+    }
+
+    for (int i = 0; i < TCP_EVENT_BATCHES && b == NULL; i++)
+        if (tcp_server.returns[i].pool == NULL) b = &tcp_server.returns[i];
+    if (b == NULL) {                                    // more pools than batches
+        event_flush();
+        b = &tcp_server.returns[0];
+    }
+    e->link = NULL;
+    b->pool = e->pool;
+    b->first = b->last = e;
+}
+
+/**
+ * Copies the TCP statistics.
+ * @param stats: where to store the statistics.
+ */
+void tcp_get_stats(TcpStats* stats) {
+    stats->event_mallocs = atomic_load_explicit(&tcp_server.event_mallocs, memory_order_relaxed);
+    stats->fast_retransmits = atomic_load_explicit(&tcp_server.fast_retransmits, memory_order_relaxed);
+    stats->timeouts = atomic_load_explicit(&tcp_server.timeouts, memory_order_relaxed);
+    stats->pure_acks = atomic_load_explicit(&tcp_server.pure_acks, memory_order_relaxed);
+}
+
+/**
+ * Queues an event for tcp_manager, waking it if it is blocked. O(1) and lock-free, so it may be
+ * called from any thread.
+ */
+void add_event(Event* e) {
+    mpsc_push(&tcp_server.events, &e->node);
+}
+
+/**
+ * This method registers an event on the TCP queue for an IP packet. Registered with 
+ * ip_set_receiver, so it runs on the IP input manager thread, and drops datagrams of other
+ * protocols.
+ * @param buf: buffer of the incoming packet; the reference passed in is owned by the event.
+ */
+void add_packet_event(PktBuf* buf) {
+    if (((IpHeader *) buf->data)->proto != IP_PROTO_TCP) {
+        pktbuf_put(buf);
+        return;
+    }
+
+    Event* e = event_alloc();
+    if (e == NULL) {
+        pktbuf_put(buf);
+        return;
+    }
+    e->type = IP_PACKET_IN;
+    (e->p).buf = buf;
 
     add_event(e);
 }
 
 /**
  * This method registers an event on the TCP queue for an user command.
- * @param hdr: pointer to the IpHeader of the incoming packet.
- * @param data: pointer to the data of the incoming packet.
+ * @param command: command to be executed by tcp_manager.
+ * @param data: argument of the command.
  */
-void add_command_event(TcpCommand command, char* data) {
+TcpStatus add_command_event(TcpCommand command, char* data) {
     
-    Event* e = (Event *) malloc(sizeof(Event));
+    Event* e = event_alloc();
+    if (e == NULL) return TCP_ERR;
     e->type = USER_COMMAND;
-    e->c = command;
+    e->c.c = command;
+    e->c.data = data;
     
     add_event(e);
+    return TCP_SUCCESS;
 }
 /**
- * Method for generating initial seq numbers.
+ * Method for generating initial seq numbers: the RFC 793 clock, ticking every 4 microseconds.
  */
 uint32_t get_initial_seq_number() {
-
+    return (uint32_t) (monotonic_us() / 4);
 }
 
 int event_queue_empty() {
-    return tcp_server.events == NULL;
+    return mpsc_empty(&tcp_server.events);
 }
 
 TcpStatus tcp_init(
     char* (*get_packet)(),
-    IpStatus (*send_packet)(char*),
+    IpStatus (*send_packet)(char*)
 ) {
-    
+    if (mpsc_init(&tcp_server.events) < 0) return TCP_ERR;
+    tcp_server.core = -1;
+    tcp_server.spin_budget_us = 0;
+    memset(tcp_server.returns, 0, sizeof(tcp_server.returns));
+    if (tcb_table_init(&tcp_server.conns) != TCB_SUCCESS) return TCP_ERR;
+    if (tcb_table_init(&tcp_server.listeners) != TCB_SUCCESS) return TCP_ERR;
+    tcp_server.now_us = monotonic_us();
+    tw_init(&tcp_server.timers, tcp_server.now_us);
+    ip_set_receiver(add_packet_event);
+
+    return TCP_SUCCESS;
+}
+
+/**
+ * Opt-in busy-poll mode for tcp_manager. Must be called before tcp_manager is started.
+ * @param core: core to pin tcp_manager to, -1 for none.
+ * @param spin_budget_us: how long to spin on an empty event queue before blocking.
+ */
+TcpStatus tcp_set_busy_poll(int core, unsigned spin_budget_us) {
+    tcp_server.core = core;
+    tcp_server.spin_budget_us = spin_budget_us;
+    return TCP_SUCCESS;
+}
+
+/**
+ * Sets up an empty ring.
+ * @param size: capacity in octets, a power of two.
+ */
+int tcp_ring_init(TcpRing* r, uint32_t size) {
+    r->size = size;
+    atomic_store(&r->head, 0);
+    atomic_store(&r->tail, 0);
+    return (r->buf = (char *) malloc(size)) == NULL ? -1 : 0;
+}
+
+/**
+ * Copies len octets into the ring, starting at stream offset off.
+ */
+void tcp_ring_write(TcpRing* r, uint32_t off, const char* data, uint32_t len) {
+    uint32_t i = off & (r->size - 1);
+    uint32_t first = r->size - i < len ? r->size - i : len;
+    memcpy(r->buf + i, data, first);
+    memcpy(r->buf, data + first, len - first);
+}
+
+/**
+ * Copies len octets out of the ring, starting at stream offset off.
+ */
+void tcp_ring_read(TcpRing* r, uint32_t off, char* data, uint32_t len) {
+    uint32_t i = off & (r->size - 1);
+    uint32_t first = r->size - i < len ? r->size - i : len;
+    memcpy(data, r->buf + i, first);
+    memcpy(data + first, r->buf, len - first);
+}
+
+/**
+ * Copies len octets out of the ring like tcp_ring_read, adding them to a partial checksum.
+ */
+uint32_t tcp_ring_read_csum(TcpRing* r, uint32_t off, char* data, uint32_t len, uint32_t sum) {
+    uint32_t i = off & (r->size - 1);
+    if (r->size - i >= len) return csum_copy(data, r->buf + i, len, sum);
+    tcp_ring_read(r, off, data, len);       // wraps: summing the halves separately could misalign them
+    return csum_partial(data, len, sum);
+}
+
+/**
+ * Stops every timer of a connection but the 2MSL one.
+ */
+void tcb_cancel_timers(Tcb* tcb) {
+    tw_cancel(&tcp_server.timers, &tcb->rto_timer);
+    tw_cancel(&tcp_server.timers, &tcb->persist_timer);
+    tw_cancel(&tcp_server.timers, &tcb->keepalive_timer);
+    tw_cancel(&tcp_server.timers, &tcb->delack_timer);
+}
+
+/**
+ * Frees a TCB that is in no table.
+ */
+void free_tcb(Tcb* tcb) {
+    tcb_cancel_timers(tcb);
+    tw_cancel(&tcp_server.timers, &tcb->time_wait_timer);
+    if (tcb->accepts != NULL) mpsc_free(tcb->accepts);
+    free(tcb->accepts);
+    free(tcb->snd.buf);
+    free(tcb->rcv.buf);
+    pthread_mutex_destroy(&tcb->lck);
+    free(tcb);
+}
+
+/**
+ * Largest segment payload that fits the IP MTU without fragmenting. It is the MSS announced in
+ * our SYNs.
+ */
+uint32_t tcp_mss() {
+    return ip_get_mtu() - sizeof(IpHeader) - sizeof(TcpHeader);
+}
+
+/**
+ * Smallest window shift that lets the whole receive ring be advertised.
+ * @param rcv_buf: size of the receive ring.
+ */
+uint8_t tcp_wscale(uint32_t rcv_buf) {
+    uint8_t shift = 0;
+    while (shift < TCP_MAX_WSCALE && (rcv_buf >> shift) > TCP_MAX_WINDOW) shift++;
+    return shift;
+}
+
+/**
+ * Largest ring worth having for the windows of a connection: a ring can only fill up to the
+ * largest window the header can advertise at the given shift.
+ * @param size: ring size asked for, a power of two.
+ */
+uint32_t tcp_ring_fit(uint32_t size, uint8_t wscale) {
+    uint32_t max = (uint32_t) (TCP_MAX_WINDOW + 1) << wscale;
+    return size < max ? size : max;
+}
+
+/**
+ * Clock of the timestamps we send, in milliseconds (RFC 7323 5.4).
+ */
+uint32_t tcp_ts_now() {
+    return (uint32_t) (tcp_server.now_us / 1000);
+}
+
+void tcp_rto_fire(TimerNode* t);
+void tcp_persist_fire(TimerNode* t);
+void tcp_keepalive_fire(TimerNode* t);
+void tcp_time_wait_fire(TimerNode* t);
+void tcp_delack_fire(TimerNode* t);
+
+/**
+ * Sets up the sequence numbers, congestion window and timers of a new TCB.
+ * @param ops: congestion control algorithm.
+ */
+void tcb_init_state(Tcb* tcb, const CongOps* ops) {
+    tcb->iss = get_initial_seq_number();
+    tcb->snd_una = tcb->iss;
+    tcb->snd_nxt = tcb->iss;
+    tcb->snd_max = tcb->iss;
+    tcb->recover = tcb->iss;
+    tcb->snd_mss = tcp_mss();
+    atomic_store_explicit(&tcb->snd_buf, TCP_SND_BUF, memory_order_relaxed);
+    atomic_store_explicit(&tcb->rcv_buf, TCP_RCV_BUF, memory_order_relaxed);
+    tcb->rcv_wscale = tcp_wscale(TCP_RCV_BUF);
+    cong_init(&tcb->cc, ops, tcp_mss());
+
+    tcb->rto_us = TCP_RTO_INITIAL_US;
+    tw_timer_init(&tcb->rto_timer, tcp_rto_fire);
+    tw_timer_init(&tcb->persist_timer, tcp_persist_fire);
+    tw_timer_init(&tcb->keepalive_timer, tcp_keepalive_fire);
+    tw_timer_init(&tcb->time_wait_timer, tcp_time_wait_fire);
+    tw_timer_init(&tcb->delack_timer, tcp_delack_fire);
+}
+
+/**
+ * Sets up the send and receive rings of a connection.
+ * @param snd_buf: size of the send ring, a power of two.
+ * @param rcv_buf: size of the receive ring, a power of two.
+ */
+int tcb_init_rings(Tcb* tcb, uint32_t snd_buf, uint32_t rcv_buf) {
+    return tcp_ring_init(&tcb->snd, snd_buf) < 0 || tcp_ring_init(&tcb->rcv, rcv_buf) < 0 ? -1 : 0;
+}
+
+/**
+ * Opens a connection. The TCB is created here and inserted by tcp_manager, which owns the tables.
+ * @param local_ip: local address, 0 to listen on any address.
+ * @param local_port: local port.
+ * @param foreign_ip: foreign address, 0 together with foreign_port for a passive open.
+ * @param foreign_port: foreign port.
+ * @param tcb: set to the connection, or to the listener on a passive open.
+ */
+TcpStatus OPEN(uint32_t local_ip, uint16_t local_port, uint32_t foreign_ip, uint16_t foreign_port, Tcb** tcb) {
+    Tcb* t = (Tcb *) calloc(1, sizeof(Tcb));
+    if (t == NULL) return TCP_ERR;
+    if (pthread_mutex_init(&t->lck, NULL) != 0) {
+        free(t);
+        return TCP_ERR;
+    }
+    t->key = (TcbKey) { .local_ip = local_ip, .local_port = local_port, .foreign_ip = foreign_ip, .foreign_port = foreign_port };
+    tcb_init_state(t, &cong_newreno);
+
+    TcpCommand c = foreign_ip == 0 && foreign_port == 0 ? TCP_PASSIVE_OPEN : TCP_ACTIVE_OPEN;
+    int failed;
+    if (c == TCP_PASSIVE_OPEN) {
+        t->accepts = (MpscQueue *) aligned_alloc(CACHE_LINE_SIZE, sizeof(MpscQueue));
+        failed = t->accepts == NULL || mpsc_init(t->accepts) < 0;
+    } else {
+        failed = tcb_init_rings(t, TCP_SND_BUF, TCP_RCV_BUF) < 0;
+    }
+    if (failed || add_command_event(c, (char *) t) != TCP_SUCCESS) {
+        free_tcb(t);
+        return TCP_ERR;
+    }
+    *tcb = t;
+    return TCP_SUCCESS;
+}
+
+/**
+ * Blocks until the listener has an established connection, and returns it.
+ * @param listener: TCB returned by a passive OPEN. Only one thread may accept on it.
+ */
+Tcb* tcp_accept(Tcb* listener) {
+    MpscNode* node;
+    while ((node = mpsc_pop(listener->accepts)) == NULL) mpsc_wait(listener->accepts);
+    return (Tcb *) ((char *) node - offsetof(Tcb, accept_node));
+}
+
+/**
+ * Selects the congestion control algorithm of a connection. The window starts over from the
+ * initial window. On a listener, the algorithm applies to the connections it spawns later.
+ * @param name: "newreno" (the default) or "cubic".
+ */
+TcpStatus tcp_set_congestion(Tcb* tcb, const char* name) {
+    const CongOps* ops = cong_find(name);
+    if (ops == NULL) return TCP_ERR;
+    atomic_store_explicit(&tcb->cc_next, ops, memory_order_release);
+    return add_command_event(TCP_SET_CONGESTION, (char *) tcb);
+}
+
+/**
+ * Turns keepalive probes on or off for a connection (RFC 1122). On a listener, the setting
+ * applies to the connections it spawns later.
+ */
+TcpStatus tcp_set_keepalive(Tcb* tcb, bool on) {
+    atomic_store_explicit(&tcb->keepalive, on, memory_order_release);
+    return add_command_event(TCP_SET_KEEPALIVE, (char *) tcb);
+}
+
+/**
+ * Sets the sizes of the send and receive rings of the connections a listener spawns later. The
+ * rings are allocated once a connection is established, and no larger than its windows allow.
+ * @param listener: TCB returned by a passive OPEN.
+ * @param snd_buf: send ring size, a power of two up to TCP_MAX_BUF.
+ * @param rcv_buf: receive ring size, a power of two up to TCP_MAX_BUF.
+ */
+TcpStatus tcp_set_buffers(Tcb* listener, uint32_t snd_buf, uint32_t rcv_buf) {
+    if (listener->accepts == NULL) return TCP_ERR;
+    if (snd_buf == 0 || (snd_buf & (snd_buf - 1)) != 0 || snd_buf > TCP_MAX_BUF) return TCP_ERR;
+    if (rcv_buf == 0 || (rcv_buf & (rcv_buf - 1)) != 0 || rcv_buf > TCP_MAX_BUF) return TCP_ERR;
+    atomic_store_explicit(&listener->snd_buf, snd_buf, memory_order_relaxed);
+    atomic_store_explicit(&listener->rcv_buf, rcv_buf, memory_order_relaxed);
+    return TCP_SUCCESS;
+}
+
+/**
+ * Appends data to the send ring of a connection, and has tcp_manager send it. Never blocks.
+ * @param tcb: connection, written to by one thread at a time.
+ * @return the number of octets taken, less than len if the send ring is full.
+ */
+size_t SEND(Tcb* tcb, const char* data, size_t len) {
+    uint32_t tail = atomic_load_explicit(&tcb->snd.tail, memory_order_relaxed);
+    uint32_t room = tcb->snd.size - (tail - atomic_load_explicit(&tcb->snd.head, memory_order_acquire));
+
+    if (len > room) len = room;
+    if (len == 0) return 0;
+    tcp_ring_write(&tcb->snd, tail, data, len);
+    atomic_store_explicit(&tcb->snd.tail, tail + len, memory_order_release);
+    add_command_event(TCP_SEND, (char *) tcb);      // on failure, the data goes with the next segment
+    return len;
+}
+
+/**
+ * Takes received data from the receive ring of a connection. Never blocks.
+ * @param tcb: connection, read from by one thread at a time.
+ * @return the number of octets copied to data, 0 if nothing was received.
+ */
+size_t RECEIVE(Tcb* tcb, char* data, size_t len) {
+    uint32_t head = atomic_load_explicit(&tcb->rcv.head, memory_order_relaxed);
+    uint32_t avail = atomic_load_explicit(&tcb->rcv.tail, memory_order_acquire) - head;
+
+    if (len > avail) len = avail;
+    if (len == 0) return 0;
+    tcp_ring_read(&tcb->rcv, head, data, len);
+    atomic_store_explicit(&tcb->rcv.head, head + len, memory_order_release);
+    add_command_event(TCP_RECEIVE, (char *) tcb);   // lets tcp_manager announce the larger window
+    return len;
+}
+
+/**
+ * Free space in the receive ring, as far as the header can advertise it.
+ */
+uint32_t tcp_rcv_window(Tcb* tcb) {
+    uint32_t used = tcb->rcv_nxt - tcb->irs - 1 - atomic_load_explicit(&tcb->rcv.head, memory_order_acquire);
+    uint32_t free = tcb->rcv.size - used;
+    uint32_t max = (uint32_t) TCP_MAX_WINDOW << tcb->rcv_wscale;
+    return free > max ? max : free;
+}
+
+/**
+ * Takes up the options of the peer's SYN. A SYN of ours offered all of them, and one answering
+ * the peer's offers what the peer did, so the SYN received settles what the connection uses.
+ */
+void tcp_negotiate(Tcb* tcb, TcpOptions* opts) {
+    uint32_t mss = opts->has_mss ? opts->mss : TCP_DEFAULT_MSS;
+
+    tcb->snd_mss = mss < tcp_mss() ? mss : tcp_mss();
+    tcb->wscale_ok = opts->has_wscale;
+    tcb->snd_wscale = opts->has_wscale ? opts->wscale : 0;
+    if (!opts->has_wscale) tcb->rcv_wscale = 0;
+    tcb->ts_ok = opts->has_timestamp;
+    tcb->ts_recent = opts->ts_val;
+    tcb->ts_recent_us = tcp_server.now_us;
+    tcb->sack_ok = opts->sack_permitted;
+
+    cong_init(&tcb->cc, tcb->cc.ops, tcb->snd_mss);
+    if (tcb->backoff > 0) tcb->cc.cwnd = tcb->snd_mss;     // a SYN was lost (RFC 6928 2)
+}
+
+/**
+ * Options a segment gets. A SYN announces the MSS and offers window scaling, timestamps and SACK,
+ * unless it answers a SYN that did not. Once agreed on, every segment carries timestamps, and
+ * ACKs the out of order ranges.
+ */
+void tcp_segment_options(Tcb* tcb, uint8_t flags, TcpOptions* opts) {
+    bool syn = flags & TCP_SYN, offer = !(flags & TCP_ACK);
+
+    opts->has_mss = syn;
+    opts->mss = tcp_mss();
+    opts->has_wscale = syn && (offer || tcb->wscale_ok);
+    opts->wscale = tcb->rcv_wscale;
+    opts->sack_permitted = syn && (offer || tcb->sack_ok);
+    opts->has_timestamp = (syn && offer) || tcb->ts_ok;
+    opts->ts_val = tcp_ts_now();
+    opts->ts_ecr = offer ? 0 : tcb->ts_recent;
+    opts->nsack = 0;
+    if (!syn && (flags & TCP_ACK) && tcb->sack_ok) {
+        opts->nsack = ooo_sack(&tcb->ooo, opts->sack, TCP_MAX_SACK_BLOCKS);
+    }
+}
+
+/**
+ * Payload that fits a data segment sent now, after the options it carries. The IP MTU is checked
+ * every time, so a segment is never fragmented, even after the MTU shrank.
+ */
+uint32_t tcp_seg_room(Tcb* tcb) {
+    TcpOptions opts;
+    uint32_t mss = tcb->snd_mss < tcp_mss() ? tcb->snd_mss : tcp_mss();
+    tcp_segment_options(tcb, TCP_ACK, &opts);
+    return mss - tcp_options_len(&opts);
+}
+
+/**
+ * Payload of a full sized segment from the peer: our MSS, less the timestamps it carries.
+ */
+uint32_t tcp_rcv_mss(Tcb* tcb) {
+    return tcp_mss() - (tcb->ts_ok ? TCP_TIMESTAMP_LEN : 0);
+}
+
+/**
+ * Turns a header as received into the form the stack works with: ports, sequence numbers,
+ * window and urgent pointer in host byte order. The checksum is left as it was on the wire.
+ */
+void tcp_hdr_ntoh(TcpHeader* hdr) {
+    hdr->s_port = ntohs(hdr->s_port);
+    hdr->d_port = ntohs(hdr->d_port);
+    hdr->seq_number = ntohl(hdr->seq_number);
+    hdr->ack_number = ntohl(hdr->ack_number);
+    hdr->window = ntohs(hdr->window);
+    hdr->urgent = ntohs(hdr->urgent);
+}
+
+/**
+ * Turns a header of the stack into network byte order, before its checksum is computed. The
+ * reverse of tcp_hdr_ntoh.
+ */
+void tcp_hdr_hton(TcpHeader* hdr) {
+    hdr->s_port = htons(hdr->s_port);
+    hdr->d_port = htons(hdr->d_port);
+    hdr->seq_number = htonl(hdr->seq_number);
+    hdr->ack_number = htonl(hdr->ack_number);
+    hdr->window = htons(hdr->window);
+    hdr->urgent = htons(hdr->urgent);
+}
+
+/**
+ * Adds the pseudo header of a segment (RFC 9293 3.1) to a partial sum: the addresses, the protocol
+ * and the TCP length, each as it is on the wire.
+ * @param saddr: source address in host byte order, as the IP layer keeps it.
+ * @param daddr: destination address in host byte order.
+ * @param tcp_len: octets of TCP header, options and payload.
+ */
+uint32_t tcp_pseudo_sum(uint32_t saddr, uint32_t daddr, uint16_t tcp_len, uint32_t sum) {
+    uint32_t addrs[2] = { htonl(saddr), htonl(daddr) };
+    sum = csum_partial(addrs, sizeof(addrs), sum);
+    return sum + htons(IP_PROTO_TCP) + htons(tcp_len);
+}
+
+/**
+ * Builds a segment and queues it for sending. Its payload is copied from the send ring, and
+ * summed into the checksum on the way. Must only be called by tcp_manager, which is the output
+ * manager of the IP layer.
+ * @param flags: TCP flags; with TCP_ACK the segment acknowledges rcv_nxt and advertises the window.
+ * @param seq: sequence number of the segment.
+ * @param len: octets of payload, starting at seq in the send ring.
+ */
+TcpStatus tcp_send_segment(Tcb* tcb, uint8_t flags, uint32_t seq, uint32_t len) {
+    IpHeader* ip_hdr = (IpHeader *) tcp_server.segment;
+    TcpHeader* hdr = (TcpHeader *) (tcp_server.segment + sizeof(IpHeader));
+    TcpOptions opts;
+
+    memset(ip_hdr, 0, sizeof(IpHeader) + sizeof(TcpHeader));
+    tcp_segment_options(tcb, flags, &opts);
+    uint16_t hdr_len = sizeof(TcpHeader) + tcp_write_options((char *) (hdr + 1), &opts);
+    uint16_t tcp_len = hdr_len + len;
+
+    ip_hdr->ver = 4;
+    ip_hdr->ihl = sizeof(IpHeader) / 4;
+    ip_hdr->len = sizeof(IpHeader) + tcp_len;
+    ip_hdr->id = tcp_server.ip_id++;
+    ip_hdr->ttl = TCP_TTL;
+    ip_hdr->proto = IP_PROTO_TCP;
+    ip_hdr->saddr = tcb->key.local_ip;
+    ip_hdr->daddr = tcb->key.foreign_ip;
+
+    hdr->s_port = tcb->key.local_port;
+    hdr->d_port = tcb->key.foreign_port;
+    hdr->seq_number = seq;
+    hdr->data_offset = hdr_len / 4;
+    hdr->flags = flags;
+    if (flags & TCP_ACK) {
+        uint8_t shift = (flags & TCP_SYN) ? 0 : tcb->rcv_wscale;    // the window of a SYN is not scaled
+        uint32_t wnd = tcp_rcv_window(tcb) >> shift;
+        hdr->ack_number = tcb->rcv_nxt;
+        hdr->window = wnd > TCP_MAX_WINDOW ? TCP_MAX_WINDOW : wnd;
+        tcb->rcv_wnd = (uint32_t) hdr->window << shift;
+        tcb->rcv_adv = tcb->rcv_nxt + tcb->rcv_wnd;
+        tcb->last_ack_sent = tcb->rcv_nxt;
+        tcb->ack_now = false;               // whatever ACK was owed, this one settles it
+        tcb->ack_delayed = false;
+        tcb->unacked_segs = 0;
+        tw_cancel(&tcp_server.timers, &tcb->delack_timer);
+        if (flags == TCP_ACK && len == 0) atomic_fetch_add_explicit(&tcp_server.pure_acks, 1, memory_order_relaxed);
+    }
+
+    tcp_hdr_hton(hdr);
+    uint32_t sum = tcp_pseudo_sum(ip_hdr->saddr, ip_hdr->daddr, tcp_len, 0);
+    sum = csum_partial(hdr, hdr_len, sum);
+    if (len > 0) sum = tcp_ring_read_csum(&tcb->snd, seq - tcb->iss - 1, (char *) hdr + hdr_len, len, sum);
+    hdr->checksum = csum_fold(sum);
+
+    return queue_for_sending(ip_hdr, (char *) hdr) == IP_SUCCESS ? TCP_SUCCESS : TCP_ERR;
+}
+
+/**
+ * Current retransmission timeout, backed off exponentially for each expiry in a row.
+ */
+uint64_t tcp_rto(Tcb* tcb) {
+    uint64_t rto = (uint64_t) tcb->rto_us << (tcb->backoff < 16 ? tcb->backoff : 16);
+    return rto < TCP_RTO_MAX_US ? rto : TCP_RTO_MAX_US;
+}
+
+void tcp_arm_rto(Tcb* tcb) {
+    tw_arm(&tcp_server.timers, &tcb->rto_timer, tcp_server.now_us + tcp_rto(tcb));
+}
+
+/**
+ * Notes that a segment ending at end was sent: starts timing it if no segment is timed yet, and
+ * starts the retransmission timer if it is not running (RFC 6298 5.1).
+ * @param end: sequence number following the segment.
+ */
+void tcp_sent(Tcb* tcb, uint32_t end) {
+    if (SEQ_GT(end, tcb->snd_max)) {
+        if (tcb->rtt_start_us == 0) {
+            tcb->rtt_seq = end;
+            tcb->rtt_start_us = tcp_server.now_us;
+        }
+        tcb->snd_max = end;
+    }
+    if (!tw_armed(&tcb->rto_timer)) tcp_arm_rto(tcb);
+}
+
+/**
+ * Updates the RTT estimate with a sample and recomputes the retransmission timeout (RFC 6298 2).
+ */
+void tcp_rtt_sample(Tcb* tcb, uint32_t rtt_us) {
+    if (tcb->srtt_us == 0) {
+        tcb->srtt_us = rtt_us > 0 ? rtt_us : 1;
+        tcb->rttvar_us = rtt_us / 2;
+    } else {
+        uint32_t err = tcb->srtt_us > rtt_us ? tcb->srtt_us - rtt_us : rtt_us - tcb->srtt_us;
+        tcb->rttvar_us = (3 * (uint64_t) tcb->rttvar_us + err) / 4;
+        tcb->srtt_us = (7 * (uint64_t) tcb->srtt_us + rtt_us) / 8;
+    }
+    uint64_t var = 4 * (uint64_t) tcb->rttvar_us > TW_TICK_US ? 4 * (uint64_t) tcb->rttvar_us : TW_TICK_US;
+    uint64_t rto = tcb->srtt_us + var;
+    tcb->rto_us = rto < TCP_RTO_MIN_US ? TCP_RTO_MIN_US : rto > TCP_RTO_MAX_US ? TCP_RTO_MAX_US : rto;
+    tcb->cc.rtt_us = tcb->srtt_us;
+}
+
+/**
+ * Sends an acknowledgment with a sequence number the peer has seen already. It is outside the
+ * window, so the peer answers with an ACK carrying its current window: used as a zero window
+ * probe and as a keepalive probe.
+ */
+void tcp_send_probe(Tcb* tcb) {
+    tcp_send_segment(tcb, TCP_ACK, tcb->snd_una - 1, 0);
+}
 
+/**
+ * Drops a connection that stopped answering: it leaves the tables and its timers stop. A
+ * connection that was never handed to the user is freed; the user holds on to the others,
+ * which stay CLOSED.
+ */
+void tcp_drop(Tcb* tcb) {
+    Tcb* t = tcb_lookup(tcp_server.conns, &tcb->key);
+    if (t == tcb) tcb_remove(tcp_server.conns, &tcb->key);
+
+    if (tcb->listener != NULL && tcb->state == TCP_SYN_RCVD) {
+        free_tcb(tcb);
+        return;
+    }
+    tcb_cancel_timers(tcb);
+    tw_cancel(&tcp_server.timers, &tcb->time_wait_timer);
+    tcb->state = TCP_CLOSED;
 }
 
-int OPEN(int local_port, int foreign_ip, int foreign_port) {
-    if (foreign_port == 0 && foreign_port == 0) 
-        // open passive
-    else
-        // open active
+/**
+ * Resends the oldest unacknowledged segment.
+ * @return the octets resent.
+ */
+uint32_t tcp_retransmit(Tcb* tcb) {
+    uint32_t len = tcb->snd_max - tcb->snd_una;
+    uint32_t mss = tcp_seg_room(tcb);
+
+    if (len > mss) len = mss;
+    if (len == 0) return 0;
+    if (SEQ_GT(tcb->rtt_seq, tcb->snd_una)) tcb->rtt_start_us = 0;     // Karn: the sample would be ambiguous
+    tcp_send_segment(tcb, TCP_ACK, tcb->snd_una, len);
+    return len;
+}
+
+/**
+ * Octets in the network. In SACK recovery (RFC 6675) that leaves out what the peer SACKed and
+ * the holes below the highest SACKed octet that were not retransmitted yet, which are lost.
+ */
+uint32_t tcp_pipe(Tcb* tcb) {
+    if (!tcb->in_recovery || !tcb->sack_ok) return tcb->snd_nxt - tcb->snd_una;
+
+    uint32_t high = sack_high(&tcb->scoreboard, tcb->snd_una);
+    uint32_t rexmit = SEQ_LT(tcb->rexmit_nxt, high) ? tcb->rexmit_nxt : high;
+    uint32_t pipe = rexmit - tcb->snd_una - sack_covered(&tcb->scoreboard, tcb->snd_una, rexmit);
+    if (SEQ_GT(tcb->snd_nxt, high)) pipe += tcb->snd_nxt - high;
+    return pipe;
+}
+
+/**
+ * SACK recovery: retransmits the holes in the scoreboard, lowest first, as far as the pipe
+ * leaves room in the window.
+ * @param wnd: smaller of the send and congestion windows.
+ * @param room: largest payload of a segment.
+ */
+void tcp_sack_retransmit(Tcb* tcb, uint32_t wnd, uint32_t room) {
+    SackBlock hole;
+
+    if (SEQ_LT(tcb->rexmit_nxt, tcb->snd_una)) tcb->rexmit_nxt = tcb->snd_una;
+    while (sack_next_hole(&tcb->scoreboard, tcb->rexmit_nxt, &hole)) {
+        uint32_t len = hole.end - hole.start < room ? hole.end - hole.start : room;
+        if (tcp_pipe(tcb) + len > wnd) break;
+        if (tcp_send_segment(tcb, TCP_ACK, hole.start, len) != TCP_SUCCESS) break;
+        if (SEQ_GT(tcb->rtt_seq, hole.start)) tcb->rtt_start_us = 0;      // Karn
+        tcb->rexmit_nxt = hole.start + len;
+        atomic_fetch_add_explicit(&tcp_server.fast_retransmits, 1, memory_order_relaxed);
+    }
+}
+
+/**
+ * Sends as much queued data as the send and congestion windows allow, in segments of at most one
+ * MSS. In SACK recovery the holes go first. With data queued, a zero window and nothing in
+ * flight, starts the persist timer.
+ */
+void tcp_output(Tcb* tcb) {
+    if (tcb->state != TCP_ESTAB) return;
+    if (tcb->snd_wnd > 0 && tw_armed(&tcb->persist_timer)) {
+        tw_cancel(&tcp_server.timers, &tcb->persist_timer);
+        tcb->backoff = 0;
+    }
+
+    uint32_t mss = tcp_seg_room(tcb);
+    uint32_t wnd = tcb->snd_wnd < tcb->cc.cwnd ? tcb->snd_wnd : tcb->cc.cwnd;
+    uint32_t end = tcb->iss + 1 + atomic_load_explicit(&tcb->snd.tail, memory_order_acquire);
+    if (tcb->in_recovery && tcb->sack_ok) tcp_sack_retransmit(tcb, wnd, mss);
+    for (;;) {
+        uint32_t in_flight = tcp_pipe(tcb);
+        uint32_t len = end - tcb->snd_nxt;
+        if (len > mss) len = mss;
+        if (in_flight + len > wnd) len = wnd > in_flight ? wnd - in_flight : 0;
+        if (len == 0) break;
+
+        uint8_t flags = TCP_ACK | (tcb->snd_nxt + len == end ? TCP_PSH : 0);
+        if (tcp_send_segment(tcb, flags, tcb->snd_nxt, len) != TCP_SUCCESS) break;   // out_pool full, retried on the next event
+        tcb->snd_nxt += len;
+        tcp_sent(tcb, tcb->snd_nxt);
+    }
+
+    if (tcb->snd_wnd == 0 && end != tcb->snd_nxt && tcb->snd_una == tcb->snd_max
+        && !tw_armed(&tcb->persist_timer)) {
+        uint64_t t = tcp_rto(tcb);
+        t = t < TCP_PERSIST_MIN_US ? TCP_PERSIST_MIN_US : t > TCP_PERSIST_MAX_US ? TCP_PERSIST_MAX_US : t;
+        tw_arm(&tcp_server.timers, &tcb->persist_timer, tcp_server.now_us + t);
+    }
+}
+
+/**
+ * Retransmission timeout (RFC 6298 5.4 to 5.7): resends the SYN or SYN-ACK of a connection being
+ * set up, or else the oldest unacknowledged segment. The timer backs off, the congestion window
+ * collapses, and sending resumes from snd_una in slow start. Gives up after TCP_MAX_RETRANSMITS.
+ */
+void tcp_rto_fire(TimerNode* t) {
+    Tcb* tcb = (Tcb *) ((char *) t - offsetof(Tcb, rto_timer));
+
+    if (tcb->snd_una == tcb->snd_max) return;       // everything acknowledged meanwhile
+    if (++tcb->backoff > TCP_MAX_RETRANSMITS) {
+        tcp_drop(tcb);
+        return;
+    }
+    atomic_fetch_add_explicit(&tcp_server.timeouts, 1, memory_order_relaxed);
+    tcb->rtt_start_us = 0;                          // Karn: no samples from retransmitted segments
+
+    switch (tcb->state) {
+        case TCP_SYN_SENT:
+            tcp_send_segment(tcb, TCP_SYN, tcb->iss, 0);
+            break;
+        case TCP_SYN_RCVD:
+            tcp_send_segment(tcb, TCP_SYN | TCP_ACK, tcb->iss, 0);
+            break;
+        case TCP_ESTAB: {
+            CongState* cc = &tcb->cc;
+            cc->ops->on_timeout(cc, tcb->snd_max - tcb->snd_una, tcp_server.now_us);
+            tcb->in_recovery = false;
+            tcb->dupacks = 0;
+            tcb->recover = tcb->snd_max;
+            sack_clear(&tcb->scoreboard);       // the peer may have dropped what it SACKed
+            tcb->snd_nxt = tcb->snd_una + tcp_retransmit(tcb);
+            break;
+        }
+        default:
+            return;
+    }
+    tcp_arm_rto(tcb);
+}
+
+/**
+ * Persist timer: probes a zero window, backing off up to TCP_PERSIST_MAX_US. A zero window is
+ * probed for as long as the peer answers (RFC 1122 4.2.2.17).
+ */
+void tcp_persist_fire(TimerNode* t) {
+    Tcb* tcb = (Tcb *) ((char *) t - offsetof(Tcb, persist_timer));
+
+    if (tcb->state != TCP_ESTAB || tcb->snd_wnd > 0) return;
+    tcp_send_probe(tcb);
+    tcb->backoff++;
+
+    uint64_t next = tcp_rto(tcb);
+    next = next < TCP_PERSIST_MIN_US ? TCP_PERSIST_MIN_US : next > TCP_PERSIST_MAX_US ? TCP_PERSIST_MAX_US : next;
+    tw_arm(&tcp_server.timers, &tcb->persist_timer, tcp_server.now_us + next);
+}
+
+/**
+ * Keepalive timer. It stays armed at the idle deadline instead of being moved on every segment:
+ * on expiry it checks how long the connection has really been idle, and either sleeps for the
+ * rest or probes. Drops the connection after TCP_KEEPALIVE_PROBES unanswered probes.
+ */
+void tcp_keepalive_fire(TimerNode* t) {
+    Tcb* tcb = (Tcb *) ((char *) t - offsetof(Tcb, keepalive_timer));
+    uint64_t idle_until = tcb->last_rcv_us + TCP_KEEPALIVE_IDLE_US;
+
+    if (tcb->state != TCP_ESTAB || !atomic_load_explicit(&tcb->keepalive, memory_order_acquire)) return;
+    if (tcb->keepalive_probes == 0 && idle_until > tcp_server.now_us) {
+        tw_arm(&tcp_server.timers, &tcb->keepalive_timer, idle_until);
+        return;
+    }
+    if (tcb->keepalive_probes >= TCP_KEEPALIVE_PROBES) {
+        tcp_drop(tcb);
+        return;
+    }
+    tcp_send_probe(tcb);
+    tcb->keepalive_probes++;
+    tw_arm(&tcp_server.timers, &tcb->keepalive_timer, tcp_server.now_us + TCP_KEEPALIVE_INTVL_US);
+}
+
+/**
+ * Starts or stops the keepalive timer of a synchronized connection as its setting says.
+ */
+void tcp_update_keepalive(Tcb* tcb) {
+    if (tcb->state == TCP_ESTAB && atomic_load_explicit(&tcb->keepalive, memory_order_acquire)) {
+        if (!tw_armed(&tcb->keepalive_timer))
+            tw_arm(&tcp_server.timers, &tcb->keepalive_timer, tcb->last_rcv_us + TCP_KEEPALIVE_IDLE_US);
+    } else {
+        tw_cancel(&tcp_server.timers, &tcb->keepalive_timer);
+    }
+}
+
+/**
+ * Moves a connection to TIME-WAIT, or restarts the 2MSL timer of one that is there already.
+ */
+void tcp_time_wait(Tcb* tcb) {
+    tcb->state = TCP_TIMEWAIT;
+    tcb_cancel_timers(tcb);
+    tw_arm(&tcp_server.timers, &tcb->time_wait_timer, tcp_server.now_us + 2 * TCP_MSL_US);
+}
+
+void tcp_time_wait_fire(TimerNode* t) {
+    tcp_drop((Tcb *) ((char *) t - offsetof(Tcb, time_wait_timer)));
+}
+
+void tcp_delack_fire(TimerNode* t) {
+    Tcb* tcb = (Tcb *) ((char *) t - offsetof(Tcb, delack_timer));
+    if (tcb->ack_delayed) tcp_send_segment(tcb, TCP_ACK, tcb->snd_nxt, 0);
+}
+
+/**
+ * Puts a connection on the list tcp_flush works through once the current batch of events is
+ * processed, so segments and ACKs prompted by several events leave together.
+ */
+void tcp_schedule(Tcb* tcb) {
+    if (tcb->scheduled) return;
+    tcb->scheduled = true;
+    tcb->next_scheduled = tcp_server.scheduled;
+    tcp_server.scheduled = tcb;
+}
+
+/**
+ * End of a batch of events: sends the data the scheduled connections may send, which carries
+ * their acknowledgment. An ACK that is still owed goes out on its own if it is urgent, and is
+ * otherwise held back for TCP_DELACK_US in the hope that data or another segment comes along.
+ */
+void tcp_flush() {
+    Tcb* tcb;
+
+    while ((tcb = tcp_server.scheduled) != NULL) {
+        tcp_server.scheduled = tcb->next_scheduled;
+        tcb->scheduled = false;
+
+        tcp_output(tcb);
+        if (tcb->ack_now) tcp_send_segment(tcb, TCP_ACK, tcb->snd_nxt, 0);
+        else if (tcb->ack_delayed && !tw_armed(&tcb->delack_timer))
+            tw_arm(&tcp_server.timers, &tcb->delack_timer, tcp_server.now_us + TCP_DELACK_US);
+    }
+}
+
+/**
+ * Counts a duplicate acknowledgment (RFC 5681). The third one retransmits the oldest segment and
+ * enters fast recovery, unless it acknowledges less than what was outstanding at the last loss
+ * (RFC 6582). In recovery each further duplicate means a segment left the network, and inflates
+ * the window by one.
+ */
+void tcp_dupack(Tcb* tcb) {
+    uint32_t in_flight = tcb->snd_max - tcb->snd_una;
+    CongState* cc = &tcb->cc;
+
+    if (tcb->in_recovery) {
+        if (!tcb->sack_ok) cc->cwnd += cc->mss;
+        return;
+    }
+    if (++tcb->dupacks != TCP_DUPACK_THRESHOLD || !SEQ_GT(tcb->snd_una, tcb->recover)) return;
+
+    cc->ops->on_loss(cc, in_flight, tcp_server.now_us);
+    tcb->in_recovery = true;
+    tcb->recover = tcb->snd_max;
+    if (tcb->sack_ok) {             // the pipe tells what left the network, tcp_output resends the other holes
+        cc->cwnd = cc->ssthresh;
+        tcb->rexmit_nxt = tcb->snd_una + tcp_retransmit(tcb);
+    } else {
+        cc->cwnd = cc->ssthresh + TCP_DUPACK_THRESHOLD * cc->mss;
+        tcp_retransmit(tcb);
+    }
+    atomic_fetch_add_explicit(&tcp_server.fast_retransmits, 1, memory_order_relaxed);
+}
+
+/**
+ * Grows the congestion window for acked new octets, or, in fast recovery, either leaves recovery
+ * on a full acknowledgment or retransmits the next hole on a partial one (RFC 6582).
+ */
+void tcp_newly_acked(Tcb* tcb, uint32_t acked) {
+    CongState* cc = &tcb->cc;
+
+    tcb->dupacks = 0;
+    if (!tcb->in_recovery) {
+        cc->ops->on_ack(cc, acked, tcp_server.now_us);
+        return;
+    }
+
+    if (SEQ_GEQ(tcb->snd_una, tcb->recover)) {
+        cc->cwnd = cc->ssthresh;
+        tcb->in_recovery = false;
+        return;
+    }
+    if (tcb->sack_ok && tcb->scoreboard.n > 0) return;     // the holes left are resent by tcp_output
+    tcp_retransmit(tcb);
+    cc->cwnd = cc->cwnd > acked ? cc->cwnd - acked : 0;     // deflate by what left the network
+    if (acked >= cc->mss) cc->cwnd += cc->mss;
+    if (cc->cwnd < cc->mss) cc->cwnd = cc->mss;
+}
+
+/**
+ * New data was acknowledged: takes the RTT sample if the timed segment is covered, and stops or
+ * restarts the retransmission timer (RFC 6298 5.2, 5.3).
+ */
+void tcp_acked(Tcb* tcb) {
+    if (tcb->rtt_start_us != 0 && SEQ_GEQ(tcb->snd_una, tcb->rtt_seq)) {
+        tcp_rtt_sample(tcb, tcp_server.now_us - tcb->rtt_start_us);
+        tcb->rtt_start_us = 0;
+    }
+    tcb->backoff = 0;
+    if (tcb->snd_una == tcb->snd_max) tw_cancel(&tcp_server.timers, &tcb->rto_timer);
+    else tcp_arm_rto(tcb);
+}
+
+/**
+ * Processes the acknowledgment and window of a segment (RFC 793, ESTABLISHED state), and its
+ * SACK blocks.
+ * @param len: octets of payload in the segment.
+ * @param opts: options of the segment.
+ */
+void tcp_ack(Tcb* tcb, TcpHeader* hdr, uint32_t len, TcpOptions* opts) {
+    uint32_t ack = hdr->ack_number;
+
+    if (SEQ_GT(ack, tcb->snd_max) || SEQ_LT(ack, tcb->snd_una)) return;    // not for anything we sent
+    for (int i = 0; i < opts->nsack && tcb->sack_ok; i++) {
+        SackBlock* b = &opts->sack[i];
+        if (SEQ_GT(b->start, ack) && SEQ_LEQ(b->end, tcb->snd_max)) sack_add(&tcb->scoreboard, b->start, b->end);
+    }
+    uint32_t wnd = (uint32_t) hdr->window << tcb->snd_wscale;
+    if (SEQ_GT(ack, tcb->snd_una)) {
+        uint32_t acked = ack - tcb->snd_una;
+        tcb->snd_una = ack;
+        sack_trim(&tcb->scoreboard, ack);
+        if (tcb->ts_ok && opts->has_timestamp && opts->ts_ecr != 0) {
+            tcp_rtt_sample(tcb, (tcp_ts_now() - opts->ts_ecr) * 1000);     // RTTM (RFC 7323 4), retransmissions too
+            tcb->rtt_start_us = 0;
+        }
+        if (SEQ_GT(ack, tcb->snd_nxt)) tcb->snd_nxt = ack;     // sent before a timeout
+        atomic_store_explicit(&tcb->snd.head, ack - tcb->iss - 1, memory_order_release);
+        tcp_acked(tcb);
+        tcp_newly_acked(tcb, acked);
+    } else if (len == 0 && wnd == tcb->snd_wnd && tcb->snd_max != tcb->snd_una) {
+        tcp_dupack(tcb);
+    }
+    if (SEQ_LT(tcb->snd_wl1, hdr->seq_number) || (tcb->snd_wl1 == hdr->seq_number && SEQ_LEQ(tcb->snd_wl2, ack))) {
+        tcb->snd_wnd = wnd;
+        tcb->snd_wl1 = hdr->seq_number;
+        tcb->snd_wl2 = ack;
+    }
+}
+
+/**
+ * Keeps a segment that arrived ahead of rcv_nxt: its payload goes into the receive ring at its
+ * place, and its range into the out of order queue. Only what lies within the window advertised,
+ * and within the free part of the ring, is kept; nothing if the queue has no room for another range.
+ */
+void tcp_ooo_add(Tcb* tcb, uint32_t seq, char* data, uint32_t len) {
+    uint32_t limit = tcb->rcv_nxt + tcp_rcv_window(tcb);     // unread data below rcv.head stays untouched
+
+    if (SEQ_LT(tcb->rcv_adv, limit)) limit = tcb->rcv_adv;
+    if (!SEQ_LT(seq, limit)) return;
+    if (SEQ_GT(seq + len, limit)) len = limit - seq;
+    if (ooo_add(&tcb->ooo, seq, seq + len)) tcp_ring_write(&tcb->rcv, seq - tcb->irs - 1, data, len);
+}
+
+/**
+ * Processes a segment on a synchronized connection: its acknowledgment frees the send ring, and
+ * payload in sequence goes straight into the receive ring. Payload is acknowledged at the end of
+ * the batch: right away for every second full sized segment (RFC 1122 4.2.3.2) and for segments
+ * out of order (RFC 5681 4.2), else after a delay.
+ */
+TcpStatus tcp_established(Tcb* tcb, IpHeader* ip_hdr, TcpHeader* hdr, TcpOptions* opts) {
+    uint32_t seq = hdr->seq_number;
+    char* data = (char *) hdr + hdr->data_offset * 4;
+    int32_t len = ip_hdr->len - ip_hdr->ihl * 4 - hdr->data_offset * 4;
+
+    if (len < 0) return TCP_ERR_UNEXPECTED_MESSAGE;
+    if (tcb->ts_ok && opts->has_timestamp && !CHECK_FLAG(hdr, TCP_RST)) {
+        // PAWS (RFC 7323 5.3): a timestamp older than the last one is an old duplicate
+        if (SEQ_LT(opts->ts_val, tcb->ts_recent) && tcp_server.now_us - tcb->ts_recent_us < TCP_PAWS_IDLE_US) {
+            tcb->ack_now = true;
+            tcp_schedule(tcb);
+            return TCP_SUCCESS;
+        }
+        if (SEQ_LEQ(seq, tcb->last_ack_sent)) {
+            tcb->ts_recent = opts->ts_val;
+            tcb->ts_recent_us = tcp_server.now_us;
+        }
+    }
+    if (CHECK_FLAG(hdr, TCP_ACK)) tcp_ack(tcb, hdr, len, opts);
+
+    if (len > 0) {
+        if (SEQ_LT(seq, tcb->rcv_nxt) && SEQ_GT(seq + len, tcb->rcv_nxt)) {    // starts with old data
+            data += tcb->rcv_nxt - seq;
+            len -= tcb->rcv_nxt - seq;
+            seq = tcb->rcv_nxt;
+        }
+        if (seq == tcb->rcv_nxt) {
+            uint32_t wnd = tcp_rcv_window(tcb);
+            if ((uint32_t) len >= tcp_rcv_mss(tcb) && ++tcb->unacked_segs >= 2) tcb->ack_now = true;
+            if ((uint32_t) len > wnd) len = wnd;
+            tcp_ring_write(&tcb->rcv, seq - tcb->irs - 1, data, len);
+            tcb->rcv_nxt += len;
+            if (tcb->ooo.n > 0) {           // the queued data is in place already: the tail jumps over it
+                tcb->rcv_nxt = ooo_take(&tcb->ooo, tcb->rcv_nxt);
+                tcb->ack_now = true;        // a hole was filled (RFC 5681 4.2)
+            }
+            atomic_store_explicit(&tcb->rcv.tail, tcb->rcv_nxt - tcb->irs - 1, memory_order_release);
+            tcb->ack_delayed = true;
+        } else {
+            if (SEQ_GT(seq, tcb->rcv_nxt)) tcp_ooo_add(tcb, seq, data, len);
+            tcb->ack_now = true;
+        }
+    }
+
+    tcp_schedule(tcb);
+    return TCP_SUCCESS;
+}
+
+/**
+ * Moves a connection to ESTABLISHED, handing it to the accept queue of its listener. The rings
+ * of a connection a listener spawned are allocated here, so a SYN costs no more than its TCB.
+ * @return -1 if the rings could not be allocated, and the connection stays where it was.
+ */
+int tcp_establish(Tcb* tcb) {
+    if (tcb->listener != NULL) {
+        uint32_t snd_buf = tcp_ring_fit(atomic_load_explicit(&tcb->snd_buf, memory_order_relaxed), tcb->snd_wscale);
+        uint32_t rcv_buf = tcp_ring_fit(atomic_load_explicit(&tcb->rcv_buf, memory_order_relaxed), tcb->rcv_wscale);
+        if (tcb_init_rings(tcb, snd_buf, rcv_buf) < 0) return -1;
+    }
+    tcb->state = TCP_ESTAB;
+    tcp_update_keepalive(tcb);
+    if (tcb->listener != NULL) mpsc_push(tcb->listener->accepts, &tcb->accept_node);
+    return 0;
+}
+
+/**
+ * Finds the TCB a segment belongs to: the connection with its exact 4-tuple, else a listener on
+ * its local address and port, else a listener on its port and any address.
+ * @param key: 4-tuple of the segment, seen from this end.
+ */
+Tcb* find_tcb(TcbKey* key) {
+    Tcb* tcb = tcb_lookup(tcp_server.conns, key);
+    if (tcb != NULL) return tcb;
+
+    TcbKey listen = { .local_ip = key->local_ip, .local_port = key->local_port };
+    if ((tcb = tcb_lookup(tcp_server.listeners, &listen)) != NULL) return tcb;
+    listen.local_ip = 0;
+    return tcb_lookup(tcp_server.listeners, &listen);
+}
+
+/**
+ * Creates the connection a SYN to a listener asks for, and adds it to the connection table. The
+ * listener stays in LISTEN.
+ * @param listener: TCB of the listening socket.
+ * @param key: 4-tuple of the SYN.
+ */
+Tcb* spawn_tcb(Tcb* listener, TcbKey* key) {
+    Tcb* tcb = (Tcb *) calloc(1, sizeof(Tcb));
+    if (tcb == NULL) return NULL;
+    if (pthread_mutex_init(&tcb->lck, NULL) != 0) {
+        free(tcb);
+        return NULL;
+    }
+    memcpy(tcb->name, listener->name, sizeof(tcb->name));
+    tcb->key = *key;
+    tcb->listener = listener;
+    tcb_init_state(tcb, listener->cc.ops);
+    atomic_store_explicit(&tcb->keepalive, atomic_load(&listener->keepalive), memory_order_relaxed);
+    uint32_t rcv_buf = atomic_load(&listener->rcv_buf);
+    atomic_store_explicit(&tcb->snd_buf, atomic_load(&listener->snd_buf), memory_order_relaxed);
+    atomic_store_explicit(&tcb->rcv_buf, rcv_buf, memory_order_relaxed);
+    tcb->rcv_wscale = tcp_wscale(rcv_buf);
+    tcb->rcv.size = rcv_buf;                    // sizes the window of the SYN-ACK; the ring comes with ESTABLISHED
+
+    if (tcb_insert(tcp_server.conns, key, tcb) != TCB_SUCCESS) {
+        free_tcb(tcb);
+        return NULL;
+    }
+    return tcb;
 }
 
 /**
@@ -137,35 +1305,50 @@ int OPEN(int local_port, int foreign_ip, int foreign_port) {
  */
 TcpStatus process_tcp_packet(Event* e) {
 
-    IpPacket p = e.p;
-    IpHeader* ip_hdr = p.hdr;
-    TcpHeader* tcp_hdr = (TcpHeader *) p.data;
+    PktBuf* buf = e->p.buf;
+    IpHeader* ip_hdr = (IpHeader *) buf->data;
+    TcpHeader* tcp_hdr = (TcpHeader *) pktbuf_pull(buf, ip_hdr->ihl * 4);
+    if (tcp_hdr == NULL || pktbuf_len(buf) < sizeof(TcpHeader)) return TCP_ERR_MALFORMED;
+    uint16_t tcp_len = pktbuf_len(buf);
+    if (tcp_hdr->data_offset < 5 || tcp_hdr->data_offset * 4 > tcp_len) return TCP_ERR_MALFORMED;
 
-    Tcb* current = tcp_server.tc_blocks;
-    while ((current != NULL) && !((current->local_port == hdr->d_port) && (current->foreign_ip == ip_hdr->saddr) && (current->foreign_port == hdr->s_port)))
-        current = current.next;
+    uint32_t sum = tcp_pseudo_sum(ip_hdr->saddr, ip_hdr->daddr, tcp_len, 0);
+    if (csum_fold(csum_partial(tcp_hdr, tcp_len, sum)) != 0) return TCP_ERR_MALFORMED;
+    tcp_hdr_ntoh(tcp_hdr);
+
+    TcbKey key = { 
+        .local_ip = ip_hdr->daddr, .local_port = tcp_hdr->d_port, 
+        .foreign_ip = ip_hdr->saddr, .foreign_port = tcp_hdr->s_port,
+    };
+    Tcb* current = find_tcb(&key);
     
     if (current == NULL) {
         // set error message.
         return TCP_ERR_PORT_CLOSED;
     }
+    current->last_rcv_us = tcp_server.now_us;
+    current->keepalive_probes = 0;
 
-    switch (current.state) {
+    TcpOptions opts;
+    if (tcp_parse_options(tcp_hdr, &opts) < 0) return TCP_ERR_UNEXPECTED_MESSAGE;
+
+    switch (current->state) {
         case TCP_LISTEN:
             if (CHECK_FLAG(tcp_hdr, TCP_SYN)) {
                 
+                if ((current = spawn_tcb(current, &key)) == NULL) return TCP_ERR;
                 current->irs = tcp_hdr->seq_number;
+                current->rcv_nxt = current->irs + 1;
+                current->snd_wnd = tcp_hdr->window;
+                current->snd_wl1 = tcp_hdr->seq_number;
+                tcp_negotiate(current, &opts);
 
-                TcpHeader* ans_tcp_hdr = (TcpHeader *) malloc(sizeof(TcpHeader));
-
-                SET_FLAG(ans_tcp_hdr, TCP_ACK);
-                ans_tcp_hdr->ack_number = current->irs+1;            // potentially mod something...
-                SET_FLAG(ans_tcp_hdr, TCP_SYN);
-                ans_tcp_hdr->seq_number = current->iss;
+                current->last_rcv_us = tcp_server.now_us;
+                tcp_send_segment(current, TCP_SYN | TCP_ACK, current->iss, 0);
+                current->snd_nxt = current->iss + 1;
+                tcp_sent(current, current->snd_nxt);
 
-                // load port, ip etc arguments and send.
-
-                current.state = TCP_SYN_RCVD;
+                current->state = TCP_SYN_RCVD;
 
             } else {
                 // set error message
@@ -174,8 +1357,12 @@ TcpStatus process_tcp_packet(Event* e) {
             break;
         case TCP_SYN_RCVD:
             if (CHECK_FLAG(tcp_hdr, TCP_ACK)) {
-                if (tcp_hdr->ack_number == current.iss+1) {
-                    current.state = TCP_ESTAB;
+                if (tcp_hdr->ack_number == current->iss+1) {
+                    if (tcp_establish(current) < 0) {
+                        tcp_drop(current);
+                        return TCP_ERR;
+                    }
+                    return tcp_established(current, ip_hdr, tcp_hdr, &opts);
                 } else {
                     // set error message
                     return TCP_ERR_ACK_FAILED;
@@ -187,36 +1374,36 @@ TcpStatus process_tcp_packet(Event* e) {
             break;
         case TCP_SYN_SENT:
             if (CHECK_FLAG(tcp_hdr, TCP_SYN) && !CHECK_FLAG(tcp_hdr, TCP_ACK)) {
-                // send ack
-
-                TcpHeader* ans_tcp_hdr = (TcpHeader *) malloc(sizeof(TcpHeader));
+                // simultaneous open, answer with our SYN again
 
                 current->irs = tcp_hdr->seq_number;
-                SET_FLAG(ans_tcp_hdr, TCP_ACK);
-                ans_tcp_hdr->ack_number = current->irs+1;
+                current->rcv_nxt = current->irs + 1;
+                tcp_negotiate(current, &opts);
+                tcp_send_segment(current, TCP_SYN | TCP_ACK, current->iss, 0);
 
-                // load port, ip and send answer.
-
-                current.state = TCP_SYN_RCVD;
+                current->state = TCP_SYN_RCVD;
                 
             } else if (CHECK_FLAG(tcp_hdr, TCP_SYN) && CHECK_FLAG(tcp_hdr, TCP_ACK)) {
 
                 // check if ack is correct,
-                if (tcp_hdr->ack_number != current.irs+1) {
+                if (tcp_hdr->ack_number != current->iss+1) {
                     // set error message
                     return TCP_ERR_ACK_FAILED;
                 }
 
-                TcpHeader* ans_tcp_hdr = (TcpHeader *) malloc(sizeof(TcpHeader));
-
                 // send ack
+                tcp_negotiate(current, &opts);
                 current->irs = tcp_hdr->seq_number;
-                SET_FLAG(ans_tcp_hdr, TCP_ACK);
-                ans_tcp_hdr->ack_number = current->irs+1;
-
-                // load port, ip and send answer.
+                current->rcv_nxt = current->irs + 1;
+                current->snd_una = tcp_hdr->ack_number;
+                tcp_acked(current);
+                current->snd_wnd = tcp_hdr->window;
+                current->snd_wl1 = tcp_hdr->seq_number;
+                current->snd_wl2 = tcp_hdr->ack_number;
 
-                current.state = TCP_ESTAB;
+                tcp_establish(current);
+                current->ack_now = true;
+                tcp_schedule(current);
 
             } else {
                 // set error message
@@ -225,7 +1412,15 @@ TcpStatus process_tcp_packet(Event* e) {
 
             break;
         case TCP_ESTAB:
-            // Not yet implemented.
+            return tcp_established(current, ip_hdr, tcp_hdr, &opts);
+        case TCP_TIMEWAIT:
+            // only a retransmitted FIN can arrive: acknowledge it again and restart 2MSL
+            if (CHECK_FLAG(tcp_hdr, TCP_FIN)) {
+                tcp_send_segment(current, TCP_ACK, current->snd_nxt, 0);
+                tcp_time_wait(current);
+            }
+            break;
+        default:
             break;
     }
 
@@ -236,40 +1431,134 @@ TcpStatus process_tcp_packet(Event* e) {
  * This method handles user command
  */
 TcpStatus tcp_process_command(Event* e) {
-    IpPacket p = e.p;
-    IpHeader* ip_hdr = p.hdr;
-    TcpHeader* tcp_hdr = (TcpHeader *) p.data;
-
-    if (e.type != USER_COMMAND) {
+    if (e->type != USER_COMMAND) {
         // set error message
         return TCP_ERR;
     }
     
-    // find the right block.
+    Tcb* tcb = (Tcb *) e->c.data;
+    TcbStatus s;
 
-    // OPEN: create a new TCB.
+    switch (e->c.c) {
+        case TCP_PASSIVE_OPEN:
+            tcb->state = TCP_LISTEN;
+            s = tcb_insert(tcp_server.listeners, &tcb->key, tcb);
+            break;
+        case TCP_ACTIVE_OPEN:
+            tcb->state = TCP_SYN_SENT;
+            if ((s = tcb_insert(tcp_server.conns, &tcb->key, tcb)) != TCB_SUCCESS) break;
+            tcp_send_segment(tcb, TCP_SYN, tcb->iss, 0);
+            tcb->snd_nxt = tcb->iss + 1;
+            tcp_sent(tcb, tcb->snd_nxt);
+            break;
+        case TCP_SEND:
+            tcp_schedule(tcb);
+            return TCP_SUCCESS;
+        case TCP_SET_CONGESTION: {
+            const CongOps* ops = atomic_exchange_explicit(&tcb->cc_next, NULL, memory_order_acquire);
+            if (ops != NULL) {
+                cong_init(&tcb->cc, ops, tcb->snd_mss);
+                tcb->in_recovery = false;
+                tcb->dupacks = 0;
+            }
+            return TCP_SUCCESS;
+        }
+        case TCP_SET_KEEPALIVE:
+            tcp_update_keepalive(tcb);
+            return TCP_SUCCESS;
+        case TCP_RECEIVE:
+            // announce the window once it grew by a segment or half the ring (RFC 1122 SWS avoidance)
+            if (tcb->state == TCP_ESTAB) {
+                uint32_t edge = tcb->rcv_nxt + tcp_rcv_window(tcb);
+                uint32_t mss = tcp_mss();
+                if (SEQ_GT(edge, tcb->rcv_adv) && edge - tcb->rcv_adv >= (tcb->rcv.size / 2 < mss ? tcb->rcv.size / 2 : mss)) {
+                    tcb->ack_now = true;
+                    tcp_schedule(tcb);
+                }
+            }
+            return TCP_SUCCESS;
+        default:
+            // find the right block.
+            return TCP_SUCCESS;
+    }
 
+    if (s != TCB_SUCCESS) {
+        free_tcb(tcb);
+        return s == TCB_ERR_EXISTS ? TCP_ERR_CONN_EXISTS : TCP_ERR;
+    }
     return TCP_SUCCESS;
 }
 
-void* tcp_manager() {
+/**
+ * Sets the clock of tcp_manager and fires the timers that expired.
+ * @param now_us: current time; tests pass a made up clock.
+ */
+void tcp_tick(uint64_t now_us) {
+    tcp_server.now_us = now_us;
+    tw_advance(&tcp_server.timers, now_us);
+}
 
-    while(true) { // need to be changed later
+/**
+ * Processes everything queued so far, then gives the events back to their pools. A producer still
+ * linking its event in is picked up on the next round.
+ * @return the number of events processed.
+ */
+int tcp_process_events() {
+    Event* e;
+    int n = 0;
+
+    while ((e = (Event *) mpsc_pop(&tcp_server.events)) != NULL) {
+        if (e->type == IP_PACKET_IN) {
+            process_tcp_packet(e);
+            pktbuf_put(e->p.buf);
+        }
+        else tcp_process_command(e);
+        event_put(e);
+        n++;
+    }
+    tcp_flush();
+    event_flush();
+    return n;
+}
+
+/**
+ * Returns the congestion window of a connection. Only for tests, racy otherwise.
+ */
+uint32_t tcp_cwnd(Tcb* tcb) {
+    return tcb->cc.cwnd;
+}
+
+/**
+ * Returns the smoothed round trip time of a connection. Only for tests, racy otherwise.
+ */
+uint32_t tcp_srtt(Tcb* tcb) {
+    return tcb->srtt_us;
+}
 
-        // get an event
-        if (event_queue_empty())
-            sleep();
+/**
+ * Returns the state of a connection. Only for tests, racy otherwise.
+ */
+TcpState tcp_state(Tcb* tcb) {
+    return tcb->state;
+}
 
-        Event* e;
+void* tcp_manager() {
 
-        pthread_mutex_lock(&tcp_server.lck);
-        e = tcp_server.events;
-        tcp_server.events = e.next;
-        pthread_mutex_unlock(&tcp_server.lck);
+    pin_to_core(tcp_server.core);
 
-        if (e.type == TCP_PACKET) {
-            process_tcp_packet(e);
+    while(true) { // need to be changed later
+
+        if (event_queue_empty() && tcp_server.spin_budget_us) {
+            uint64_t deadline = monotonic_us() + tcp_server.spin_budget_us;
+            while (event_queue_empty() && monotonic_us() < deadline) cpu_relax();
         }
-        else tcp_process_command(e);
+
+        // block until add_event signals a non-empty queue, or the next timer is due
+        int64_t timeout_us = tw_next_us(&tcp_server.timers);
+        mpsc_wait_timeout(&tcp_server.events, timeout_us < 0 ? -1 : (int) ((timeout_us + 999) / 1000));
+
+        tcp_tick(monotonic_us());
+        tcp_process_events();
+        if (!event_queue_empty()) cpu_relax();
     }
 }
\ No newline at end of file
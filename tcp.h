@@ -1,4 +1,8 @@
+#ifndef TCP
+#define TCP
+
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "ip.h"
 
@@ -9,6 +13,8 @@ typedef enum {
     TCP_ERR_PORT_CLOSED,            // A packet was received, but there associated port is closed.
     TCP_ERR_UNEXPECTED_MESSAGE,     // The state machine received an unexpected message.
     TCP_ERR_ACK_FAILED,             
+    TCP_ERR_CONN_EXISTS,            // OPEN was called for a connection that exists already
+    TCP_ERR_MALFORMED,              // A segment was dropped as truncated, or for a wrong checksum.
 } TcpStatus;
 
 typedef enum {
@@ -19,6 +25,8 @@ typedef enum {
     TCP_CLOSE,
     TCP_ABORT,
     TCP_STATUS,
+    TCP_SET_CONGESTION,
+    TCP_SET_KEEPALIVE,
 } TcpCommand;
 
 typedef enum {
@@ -31,7 +39,7 @@ typedef enum {
     TCP_FINWAIT_2,
     TCP_CLOSING,
     TCP_TIMEWAIT,
-} TcpState
+} TcpState;
 
 #define TCP_URG 0b100000
 #define TCP_ACK 0b010000
@@ -45,16 +53,35 @@ typedef enum {
 
 #define CHECK_FLAG(hdr, flag) ((hdr)->flags & flag)
 
+// Sequence number comparisons, modulo 2^32
+#define SEQ_LT(a, b) ((int32_t) ((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t) ((a) - (b)) <= 0)
+#define SEQ_GT(a, b) ((int32_t) ((a) - (b)) > 0)
+#define SEQ_GEQ(a, b) ((int32_t) ((a) - (b)) >= 0)
+
 
+/*
+ * The data offset and the flags are laid out octet by octet as on the wire. The other fields are
+ * in host byte order inside the stack; tcp_hdr_ntoh and tcp_hdr_hton convert a header where it
+ * is received and before it is checksummed for sending.
+ */
 typedef struct __attribute__((__packed__))
 {
     uint16_t s_port;                // source port
     uint16_t d_port;                // destination port
     uint32_t seq_number;
     uint32_t ack_number;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint8_t reserved : 4;
+    uint8_t data_offset : 4;        // header length in 32bit words
+    uint8_t flags : 6;
+    uint8_t ecn : 2;                // CWR and ECE (RFC 3168), not used
+#else
     uint8_t data_offset : 4;
-    uint8_t reserved : 6;
+    uint8_t reserved : 4;
+    uint8_t ecn : 2;
     uint8_t flags : 6;
+#endif
     uint16_t window;
     uint16_t checksum;
     uint16_t urgent;
@@ -62,5 +89,65 @@ typedef struct __attribute__((__packed__))
     // 
 } TcpHeader;
 
-void store_packet(IpHeader* hdr, char* data);
+#define IP_PROTO_TCP 6
+#define TCP_TTL 64                  // time to live of the segments sent
+#define TCP_SND_BUF (1 << 20)       // send ring of a connection in octets, a power of two
+#define TCP_RCV_BUF (1 << 20)       // receive ring of a connection in octets, a power of two
+#define TCP_MAX_BUF (1 << 30)       // largest ring, the largest window at the largest shift
+#define TCP_MAX_WINDOW 65535        // largest window the header can advertise, before scaling
+#define TCP_DEFAULT_MSS 536         // MSS of a peer that announces none (RFC 9293 3.7.1)
+#define TCP_DUPACK_THRESHOLD 3      // duplicate acknowledgments that trigger a fast retransmit
+
+#define TCP_RTO_INITIAL_US 1000000  // retransmission timeout before the first RTT sample (RFC 6298)
+#define TCP_RTO_MIN_US 1000000
+#define TCP_RTO_MAX_US 60000000
+#define TCP_MAX_RETRANSMITS 12      // consecutive timeouts after which a connection is dropped
+#define TCP_PERSIST_MIN_US 5000000  // bounds of the zero window probe interval
+#define TCP_PERSIST_MAX_US 60000000
+#define TCP_KEEPALIVE_IDLE_US 7200000000ULL     // idle time before the first keepalive probe (RFC 1122)
+#define TCP_KEEPALIVE_INTVL_US 75000000
+#define TCP_KEEPALIVE_PROBES 9      // unanswered probes after which a connection is dropped
+#define TCP_MSL_US 30000000         // maximum segment lifetime; TIME-WAIT lasts twice as long
+#define TCP_DELACK_US 40000         // longest an acknowledgment is held back (RFC 1122: < 500 ms)
+#define TCP_PAWS_IDLE_US 2073600000000ULL       // 24 days: an older TS.Recent no longer rejects segments (RFC 7323 5.5)
+
+#define TCP_EVENT_SLAB 256          // events an event pool allocates at once when it runs dry
+#define TCP_EVENT_BATCHES 8         // pools tcp_manager gathers returned events for at a time
+
+typedef struct Tcb Tcb;
+
+typedef struct {
+    uint64_t event_mallocs;         // mallocs made by the event pools, flat once they are warm
+    uint64_t fast_retransmits;      // segments retransmitted after duplicate acknowledgments
+    uint64_t timeouts;              // retransmission timer expiries
+    uint64_t pure_acks;             // segments sent with neither data nor SYN
+} TcpStats;
+
+TcpStatus tcp_init(char* (*get_packet)(), IpStatus (*send_packet)(char*));
+TcpStatus tcp_set_busy_poll(int core, unsigned spin_budget_us);
+TcpStatus OPEN(uint32_t local_ip, uint16_t local_port, uint32_t foreign_ip, uint16_t foreign_port, Tcb** tcb);
+Tcb* tcp_accept(Tcb* listener);
+size_t SEND(Tcb* tcb, const char* data, size_t len);
+size_t RECEIVE(Tcb* tcb, char* data, size_t len);
+TcpStatus tcp_set_congestion(Tcb* tcb, const char* name);
+TcpStatus tcp_set_keepalive(Tcb* tcb, bool on);
+TcpStatus tcp_set_buffers(Tcb* listener, uint32_t snd_buf, uint32_t rcv_buf);
+void tcp_hdr_ntoh(TcpHeader* hdr);
+void tcp_hdr_hton(TcpHeader* hdr);
+void tcp_get_stats(TcpStats* stats);
+void* tcp_manager();
+
+#ifdef DEBUG_INFO_ENABLED
+
+void add_packet_event(PktBuf* buf);
+int tcp_process_events();
+void tcp_tick(uint64_t now_us);
+uint32_t tcp_cwnd(Tcb* tcb);
+uint32_t tcp_srtt(Tcb* tcb);
+TcpState tcp_state(Tcb* tcb);
+uint32_t tcp_pseudo_sum(uint32_t saddr, uint32_t daddr, uint16_t tcp_len, uint32_t sum);
+
+#endif
+
+#endif
 
@@ -0,0 +1,166 @@
+#include <stdint.h>
+
+#include "tcp_options.h"
+
+/*
+ * Multi-octet option fields are big endian on the wire, and read and written octet by octet.
+ */
+static uint16_t get16(const uint8_t* p) {
+    return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+static uint32_t get32(const uint8_t* p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static uint8_t* put16(uint8_t* p, uint16_t v) {
+    *p++ = v >> 8;
+    *p++ = v;
+    return p;
+}
+
+static uint8_t* put32(uint8_t* p, uint32_t v) {
+    return put16(put16(p, v >> 16), v);
+}
+
+/**
+ * Parses the options between the fixed header and the data of a segment. Unknown options are
+ * skipped, SACK blocks beyond TCP_MAX_SACK_BLOCKS ignored. Segments of an established connection
+ * usually carry nothing but timestamps, laid out as RFC 7323 appendix A suggests: those are read
+ * without walking the list.
+ * @param hdr: header of the segment, followed by its options.
+ * @param opts: set to the options found.
+ * @return 0, or -1 if the options are malformed and the segment should be dropped.
+ */
+int tcp_parse_options(const TcpHeader* hdr, TcpOptions* opts) {
+    const uint8_t* p = (const uint8_t *) (hdr + 1);
+    int len = hdr->data_offset * 4 - (int) sizeof(TcpHeader);
+
+    opts->has_mss = false;
+    opts->has_wscale = false;
+    opts->has_timestamp = false;
+    opts->sack_permitted = false;
+    opts->nsack = 0;
+    if (len < 0) return -1;
+    if (len == TCP_TIMESTAMP_LEN && p[0] == TCP_OPT_NOP && p[1] == TCP_OPT_NOP && p[2] == TCP_OPT_TIMESTAMP && p[3] == 10) {
+        opts->has_timestamp = true;
+        opts->ts_val = get32(p + 4);
+        opts->ts_ecr = get32(p + 8);
+        return 0;
+    }
+
+    for (int i = 0; i < len; ) {
+        if (p[i] == TCP_OPT_EOL) break;
+        if (p[i] == TCP_OPT_NOP) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= len || p[i + 1] < 2 || i + p[i + 1] > len) return -1;
+
+        uint8_t olen = p[i + 1];
+        switch (p[i]) {
+            case TCP_OPT_MSS:
+                if (olen != 4) return -1;
+                opts->has_mss = true;
+                opts->mss = get16(p + i + 2);
+                break;
+            case TCP_OPT_WSCALE:
+                if (olen != 3) return -1;
+                opts->has_wscale = true;
+                opts->wscale = p[i + 2] > TCP_MAX_WSCALE ? TCP_MAX_WSCALE : p[i + 2];
+                break;
+            case TCP_OPT_SACK_PERMITTED:
+                if (olen != 2) return -1;
+                opts->sack_permitted = true;
+                break;
+            case TCP_OPT_SACK:
+                if ((olen - 2) % sizeof(SackBlock) != 0) return -1;
+                for (int b = 2; b < olen && opts->nsack < TCP_MAX_SACK_BLOCKS; b += sizeof(SackBlock)) {
+                    opts->sack[opts->nsack].start = get32(p + i + b);
+                    opts->sack[opts->nsack++].end = get32(p + i + b + 4);
+                }
+                break;
+            case TCP_OPT_TIMESTAMP:
+                if (olen != 10) return -1;
+                opts->has_timestamp = true;
+                opts->ts_val = get32(p + i + 2);
+                opts->ts_ecr = get32(p + i + 6);
+                break;
+            default:
+                break;
+        }
+        i += olen;
+    }
+    return 0;
+}
+
+/**
+ * SACK blocks that fit next to the other options.
+ */
+static uint8_t tcp_sack_room(const TcpOptions* opts) {
+    uint8_t used = opts->has_timestamp ? TCP_TIMESTAMP_LEN : 0;
+    return (TCP_MAX_OPTIONS_LEN - used - 4) / sizeof(SackBlock);
+}
+
+/**
+ * Octets the options take in a header, padded to a multiple of 4.
+ */
+uint8_t tcp_options_len(const TcpOptions* opts) {
+    uint8_t len = 0;
+    uint8_t nsack = opts->nsack < tcp_sack_room(opts) ? opts->nsack : tcp_sack_room(opts);
+
+    if (opts->has_mss) len += 4;
+    if (opts->has_wscale) len += 4;
+    if (opts->sack_permitted) len += 4;
+    if (opts->has_timestamp) len += TCP_TIMESTAMP_LEN;
+    if (nsack > 0) len += 4 + nsack * sizeof(SackBlock);
+    return len;
+}
+
+/**
+ * Writes the options, each aligned on 4 octets with leading NOPs. SACK blocks that do not fit
+ * are left out, the last ones first.
+ * @param buf: where the options go, right after the fixed header; room for TCP_MAX_OPTIONS_LEN.
+ * @return octets written, tcp_options_len(opts).
+ */
+uint8_t tcp_write_options(char* buf, const TcpOptions* opts) {
+    uint8_t* p = (uint8_t *) buf;
+    uint8_t nsack = opts->nsack < tcp_sack_room(opts) ? opts->nsack : tcp_sack_room(opts);
+
+    if (opts->has_mss) {
+        *p++ = TCP_OPT_MSS;
+        *p++ = 4;
+        p = put16(p, opts->mss);
+    }
+    if (opts->has_wscale) {
+        *p++ = TCP_OPT_NOP;
+        *p++ = TCP_OPT_WSCALE;
+        *p++ = 3;
+        *p++ = opts->wscale;
+    }
+    if (opts->sack_permitted) {
+        *p++ = TCP_OPT_NOP;
+        *p++ = TCP_OPT_NOP;
+        *p++ = TCP_OPT_SACK_PERMITTED;
+        *p++ = 2;
+    }
+    if (opts->has_timestamp) {
+        *p++ = TCP_OPT_NOP;
+        *p++ = TCP_OPT_NOP;
+        *p++ = TCP_OPT_TIMESTAMP;
+        *p++ = 10;
+        p = put32(p, opts->ts_val);
+        p = put32(p, opts->ts_ecr);
+    }
+    if (nsack > 0) {
+        *p++ = TCP_OPT_NOP;
+        *p++ = TCP_OPT_NOP;
+        *p++ = TCP_OPT_SACK;
+        *p++ = 2 + nsack * sizeof(SackBlock);
+        for (uint8_t b = 0; b < nsack; b++) {
+            p = put32(p, opts->sack[b].start);
+            p = put32(p, opts->sack[b].end);
+        }
+    }
+    return p - (uint8_t *) buf;
+}
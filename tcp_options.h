@@ -0,0 +1,51 @@
+#ifndef TCP_OPTIONS
+#define TCP_OPTIONS
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "tcp.h"
+
+#define TCP_OPT_EOL 0
+#define TCP_OPT_NOP 1
+#define TCP_OPT_MSS 2
+#define TCP_OPT_WSCALE 3
+#define TCP_OPT_SACK_PERMITTED 4
+#define TCP_OPT_SACK 5
+#define TCP_OPT_TIMESTAMP 8
+
+#define TCP_MAX_OPTIONS_LEN 40      // data_offset is 4 bits: at most 60 octets of header
+#define TCP_MAX_SACK_BLOCKS 4       // as many as fit the option space
+#define TCP_TIMESTAMP_LEN 12        // timestamps with their two leading NOPs
+#define TCP_MAX_WSCALE 14           // largest window shift (RFC 7323 2.3)
+
+/*
+ * A range of sequence numbers, end excluded.
+ */
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+} SackBlock;
+
+/*
+ * Options of a segment, parsed or to be written. Multi-octet values are in host byte order here;
+ * tcp_parse_options and tcp_write_options convert them from and to the big endian wire format.
+ */
+typedef struct {
+    bool has_mss;
+    bool has_wscale;
+    bool has_timestamp;
+    bool sack_permitted;
+    uint16_t mss;                   // largest segment the sender of the SYN takes in
+    uint8_t wscale;                 // shift the sender of the SYN applies to its windows
+    uint8_t nsack;                  // number of SACK blocks
+    uint32_t ts_val;
+    uint32_t ts_ecr;
+    SackBlock sack[TCP_MAX_SACK_BLOCKS];
+} TcpOptions;
+
+int tcp_parse_options(const TcpHeader* hdr, TcpOptions* opts);
+uint8_t tcp_options_len(const TcpOptions* opts);
+uint8_t tcp_write_options(char* buf, const TcpOptions* opts);
+
+#endif
@@ -6,12 +6,23 @@
 
 #include "ip.h"
 #include "reassembly_store.h"
+#include "checksum.h"
+#include "tcb_table.h"
+#include "mpsc_queue.h"
+#include "congestion.h"
+#include "timer_wheel.h"
+#include "tcp_options.h"
+#include "sack.h"
+#include "ooo_queue.h"
+#include "tcp.h"
 
 typedef enum {
     PASS,
     FAIL
 } TestResult;
 
+RasStore* rs;
+
 /**
  * Write a packet directly into out_pool, and then read it out, check for consistency.
  * 
@@ -21,7 +32,7 @@ TestResult test_out_pool() {
 
     printf("Testing out pool...\t");
 
-    iphdr* hdr = (iphdr *) malloc(sizeof(iphdr));
+    IpHeader* hdr = (IpHeader *) calloc(1, sizeof(IpHeader));
     char payload[8] = "abcdefg!";
 
     hdr->ihl = 5;   
@@ -29,7 +40,7 @@ TestResult test_out_pool() {
     hdr->saddr = 1234;
 
     out_pool_append(hdr, payload);
-    iphdr* new_hdr = (iphdr *) malloc(sizeof(iphdr));
+    IpHeader* new_hdr = (IpHeader *) malloc(sizeof(IpHeader));
     char* new_payload = malloc(100 * sizeof(char));
     out_pool_pop(new_hdr, new_payload);
     
@@ -45,6 +56,40 @@ TestResult test_out_pool() {
     return result;
 }
 
+/**
+ * Push packets through the out_pool until the indices wrap around several times, and check that
+ * a full pool refuses new packets.
+ */
+TestResult test_out_pool_wrap() {
+    TestResult result = PASS;
+
+    printf("Testing out pool wrap...\t");
+
+    IpHeader hdr = {0};
+    IpHeader new_hdr;
+    char payload[8] = "abcdefg!";
+    char new_payload[8];
+
+    hdr.ihl = 5;
+    hdr.len = hdr.ihl * 4 + 8;
+
+    for (int i = 0; i < 3 * MAX_MESSAGE_POOL; i++) {
+        hdr.id = i;
+        if (out_pool_append(&hdr, payload) != IP_SUCCESS) result = FAIL;
+        out_pool_pop(&new_hdr, new_payload);
+        if (new_hdr.id != i || memcmp(payload, new_payload, 8) != 0) result = FAIL;
+    }
+
+    for (int i = 0; i < MAX_MESSAGE_POOL; i++)
+        if (out_pool_append(&hdr, payload) != IP_SUCCESS) result = FAIL;
+    if (out_pool_append(&hdr, payload) != IP_ERR_OUT_POOL_FULL) result = FAIL;
+    while (!out_pool_empty()) out_pool_pop(&new_hdr, new_payload);
+
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+
+    return result;
+}
+
 /**
  * Submit a large packet for sending. Reassemble the message 
  */
@@ -52,7 +97,7 @@ TestResult test_fragmentation() {
     TestResult result = PASS;
     printf("Testing fragmentation...\t");
 
-    iphdr* hdr = (iphdr *)malloc(sizeof(iphdr));
+    IpHeader* hdr = (IpHeader *) calloc(1, sizeof(IpHeader));
     char* payload = malloc(100 * sizeof(char));
     for (int i = 0; i < 100; i++) {
         payload[i] = 33 + i;
@@ -60,10 +105,13 @@ TestResult test_fragmentation() {
     hdr->ihl = 5;
     hdr->len = hdr->ihl * 4 + 100;
 
+    uint16_t mtu = ip_get_mtu();
+    ip_set_mtu(28);                                        // 8 octet fragments
     queue_for_sending(hdr, payload);
+    ip_set_mtu(mtu);
 
     char* recovered_message = (char *) malloc(100 * sizeof(char));
-    iphdr* new_hdr = (iphdr *) malloc(sizeof(iphdr));
+    IpHeader* new_hdr = (IpHeader *) malloc(sizeof(IpHeader));
     char* new_payload = (char *) malloc(8 * sizeof(char)); // this is 8 for testing purposes...
 
     while (!out_pool_empty()) {
@@ -81,12 +129,224 @@ TestResult test_fragmentation() {
     return result;
 }
 
+int zc_released = 0;
+
+void zc_release(IpPayload* payload) {
+    zc_released++;
+}
+
+/**
+ * Fragments queued without copying refer to the caller's payload, which is released once the
+ * last fragment leaves the out_pool.
+ */
+TestResult test_fragmentation_zc() {
+    TestResult result = PASS;
+    printf("Testing zero-copy fragmentation...\t");
+
+    IpHeader hdr = {0};
+    IpHeader new_hdr;
+    IpPayload payload = { .data = malloc(100), .release = zc_release };
+    char recovered[100];
+    char new_payload[8];
+    int fragments = 0;
+    for (int i = 0; i < 100; i++) payload.data[i] = 33 + i;
+    hdr.ihl = 5;
+    hdr.len = hdr.ihl * 4 + 100;
+
+    uint16_t mtu = ip_get_mtu();
+    ip_set_mtu(28);                                        // 8 octet fragments
+    if (queue_for_sending_zc(&hdr, &payload) != IP_SUCCESS) result = FAIL;
+    ip_set_mtu(mtu);
+
+    while (!out_pool_empty()) {
+        if (zc_released != 0) result = FAIL;
+        out_pool_pop(&new_hdr, new_payload);
+        if (ip_checksum(&new_hdr, new_hdr.ihl * 4) != 0) result = FAIL;
+        memcpy(recovered + new_hdr.frag_offset * 8, new_payload, new_hdr.len - new_hdr.ihl * 4);
+        fragments++;
+    }
+
+    if (fragments != 13 || zc_released != 1) result = FAIL;
+    if (memcmp(payload.data, recovered, 100) != 0) result = FAIL;
+
+    free(payload.data);
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+/**
+ * A packet that fits the device MTU is queued as a single packet, and the MTU can't be raised past
+ * the pool slot size.
+ */
+TestResult test_mtu() {
+    TestResult result = PASS;
+    printf("Testing MTU...\t");
+
+    IpHeader hdr = {0};
+    IpHeader new_hdr;
+    uint16_t mtu = ip_get_mtu();
+    int data_len = mtu - 20;
+    char* payload = malloc(data_len);
+    char* new_payload = malloc(data_len);
+    for (int i = 0; i < data_len; i++) payload[i] = i;
+
+    hdr.ihl = 5;
+    hdr.len = mtu;
+
+    if (queue_for_sending(&hdr, payload) != IP_SUCCESS) result = FAIL;
+    out_pool_pop(&new_hdr, new_payload);
+    if (!out_pool_empty()) result = FAIL;
+    if (new_hdr.len != mtu || memcmp(payload, new_payload, data_len) != 0) result = FAIL;
+
+    if (ip_set_mtu(IP_MAX_MTU + 1) == IP_SUCCESS) result = FAIL;
+    if (ip_get_mtu() != mtu) result = FAIL;
+
+    free(payload);
+    free(new_payload);
+
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+/**
+ * Check the checksum against a known header, the accelerated sum against the scalar one, and that
+ * the incrementally patched headers of a fragmented packet verify.
+ */
+TestResult test_checksum() {
+    TestResult result = PASS;
+    printf("Testing checksum...\t");
+
+    unsigned char known[20] = {
+        0x45, 0x00, 0x00, 0x73, 0x00, 0x00, 0x40, 0x00, 0x40, 0x11,
+        0x00, 0x00, 0xc0, 0xa8, 0x00, 0x01, 0xc0, 0xa8, 0x00, 0xc7,
+    };
+    uint16_t csum = ip_checksum(known, 20);
+    memcpy(known + 10, &csum, 2);
+    if (known[10] != 0xb8 || known[11] != 0x61) result = FAIL;
+    if (ip_checksum(known, 20) != 0) result = FAIL;
+
+    unsigned char* buf = malloc(2048);
+    for (int i = 0; i < 2048; i++) buf[i] = rand();
+    for (int off = 0; off < 4; off++)
+        for (int len = 0; len < 2000; len += 37)
+            if (csum_partial(buf + off, len, 0) % 0xffff != csum_partial_scalar(buf + off, len, 0) % 0xffff) result = FAIL;
+
+    unsigned char* copy = malloc(2048);
+    for (int len = 0; len < 2000; len += 37) {
+        memset(copy, 0, 2048);
+        if (csum_copy(copy, buf + 1, len, 0) % 0xffff != csum_partial_scalar(buf + 1, len, 0) % 0xffff) result = FAIL;
+        if (memcmp(copy, buf + 1, len) != 0 || copy[len] != 0) result = FAIL;
+    }
+    free(copy);
+    free(buf);
+
+    IpHeader hdr = {0};
+    IpHeader new_hdr;
+    char payload[100];
+    char new_payload[8];
+    hdr.ihl = 5;
+    hdr.len = hdr.ihl * 4 + 100;
+    hdr.ttl = 64;
+    hdr.saddr = 0x0100a8c0;
+
+    uint16_t mtu = ip_get_mtu();
+    ip_set_mtu(28);
+    queue_for_sending(&hdr, payload);
+    ip_set_mtu(mtu);
+    while (!out_pool_empty()) {
+        out_pool_pop(&new_hdr, new_payload);
+        if (ip_checksum(&new_hdr, new_hdr.ihl * 4) != 0) result = FAIL;
+    }
+
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+unsigned delivered;                         // datagrams handed to count_delivery
+
+void count_delivery(PktBuf* buf) {
+    delivered++;
+    pktbuf_put(buf);
+}
+
+/**
+ * Feed datagrams whose total length disagrees with what was read, and an IPv6 packet, and check
+ * that only the intact IPv4 datagram is delivered.
+ */
+TestResult test_truncated() {
+    TestResult result = PASS;
+    printf("Testing truncated datagrams...\t");
+
+    char packet[100] = { 0 };
+    IpHeader* hdr = (IpHeader *) packet;
+    uint16_t lens[] = { 100, 101, 19 };             // intact, longer than read, shorter than its header
+
+    ip_set_receiver(count_delivery);
+    for (unsigned i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+        memset(packet, 0, sizeof(IpHeader));
+        hdr->ver = 4;
+        hdr->ihl = 5;
+        hdr->len = lens[i];
+        hdr->ttl = 64;
+        hdr->proto = 17;
+        hdr->saddr = 0x0a000002;
+        hdr->daddr = 0x0a000001;
+        hdr->csum = ip_checksum(hdr, sizeof(IpHeader));
+        ip_hdr_hton(hdr);
+        delivered = 0;
+        in_pool_push(packet, sizeof(packet));
+        if (delivered != (i == 0)) result = FAIL;
+    }
+
+    // an IPv6 header: version 6, payload length 20, next header UDP; never read as IPv4
+    unsigned char v6[60] = { 0x60, 0, 0, 0, 0x00, 0x14, 17, 64 };
+    delivered = 0;
+    in_pool_push((char *) v6, sizeof(v6));
+    if (delivered != 0) result = FAIL;
+    ip_set_receiver(NULL);
+
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+/**
+ * Convert a known wire header to the stack's form and back, and check the fields, the byte order
+ * on the wire and that the checksum stays valid both ways.
+ */
+TestResult test_byte_order() {
+    TestResult result = PASS;
+    printf("Testing byte order...\t");
+
+    unsigned char wire[20] = {
+        0x45, 0x00, 0x00, 0x73, 0x12, 0x34, 0x40, 0x00, 0x40, 0x11,
+        0xb8, 0x61, 0xc0, 0xa8, 0x00, 0x01, 0xc0, 0xa8, 0x00, 0xc7,
+    };
+    uint16_t csum = 0;
+    memcpy(wire + 10, &csum, 2);
+    csum = ip_checksum(wire, 20);
+    memcpy(wire + 10, &csum, 2);
+
+    IpHeader hdr;
+    memcpy(&hdr, wire, sizeof(hdr));
+    ip_hdr_ntoh(&hdr);
+    if (hdr.ver != 4 || hdr.ihl != 5 || hdr.len != 0x73 || hdr.id != 0x1234) result = FAIL;
+    if (hdr.flags != 2 || hdr.frag_offset != 0 || hdr.ttl != 0x40 || hdr.proto != 0x11) result = FAIL;
+    if (hdr.saddr != 0xc0a80001 || hdr.daddr != 0xc0a800c7) result = FAIL;
+    if (ip_checksum(&hdr, 20) != 0) result = FAIL;
+
+    ip_hdr_hton(&hdr);
+    if (memcmp(&hdr, wire, sizeof(wire)) != 0) result = FAIL;
+
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
 TestResult test_ras() {
     TestResult result = PASS;
     printf("Testing reassembly store...\t");
 
-    char* packet = (char *) malloc(36 * sizeof(char));
-    iphdr* hdr = (iphdr *) packet;
+    char* packet = (char *) calloc(36, sizeof(char));
+    IpHeader* hdr = (IpHeader *) packet;
 
     hdr->ihl = 5;
     hdr->len = 28;
@@ -99,28 +359,1407 @@ TestResult test_ras() {
     
     for (int i = 0; i < 8; i++) data[i] = 65 + i;
     SET_MORE_FRAGMENTS(hdr);
-    if (ras_log(packet) != RAS_SUCCESS) result = FAIL;
+    if (ras_log(rs, packet) != RAS_SUCCESS) result = FAIL;
     hdr->frag_offset = 1;
     for (int i = 0; i < 8; i++) data[i] = 73 + i;
     SET_LAST_FRAGMENT(hdr);
-    if (ras_log(packet) != RAS_SUCCESS_RE_COMPLETE) result = FAIL;
+    if (ras_log(rs, packet) != RAS_SUCCESS_RE_COMPLETE) result = FAIL;
     
-    ras_get_packet(hdr, data);
+    uint32_t data_csum;
+    ras_get_packet(rs, hdr, data, &data_csum);
 
     for (int i = 0; i < 16; i++) {
         if (data[i] != 65 + i) result = FAIL;
     }
+    if (csum_fold(data_csum) != ip_checksum(data, 16)) result = FAIL;
     
     free(packet);
     printf(result == PASS ? "PASS\n" : "FAIL\n");
     return result;
 }
 
+/**
+ * Interleave many datagrams between the same hosts that only differ in their identification,
+ * and check that each one is reassembled from its own fragments.
+ */
+TestResult test_ras_interleaved() {
+    TestResult result = PASS;
+    printf("Testing interleaved reassembly...\t");
+
+    char* packet = (char *) calloc(28, sizeof(char));
+    IpHeader* hdr = (IpHeader *) packet;
+    char* data = packet + 20;
+    char out[16];
+
+    hdr->ihl = 5;
+    hdr->len = 28;
+    hdr->proto = 6;
+    hdr->saddr = 2;
+    hdr->daddr = 3;
+
+    for (int k = 0; k < 200; k++) {
+        hdr->id = k;
+        hdr->frag_offset = 0;
+        SET_MORE_FRAGMENTS(hdr);
+        memset(data, k, 8);
+        if (ras_log(rs, packet) != RAS_SUCCESS) result = FAIL;
+    }
+    for (int k = 199; k >= 0; k--) {
+        hdr->id = k;
+        hdr->len = 28;                                      // ras_get_packet rewrites the header
+        hdr->frag_offset = 1;
+        SET_LAST_FRAGMENT(hdr);
+        memset(data, k + 1, 8);
+        if (ras_log(rs, packet) != RAS_SUCCESS_RE_COMPLETE) result = FAIL;
+        if (ras_get_packet(rs, hdr, out, NULL) != RAS_SUCCESS) result = FAIL;
+        for (int i = 0; i < 16; i++)
+            if (out[i] != (char) (i < 8 ? k : k + 1)) result = FAIL;
+        if (ras_get_packet(rs, hdr, out, NULL) != RAS_ERR_PACKET_NOT_FOUND) result = FAIL;
+    }
+
+    free(packet);
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+/**
+ * Reassemble a datagram spanning several bitmap words from shuffled and duplicated fragments, and
+ * check that it completes exactly when the last missing fragment arrives.
+ */
+TestResult test_ras_out_of_order() {
+    TestResult result = PASS;
+    printf("Testing out of order reassembly...\t");
+
+    int nfrags = 15;                                        // 15 * 40 octets = 75 blocks
+    int order[] = { 3, 0, 14, 7, 7, 1, 2, 13, 4, 5, 6, 8, 0, 9, 10, 11, 12 };
+    int norder = sizeof(order) / sizeof(order[0]);
+    char* packet = (char *) calloc(60, sizeof(char));
+    IpHeader* hdr = (IpHeader *) packet;
+    char* data = packet + 20;
+    char* out = malloc(nfrags * 40);
+    uint32_t data_csum;
+
+    for (int n = 0; n < norder; n++) {
+        int k = order[n];
+        memset(hdr, 0, sizeof(IpHeader));
+        hdr->ihl = 5;
+        hdr->len = 60;
+        hdr->proto = 17;
+        hdr->id = 4242;
+        hdr->frag_offset = k * 5;
+        if (k == nfrags - 1) SET_LAST_FRAGMENT(hdr);
+        else SET_MORE_FRAGMENTS(hdr);
+        for (int i = 0; i < 40; i++) data[i] = k * 40 + i;
+
+        RasStatus s = ras_log(rs, packet);
+        if (s != (n == norder - 1 ? RAS_SUCCESS_RE_COMPLETE : RAS_SUCCESS)) result = FAIL;
+    }
+
+    if (ras_get_packet(rs, hdr, out, &data_csum) != RAS_SUCCESS) result = FAIL;
+    for (int i = 0; i < nfrags * 40; i++)
+        if (out[i] != (char) i) result = FAIL;
+    if (csum_fold(data_csum) != ip_checksum(out, nfrags * 40)) result = FAIL;
+
+    free(packet);
+    free(out);
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+TestResult test_ras_growth() {
+    TestResult result = PASS;
+    printf("Testing reassembly buffer growth...\t");
+
+    int nfrags = 20;                                        // 20 * 1000 octets outgrows several size classes
+    char* packet = (char *) calloc(1020, sizeof(char));
+    IpHeader* hdr = (IpHeader *) packet;
+    char* data = packet + 20;
+    char* out = malloc(nfrags * 1000);
+    uint32_t data_csum;
+
+    for (int round = 0; round < 3; round++) {               // later rounds run on recycled buffers
+        for (int n = 0; n < nfrags; n++) {
+            int k = n % 2 == 0 ? n / 2 : nfrags - 1 - n / 2;  // 0, 19, 1, 18, ...
+            memset(hdr, 0, sizeof(IpHeader));
+            hdr->ihl = 5;
+            hdr->len = 1020;
+            hdr->proto = 17;
+            hdr->id = 777 + round;
+            hdr->frag_offset = k * 125;
+            if (k == nfrags - 1) SET_LAST_FRAGMENT(hdr);
+            else SET_MORE_FRAGMENTS(hdr);
+            for (int i = 0; i < 1000; i++) data[i] = k * 1000 + i + round;
+
+            RasStatus s = ras_log(rs, packet);
+            if (s != (n == nfrags - 1 ? RAS_SUCCESS_RE_COMPLETE : RAS_SUCCESS)) result = FAIL;
+        }
+
+        if (ras_get_packet(rs, hdr, out, &data_csum) != RAS_SUCCESS) result = FAIL;
+        if (hdr->len != 20 + nfrags * 1000) result = FAIL;
+        for (int i = 0; i < nfrags * 1000; i++)
+            if (out[i] != (char) (i + round)) result = FAIL;
+        if (csum_fold(data_csum) != ip_checksum(out, nfrags * 1000)) result = FAIL;
+    }
+
+    free(packet);
+    free(out);
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+TestResult test_ras_expiry() {
+    TestResult result = PASS;
+    printf("Testing reassembly expiry...\t");
+
+    char* packet = (char *) calloc(60, sizeof(char));
+    IpHeader* hdr = (IpHeader *) packet;
+    char* out = malloc(80);
+    RasStats before, after;
+    uint64_t now = monotonic_us();
+
+    ras_tick(rs, now);
+    ras_get_stats(rs, &before);
+    hdr->ihl = 5;
+    hdr->len = 60;
+    hdr->proto = 17;
+    hdr->id = 999;
+    SET_MORE_FRAGMENTS(hdr);
+    if (ras_log(rs, packet) != RAS_SUCCESS) result = FAIL;      // second half never arrives
+
+    ras_tick(rs, now + (RAS_TIMEOUT_MS - RAS_TICK_MS) * 1000);
+    if (ras_get_packet(rs, hdr, out, NULL) != RAS_ERR_PACKET_NOT_COMPLETE) result = FAIL;
+
+    ras_tick(rs, now + (RAS_TIMEOUT_MS + RAS_TICK_MS) * 1000);
+    if (ras_get_packet(rs, hdr, out, NULL) != RAS_ERR_PACKET_NOT_FOUND) result = FAIL;
+    ras_get_stats(rs, &after);
+    if (after.expired != before.expired + 1 || after.expired_octets != before.expired_octets + 40) result = FAIL;
+
+    free(packet);
+    free(out);
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+TestResult test_ras_limits() {
+    TestResult result = PASS;
+    printf("Testing reassembly memory limits...\t");
+
+    char* packet = (char *) calloc(60, sizeof(char));
+    IpHeader* hdr = (IpHeader *) packet;
+    RasStats before, after;
+    int limited = 0;
+
+    ras_get_stats(rs, &before);
+    for (uint32_t src = 1; src <= 16; src++) {              // more sources than the store can hold
+        for (int id = 0; id < 1 << 16; id++) {
+            memset(hdr, 0, sizeof(IpHeader));
+            hdr->ihl = 5;
+            hdr->len = 60;
+            hdr->proto = 17;
+            hdr->saddr = src;
+            hdr->id = id;
+            SET_MORE_FRAGMENTS(hdr);
+            RasStatus s = ras_log(rs, packet);
+            if (s == RAS_ERR_SOURCE_LIMIT) {
+                limited++;
+                break;
+            }
+            if (s != RAS_SUCCESS) result = FAIL;
+            ras_get_stats(rs, &after);
+            if (after.mem > RAS_MEM_HIGH + RAS_SOURCE_LIMIT) result = FAIL;
+        }
+    }
+
+    ras_get_stats(rs, &after);
+    if (limited == 0 || after.source_limited == before.source_limited) result = FAIL;
+    if (after.evicted == before.evicted) result = FAIL;
+
+    ras_tick(rs, monotonic_us() + 3 * RAS_TIMEOUT_MS * 1000);   // let everything expire
+    ras_get_stats(rs, &after);
+    if (after.mem != 0) result = FAIL;
+
+    free(packet);
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+/**
+ * A reassembled datagram is handed over in the store's buffer, which the store reuses once the
+ * last reference is dropped.
+ */
+TestResult test_ras_take() {
+    TestResult result = PASS;
+    printf("Testing reassembly hand over...\t");
+
+    char* packet = (char *) calloc(60, sizeof(char));
+    IpHeader* hdr = (IpHeader *) packet;
+    char* data = packet + 20;
+    PktBuf* bufs[2];
+    RasStats before;
+    ras_get_stats(rs, &before);
+    uint64_t mem_before = before.mem;
+
+    for (int round = 0; round < 2; round++) {
+        for (int k = 0; k < 2; k++) {
+            memset(hdr, 0, sizeof(IpHeader));
+            hdr->ihl = 5;
+            hdr->len = 60;
+            hdr->proto = 6;
+            hdr->id = 31337;
+            hdr->frag_offset = k * 5;
+            if (k == 1) SET_LAST_FRAGMENT(hdr);
+            else SET_MORE_FRAGMENTS(hdr);
+            for (int i = 0; i < 40; i++) data[i] = k * 40 + i;
+            ras_log(rs, packet);
+        }
+        if (ras_take_packet(rs, hdr, &bufs[round]) != RAS_SUCCESS) {
+            result = FAIL;
+            break;
+        }
+
+        PktBuf* buf = pktbuf_get(bufs[round]);              // a second user of the same buffer
+        IpHeader* new_hdr = (IpHeader *) buf->data;
+        if (new_hdr->len != 100 || pktbuf_len(buf) != 100 || new_hdr->flags != 0) result = FAIL;
+        if (ip_checksum(new_hdr, 20) != 0) result = FAIL;
+        char* payload = pktbuf_pull(buf, new_hdr->ihl * 4);
+        for (int i = 0; i < 80; i++)
+            if (payload[i] != (char) i) result = FAIL;
+        if (!buf->csum_valid || csum_fold(buf->csum) != ip_checksum(payload, 80)) result = FAIL;
+        if (pktbuf_push(buf, 20) != (char *) new_hdr) result = FAIL;
+
+        pktbuf_put(buf);
+        pktbuf_put(buf);
+    }
+    RasStats stats;
+    ras_get_stats(rs, &stats);
+    if (stats.mem != mem_before) result = FAIL;             // handed out buffers are not charged
+
+    free(packet);
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+/**
+ * The flow hash must match the Toeplitz reference value, hash both directions of a flow alike, 
+ * and spread flows evenly over the queues.
+ */
+TestResult test_flow_hash() {
+    printf("Testing flow hash...\t");
+    TestResult result = PASS;
+
+    uint8_t src[4] = { 199, 92, 111, 2 }, dst[4] = { 65, 69, 140, 83 };
+    uint32_t saddr, daddr;
+    memcpy(&saddr, src, 4);
+    memcpy(&daddr, dst, 4);
+    if (ip_flow_hash(saddr, daddr) != 0xd718262a) result = FAIL;   // reference vector of the RSS spec
+
+    unsigned counts[4] = { 0 };
+    srand(7);
+    for (int i = 0; i < 4096; i++) {
+        saddr = (uint32_t) rand() << 16 ^ rand();
+        daddr = (uint32_t) rand() << 16 ^ rand();
+        uint32_t h = ip_flow_hash(saddr, daddr);
+        if (h != ip_flow_hash(daddr, saddr)) result = FAIL;
+        counts[((uint64_t) h * 4) >> 32]++;
+    }
+    for (int i = 0; i < 4; i++)
+        if (counts[i] < 4096 / 4 * 3 / 4 || counts[i] > 4096 / 4 * 5 / 4) result = FAIL;
+
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+/**
+ * Fill a connection table well past its initial size, then remove every other connection; all
+ * lookups must still find exactly the connections left.
+ */
+TestResult test_tcb_table() {
+    printf("Testing TCB table...\t");
+    TestResult result = PASS;
+    TcbTable* t;
+    const uint32_t n = 100000;
+
+    if (tcb_table_init(&t) != TCB_SUCCESS) result = FAIL;
+
+    // SipHash-2-4 reference vectors: key 00 01 .. 0f, message 00 01 .. of the given length
+    const uint64_t sip_key[2] = { 0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL };
+    uint8_t sip_msg[16];
+    for (int i = 0; i < 16; i++) sip_msg[i] = i;
+    if (siphash(sip_key, sip_msg, 0, 2, 4) != 0x726fdb47dd0e0e31ULL) result = FAIL;
+    if (siphash(sip_key, sip_msg, 1, 2, 4) != 0x74f839c593dc67fdULL) result = FAIL;
+    if (siphash(sip_key, sip_msg, 8, 2, 4) != 0x93f5f5799a932462ULL) result = FAIL;
+    if (siphash(sip_key, sip_msg, 15, 2, 4) != 0xa129ca6149be45e5ULL) result = FAIL;
+
+    for (uint32_t i = 0; i < n; i++) {
+        TcbKey key = { .local_ip = 0x0a000001, .local_port = 80, .foreign_ip = 0x0a010000 + i / 50000, .foreign_port = i % 50000 };
+        if (tcb_insert(t, &key, (Tcb *) (uintptr_t) (i + 1)) != TCB_SUCCESS) result = FAIL;
+    }
+    TcbKey dup = { .local_ip = 0x0a000001, .local_port = 80, .foreign_ip = 0x0a010000, .foreign_port = 7 };
+    if (tcb_insert(t, &dup, (Tcb *) 1) != TCB_ERR_EXISTS) result = FAIL;
+
+    for (uint32_t i = 0; i < n; i += 2) {
+        TcbKey key = { .local_ip = 0x0a000001, .local_port = 80, .foreign_ip = 0x0a010000 + i / 50000, .foreign_port = i % 50000 };
+        if (tcb_remove(t, &key) != (Tcb *) (uintptr_t) (i + 1)) result = FAIL;
+    }
+    if (tcb_count(t) != n / 2) result = FAIL;
+
+    for (uint32_t i = 0; i < n; i++) {
+        TcbKey key = { .local_ip = 0x0a000001, .local_port = 80, .foreign_ip = 0x0a010000 + i / 50000, .foreign_port = i % 50000 };
+        Tcb* expected = i % 2 ? (Tcb *) (uintptr_t) (i + 1) : NULL;
+        if (tcb_lookup(t, &key) != expected) result = FAIL;
+    }
+
+    tcb_table_kill(t);
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+#define MPSC_PRODUCERS 4
+#define MPSC_ITEMS 100000
+
+typedef struct {
+    MpscNode node;
+    int producer;
+    int seq;
+} MpscItem;
+
+MpscQueue mpsc;
+MpscItem* mpsc_items;
+
+void* mpsc_producer(void* arg) {
+    int p = (int) (intptr_t) arg;
+    for (int i = 0; i < MPSC_ITEMS; i++) {
+        MpscItem* item = &mpsc_items[p * MPSC_ITEMS + i];
+        item->producer = p;
+        item->seq = i;
+        mpsc_push(&mpsc, &item->node);
+    }
+    return NULL;
+}
+
+/**
+ * Several threads push into the event queue while the consumer drains it, blocking whenever it
+ * runs dry. Every item must arrive exactly once, in order per producer.
+ */
+TestResult test_mpsc_queue() {
+    printf("Testing MPSC queue...\t");
+    TestResult result = PASS;
+    pthread_t producers[MPSC_PRODUCERS];
+    int next[MPSC_PRODUCERS] = { 0 };
+
+    mpsc_items = malloc(sizeof(MpscItem) * MPSC_PRODUCERS * MPSC_ITEMS);
+    if (mpsc_init(&mpsc) < 0) result = FAIL;
+    for (int p = 0; p < MPSC_PRODUCERS; p++)
+        pthread_create(&producers[p], NULL, mpsc_producer, (void *) (intptr_t) p);
+
+    for (int received = 0; received < MPSC_PRODUCERS * MPSC_ITEMS; ) {
+        MpscItem* item = (MpscItem *) mpsc_pop(&mpsc);
+        if (item == NULL) {
+            mpsc_wait(&mpsc);
+            continue;
+        }
+        if (item->seq != next[item->producer]++) result = FAIL;
+        received++;
+    }
+    for (int p = 0; p < MPSC_PRODUCERS; p++) pthread_join(producers[p], NULL);
+    if (mpsc_pop(&mpsc) != NULL || !mpsc_empty(&mpsc)) result = FAIL;
+
+    mpsc_free(&mpsc);
+    free(mpsc_items);
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+/**
+ * Queue and process rounds of packet events; once the event pool is warm, no more events may be
+ * allocated.
+ */
+TestResult test_event_pool() {
+    printf("Testing TCP event pool...\t");
+    TestResult result = PASS;
+    TcpStats warm, stats;
+    char packet[40] = { 0 };
+    IpHeader* hdr = (IpHeader *) packet;
+
+    hdr->ver = 4;
+    hdr->ihl = 5;
+    hdr->len = sizeof(packet);
+    hdr->proto = 6;
+
+    if (tcp_init(NULL, NULL) != TCP_SUCCESS) result = FAIL;
+    for (int round = 0; round < 100; round++) {
+        if (round == 1) tcp_get_stats(&warm);
+        for (int i = 0; i < 1000; i++) add_packet_event(pktbuf_copy(packet, sizeof(packet)));
+        if (tcp_process_events() != 1000) result = FAIL;
+    }
+    tcp_get_stats(&stats);
+    if (warm.event_mallocs == 0 || stats.event_mallocs != warm.event_mallocs) result = FAIL;
+
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+uint16_t peer_window = TCP_MAX_WINDOW;     // window advertised by inject_segment
+TcpOptions* peer_options;                   // options sent by inject_segment; if NULL, a SYN announces the MSS of the link
+uint64_t test_clock;                        // made up clock of the TCP tests, on a tick
+
+/*
+ * A SYN Linux sent from 10.9.0.1:40346 to 10.9.0.2:80, as read from its tun device: MSS 1460,
+ * SACK permitted, timestamps (TSval 0xeb8412b3) and window scale 10.
+ */
+const unsigned char linux_syn[60] = {
+    0x45, 0x00, 0x00, 0x3c, 0xba, 0xe4, 0x40, 0x00, 0x40, 0x06, 0x6b, 0xc3, 0x0a, 0x09, 0x00, 0x01,
+    0x0a, 0x09, 0x00, 0x02, 0x9d, 0x9a, 0x00, 0x50, 0x03, 0x86, 0xe0, 0x13, 0x00, 0x00, 0x00, 0x00,
+    0xa0, 0x02, 0xfa, 0xf0, 0xb9, 0x3b, 0x00, 0x00, 0x02, 0x04, 0x05, 0xb4, 0x04, 0x02, 0x08, 0x0a,
+    0xeb, 0x84, 0x12, 0xb3, 0x00, 0x00, 0x00, 0x00, 0x01, 0x03, 0x03, 0x0a,
+};
+
+/**
+ * Fills in the TCP checksum of a datagram built by build_segment, over the pseudo header and the
+ * segment as tcp_send_segment does.
+ */
+void segment_checksum(char* packet) {
+    IpHeader* hdr = (IpHeader *) packet;
+    TcpHeader* tcp_hdr = (TcpHeader *) (packet + sizeof(IpHeader));
+    uint16_t tcp_len = hdr->len - sizeof(IpHeader);
+
+    tcp_hdr->checksum = 0;
+    uint32_t sum = tcp_pseudo_sum(hdr->saddr, hdr->daddr, tcp_len, 0);
+    tcp_hdr->checksum = csum_fold(csum_partial(tcp_hdr, tcp_len, sum));
+}
+
+/**
+ * Builds a segment from the foreign host 10.0.0.2:4000 to 10.0.0.1, as it is on the wire.
+ * @param packet: buffer of at least sizeof(IpHeader) + sizeof(TcpHeader) + TCP_MAX_OPTIONS_LEN + len.
+ * @param port: local port the segment is for.
+ */
+void build_segment(char* packet, uint16_t port, uint8_t flags, uint32_t seq, uint32_t ack, const char* data, uint16_t len) {
+    IpHeader* hdr = (IpHeader *) packet;
+    TcpHeader* tcp_hdr = (TcpHeader *) (packet + sizeof(IpHeader));
+    TcpOptions mss_only = { .has_mss = true, .mss = ip_get_mtu() - sizeof(IpHeader) - sizeof(TcpHeader) };
+    TcpOptions* opts = peer_options != NULL ? peer_options : (flags & TCP_SYN) ? &mss_only : NULL;
+    uint8_t opt_len = opts == NULL ? 0 : tcp_write_options((char *) (tcp_hdr + 1), opts);
+
+    hdr->ver = 4;
+    hdr->ihl = 5;
+    hdr->len = sizeof(IpHeader) + sizeof(TcpHeader) + opt_len + len;
+    hdr->proto = IP_PROTO_TCP;
+    hdr->saddr = 0x0a000002;
+    hdr->daddr = 0x0a000001;
+    tcp_hdr->s_port = 4000;
+    tcp_hdr->d_port = port;
+    tcp_hdr->seq_number = seq;
+    tcp_hdr->ack_number = ack;
+    tcp_hdr->data_offset = (sizeof(TcpHeader) + opt_len) / 4;
+    tcp_hdr->flags = flags;
+    tcp_hdr->window = peer_window;
+    if (len > 0) memcpy((char *) (tcp_hdr + 1) + opt_len, data, len);
+    tcp_hdr_hton(tcp_hdr);
+    segment_checksum(packet);
+}
+
+/**
+ * Pops a datagram TCP queued for sending, with its TCP header in host byte order.
+ * @param payload: set to the segment, at least IP_MAX_MTU octets.
+ */
+void pop_segment(IpHeader* out, char* payload) {
+    out_pool_pop(out, payload);
+    tcp_hdr_ntoh((TcpHeader *) payload);
+}
+
+/**
+ * Builds a segment with build_segment and queues it for TCP.
+ */
+void queue_segment(uint16_t port, uint8_t flags, uint32_t seq, uint32_t ack, const char* data, uint16_t len) {
+    char packet[sizeof(IpHeader) + sizeof(TcpHeader) + TCP_MAX_OPTIONS_LEN + 1500] = { 0 };
+    build_segment(packet, port, flags, seq, ack, data, len);
+    add_packet_event(pktbuf_copy(packet, ((IpHeader *) packet)->len));
+}
+
+/**
+ * Like queue_segment, then has TCP process it.
+ */
+void inject_segment(uint16_t port, uint8_t flags, uint32_t seq, uint32_t ack, const char* data, uint16_t len) {
+    queue_segment(port, flags, seq, ack, data, len);
+    tcp_process_events();
+}
+
+/**
+ * Passive open, three way handshake, then data both ways on the established connection.
+ */
+TestResult test_tcp_data() {
+    printf("Testing TCP data transfer...\t");
+    TestResult result = PASS;
+    IpHeader out;
+    char payload[IP_MAX_MTU];
+    TcpHeader* seg = (TcpHeader *) payload;
+    char msg[3000], got[3000];
+    Tcb* listener, *conn;
+    uint32_t irs = 1000;
+
+    for (size_t i = 0; i < sizeof(msg); i++) msg[i] = 'a' + i % 26;
+    test_clock = (monotonic_us() / TW_TICK_US + 1000) * TW_TICK_US;
+    tcp_tick(test_clock);
+
+    if (OPEN(0x0a000001, 80, 0, 0, &listener) != TCP_SUCCESS) result = FAIL;
+    tcp_process_events();
+
+    inject_segment(80, TCP_SYN, irs, 0, NULL, 0);
+    if (out_pool_empty()) return FAIL;
+    pop_segment(&out, payload);
+    if (!CHECK_FLAG(seg, TCP_SYN) || !CHECK_FLAG(seg, TCP_ACK) || seg->ack_number != irs + 1) result = FAIL;
+    if (out.saddr != 0x0a000001 || out.daddr != 0x0a000002 || seg->d_port != 4000) result = FAIL;
+    uint32_t iss = seg->seq_number;
+
+    inject_segment(80, TCP_ACK, irs + 1, iss + 1, NULL, 0);
+    conn = tcp_accept(listener);
+
+    // data in: acknowledged, and readable with RECEIVE
+    inject_segment(80, TCP_ACK | TCP_PSH, irs + 1, iss + 1, "hello", 5);
+    if (!out_pool_empty()) result = FAIL;       // the ACK is delayed
+    tcp_tick(test_clock += TCP_DELACK_US);
+    if (out_pool_empty()) return FAIL;
+    pop_segment(&out, payload);
+    if (seg->ack_number != irs + 6 || seg->window != TCP_MAX_WINDOW + 1 - 5) result = FAIL;     // unscaled peer: a 64K ring
+    if (RECEIVE(conn, got, sizeof(got)) != 5 || memcmp(got, "hello", 5) != 0) result = FAIL;
+    if (RECEIVE(conn, got, sizeof(got)) != 0) result = FAIL;
+    tcp_process_events();
+
+    // data out: split at the MSS, PSH on the last segment
+    uint32_t mss = ip_get_mtu() - sizeof(IpHeader) - sizeof(TcpHeader);
+    if (SEND(conn, msg, sizeof(msg)) != sizeof(msg)) result = FAIL;
+    tcp_process_events();
+    uint32_t seq = iss + 1;
+    while (!out_pool_empty()) {
+        pop_segment(&out, payload);
+        uint32_t len = out.len - sizeof(IpHeader) - sizeof(TcpHeader);
+        if (seg->seq_number != seq || len > mss || memcmp(seg + 1, msg + (seq - iss - 1), len) != 0) result = FAIL;
+        if (CHECK_FLAG(seg, TCP_PSH) != (seq + len == iss + 1 + sizeof(msg) ? TCP_PSH : 0)) result = FAIL;
+        seq += len;
+    }
+    if (seq != iss + 1 + sizeof(msg)) result = FAIL;
+
+    // the acknowledgment frees the send ring
+    inject_segment(80, TCP_ACK, irs + 6, seq, NULL, 0);
+    if (!out_pool_empty()) result = FAIL;
+    if (SEND(conn, msg, sizeof(msg)) != sizeof(msg)) result = FAIL;
+    tcp_process_events();
+    while (!out_pool_empty()) pop_segment(&out, payload);
+
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+/**
+ * Opens a listener on the given local port and completes a handshake with it.
+ * @param irs: initial sequence number of the foreign host.
+ * @param iss: set to the initial sequence number of the connection.
+ */
+Tcb* accept_connection(uint16_t port, uint32_t irs, uint32_t* iss) {
+    IpHeader out;
+    char payload[IP_MAX_MTU];
+    Tcb* listener;
+
+    if (OPEN(0x0a000001, port, 0, 0, &listener) != TCP_SUCCESS) return NULL;
+    tcp_process_events();
+    inject_segment(port, TCP_SYN, irs, 0, NULL, 0);
+    if (out_pool_empty()) return NULL;
+    pop_segment(&out, payload);
+    *iss = ((TcpHeader *) payload)->seq_number;
+    inject_segment(port, TCP_ACK, irs + 1, *iss + 1, NULL, 0);
+    return tcp_accept(listener);
+}
+
+/**
+ * Window arithmetic of NewReno and CUBIC, then a fast retransmit and recovery on a connection.
+ */
+TestResult test_congestion() {
+    printf("Testing congestion control...\t");
+    TestResult result = PASS;
+    CongState c;
+
+    // NewReno: slow start doubles per window, congestion avoidance adds one MSS per window
+    cong_init(&c, &cong_newreno, 1000);
+    if (c.cwnd != 10000) result = FAIL;
+    for (int i = 0; i < 10; i++) c.ops->on_ack(&c, 1000, 1);
+    if (c.cwnd != 20000) result = FAIL;
+    c.ssthresh = 20000;
+    for (int i = 0; i < 20; i++) c.ops->on_ack(&c, 1000, 1);
+    if (c.cwnd != 21000) result = FAIL;
+    c.ops->on_loss(&c, 21000, 1);
+    if (c.ssthresh != 10500) result = FAIL;
+    c.ops->on_timeout(&c, 10500, 1);
+    if (c.cwnd != 1000) result = FAIL;
+
+    // CUBIC: back off to 0.7, plateau around the old maximum K seconds later, then probe above it
+    cong_init(&c, &cong_cubic, 1000);
+    c.cwnd = c.ssthresh = 100000;
+    c.ops->on_loss(&c, 100000, 1000000);
+    if (c.ssthresh != 70000) result = FAIL;
+    c.cwnd = c.ssthresh;
+    uint32_t at_2s = 0, at_k = 0;       // K = cbrt(30 / 0.4) = 4.2 s
+    for (uint64_t now = 1000000; now <= 9000000; now += 100000) {     // one window acked per 100 ms
+        for (uint32_t acked = 0, w = c.cwnd; acked < w; acked += 1000) c.ops->on_ack(&c, 1000, now);
+        if (now == 3000000) at_2s = c.cwnd;
+        if (now == 5200000) at_k = c.cwnd;
+    }
+    if (at_2s <= 70000 || at_2s >= 100000) result = FAIL;
+    if (at_k < 95000 || at_k > 105000) result = FAIL;
+    if (c.cwnd <= 120000) result = FAIL;
+
+    if (cong_find("cubic") != &cong_cubic || cong_find("vegas") != NULL) result = FAIL;
+
+    // fast retransmit on the third duplicate ACK, partial and full ACKs during recovery
+    IpHeader out;
+    char payload[IP_MAX_MTU];
+    TcpHeader* seg = (TcpHeader *) payload;
+    char msg[20000] = { 0 };
+    TcpStats before, after;
+    uint32_t iss, irs = 5000, mss = ip_get_mtu() - sizeof(IpHeader) - sizeof(TcpHeader);
+
+    Tcb* conn = accept_connection(81, irs, &iss);
+    if (conn == NULL) return FAIL;
+    uint32_t cwnd = tcp_cwnd(conn);
+    SEND(conn, msg, 10 * mss < cwnd ? 10 * mss : cwnd);
+    tcp_process_events();
+    while (!out_pool_empty()) pop_segment(&out, payload);
+
+    tcp_get_stats(&before);
+    uint32_t una = iss + 1 + mss;       // first segment arrived, the second was lost
+    for (int i = 0; i < 4; i++) inject_segment(81, TCP_ACK, irs + 1, una, NULL, 0);
+    tcp_get_stats(&after);
+    if (after.fast_retransmits != before.fast_retransmits + 1) result = FAIL;
+    if (out_pool_empty()) return FAIL;
+    pop_segment(&out, payload);
+    if (seg->seq_number != una || out.len != sizeof(IpHeader) + sizeof(TcpHeader) + mss) result = FAIL;
+    if (!out_pool_empty()) result = FAIL;
+
+    inject_segment(81, TCP_ACK, irs + 1, una + 3 * mss, NULL, 0);      // partial: the next hole is resent
+    if (out_pool_empty()) return FAIL;
+    pop_segment(&out, payload);
+    if (seg->seq_number != una + 3 * mss) result = FAIL;
+    while (!out_pool_empty()) pop_segment(&out, payload);
+
+    inject_segment(81, TCP_ACK, irs + 1, iss + 1 + 10 * mss < iss + 1 + cwnd ? iss + 1 + 10 * mss : iss + 1 + cwnd, NULL, 0);
+    if (tcp_cwnd(conn) >= cwnd) result = FAIL;      // recovery ends with the window reduced
+    while (!out_pool_empty()) pop_segment(&out, payload);
+
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+typedef struct {
+    TimerNode node;
+    uint64_t expires;               // tick the timer must fire at
+    uint64_t fired_at;              // tick it fired at, 0 if it did not
+    int fired;
+} TestTimer;
+
+TimerWheel test_wheel;
+
+void test_timer_fire(TimerNode* t) {
+    TestTimer* tt = (TestTimer *) t;
+    tt->fired++;
+    tt->fired_at = test_wheel.now;
+}
+
+/**
+ * Arms timers spread over every level of the wheel, cancels a third of them, and checks that
+ * the others fire exactly once, on their tick, while the wheel moves in uneven steps.
+ */
+TestResult test_timer_wheel() {
+    printf("Testing timer wheel...\t");
+    TestResult result = PASS;
+    const int n = 200000;
+    const uint64_t start = 5000000;
+    TestTimer* timers = (TestTimer *) calloc(n, sizeof(TestTimer));
+    uint64_t x = 88172645463325252ULL;
+
+    tw_init(&test_wheel, start);
+    for (int i = 0; i < n; i++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        uint64_t delay_us = x % (i % 2 ? 10000000000ULL : 100000000ULL);      // up to 10000 s or 100 s
+        tw_timer_init(&timers[i].node, test_timer_fire);
+        tw_arm(&test_wheel, &timers[i].node, start + delay_us);
+        timers[i].expires = (start + delay_us + TW_TICK_US - 1) / TW_TICK_US;
+        if (timers[i].expires <= start / TW_TICK_US) timers[i].expires = start / TW_TICK_US + 1;
+    }
+    for (int i = 0; i < n; i += 3) tw_cancel(&test_wheel, &timers[i].node);
+    if (test_wheel.count != (uint64_t) (n - (n + 2) / 3)) result = FAIL;
+
+    for (uint64_t now = start; test_wheel.count > 0; ) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        now += x % 3000000;
+        tw_advance(&test_wheel, now);
+    }
+    for (int i = 0; i < n; i++) {
+        if (i % 3 == 0 && timers[i].fired != 0) result = FAIL;
+        if (i % 3 != 0 && (timers[i].fired != 1 || timers[i].fired_at != timers[i].expires)) result = FAIL;
+    }
+    if (tw_next_us(&test_wheel) != -1) result = FAIL;
+
+    free(timers);
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+/**
+ * Pops the segments queued for sending, keeping the last one sent from the given local port.
+ * @return the number of segments from that port.
+ */
+int pop_segments(uint16_t port, IpHeader* out, char* payload) {
+    IpHeader hdr;
+    char data[IP_MAX_MTU];
+    int n = 0;
+
+    while (!out_pool_empty()) {
+        pop_segment(&hdr, data);
+        if (((TcpHeader *) data)->s_port != port) continue;
+        *out = hdr;
+        memcpy(payload, data, hdr.len - sizeof(IpHeader));
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Offer a listener SYNs that are not TCP, truncated, have a bad data offset or a wrong checksum,
+ * and check that only the intact one is answered.
+ */
+TestResult test_tcp_input() {
+    printf("Testing TCP input checks...\t");
+    TestResult result = PASS;
+    char packet[sizeof(IpHeader) + sizeof(TcpHeader) + TCP_MAX_OPTIONS_LEN + 1500];
+    IpHeader* hdr = (IpHeader *) packet, out;
+    TcpHeader* tcp_hdr = (TcpHeader *) (packet + sizeof(IpHeader));
+    char payload[IP_MAX_MTU];
+    Tcb* listener;
+
+    // the checksum of a segment from a real stack verifies
+    uint32_t sum = tcp_pseudo_sum(0x0a090001, 0x0a090002, sizeof(linux_syn) - 20, 0);
+    if (csum_fold(csum_partial(linux_syn + 20, sizeof(linux_syn) - 20, sum)) != 0) result = FAIL;
+
+    if (OPEN(0x0a000001, 90, 0, 0, &listener) != TCP_SUCCESS) return FAIL;
+    tcp_process_events();
+
+    for (int round = 0; round < 6; round++) {
+        memset(packet, 0, sizeof(packet));
+        build_segment(packet, 90, TCP_SYN, 7000, 0, NULL, 0);
+        switch (round) {
+            case 0: hdr->proto = 17; break;                                 // not for TCP
+            case 1: hdr->len = sizeof(IpHeader) + 12; break;                // shorter than a TCP header
+            case 2: tcp_hdr->data_offset = 4; segment_checksum(packet); break;
+            case 3: tcp_hdr->data_offset = 15; segment_checksum(packet); break;
+            case 4: tcp_hdr->checksum ^= 1; break;
+        }
+        add_packet_event(pktbuf_copy(packet, hdr->len));
+        tcp_process_events();
+        if (pop_segments(90, &out, payload) != (round == 5)) result = FAIL;
+    }
+
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+/**
+ * Retransmission with exponential backoff and an RTO derived from the measured RTT, zero window
+ * probes, keepalive probes, and dropping a half open connection, on a made up clock.
+ */
+TestResult test_tcp_timers() {
+    printf("Testing TCP timers...\t");
+    TestResult result = PASS;
+    IpHeader out;
+    char payload[IP_MAX_MTU];
+    TcpHeader* seg = (TcpHeader *) payload;
+    char msg[100] = { 0 };
+    IpHeader syn_ack;
+    char syn_ack_payload[IP_MAX_MTU];
+    Tcb* listener;
+    uint32_t iss, irs = 9000;
+
+    // handshake with a 500 ms RTT: RTO = 500 + 4 * 250 ms
+    pop_segments(0, &out, payload);
+    if (OPEN(0x0a000001, 82, 0, 0, &listener) != TCP_SUCCESS) return FAIL;
+    tcp_process_events();
+    inject_segment(82, TCP_SYN, irs, 0, NULL, 0);
+    if (pop_segments(82, &syn_ack, syn_ack_payload) != 1) return FAIL;
+    iss = ((TcpHeader *) syn_ack_payload)->seq_number;
+    tcp_tick(test_clock += 500000);
+    inject_segment(82, TCP_ACK, irs + 1, iss + 1, NULL, 0);
+    Tcb* conn = tcp_accept(listener);
+
+    SEND(conn, msg, sizeof(msg));
+    tcp_process_events();
+    if (pop_segments(82, &out, payload) != 1) result = FAIL;
+    uint64_t sent = test_clock;
+    uint64_t rto = 1500000;
+    for (int i = 0; i < 3; i++) {
+        tcp_tick(sent + rto - 2000);
+        if (pop_segments(82, &out, payload) != 0) result = FAIL;
+        tcp_tick(sent + rto);
+        if (pop_segments(82, &out, payload) != 1 || seg->seq_number != iss + 1) result = FAIL;
+        if (out.len != sizeof(IpHeader) + sizeof(TcpHeader) + sizeof(msg)) result = FAIL;
+        sent += rto;
+        rto *= 2;
+    }
+    test_clock = sent;
+    inject_segment(82, TCP_ACK, irs + 1, iss + 1 + sizeof(msg), NULL, 0);
+    tcp_tick(test_clock += 600000000);
+    if (pop_segments(82, &out, payload) != 0) result = FAIL;
+
+    // zero window: probed until it opens again
+    peer_window = 0;
+    inject_segment(82, TCP_ACK, irs + 1, iss + 1 + sizeof(msg), NULL, 0);
+    SEND(conn, msg, sizeof(msg));
+    tcp_process_events();
+    if (pop_segments(82, &out, payload) != 0) result = FAIL;
+    tcp_tick(test_clock += TCP_PERSIST_MIN_US);
+    if (pop_segments(82, &out, payload) != 1 || seg->seq_number != iss + sizeof(msg)) result = FAIL;
+    if (out.len != sizeof(IpHeader) + sizeof(TcpHeader)) result = FAIL;
+    peer_window = TCP_MAX_WINDOW;
+    inject_segment(82, TCP_ACK, irs + 1, iss + 1 + sizeof(msg), NULL, 0);
+    if (pop_segments(82, &out, payload) != 1 || seg->seq_number != iss + 1 + sizeof(msg)) result = FAIL;
+    inject_segment(82, TCP_ACK, irs + 1, iss + 1 + 2 * sizeof(msg), NULL, 0);
+
+    // keepalive: probes after two idle hours, the connection is dropped once they go unanswered
+    tcp_set_keepalive(conn, true);
+    tcp_process_events();
+    tcp_tick(test_clock += TCP_KEEPALIVE_IDLE_US - 1000000);
+    if (pop_segments(82, &out, payload) != 0) result = FAIL;
+    tcp_tick(test_clock += 1000000);
+    if (pop_segments(82, &out, payload) != 1 || seg->seq_number != iss + 2 * sizeof(msg)) result = FAIL;
+    inject_segment(82, TCP_ACK, irs + 1, iss + 1 + 2 * sizeof(msg), NULL, 0);      // answered
+    tcp_tick(test_clock += TCP_KEEPALIVE_INTVL_US);
+    if (pop_segments(82, &out, payload) != 0) result = FAIL;
+    int probes = 0;
+    for (int i = 0; i <= TCP_KEEPALIVE_PROBES + 1; i++) {
+        tcp_tick(test_clock += TCP_KEEPALIVE_IDLE_US);
+        probes += pop_segments(82, &out, payload);
+    }
+    if (probes != TCP_KEEPALIVE_PROBES || tcp_state(conn) != TCP_CLOSED) result = FAIL;
+
+    // a SYN-ACK that is never acknowledged is resent TCP_MAX_RETRANSMITS times
+    TcpStats before, after;
+    tcp_get_stats(&before);
+    inject_segment(82, TCP_SYN, irs, 0, NULL, 0);
+    int syn_acks = pop_segments(82, &out, payload);
+    for (int i = 0; i < 1000; i++) {
+        tcp_tick(test_clock += 1000000);
+        syn_acks += pop_segments(82, &out, payload);
+    }
+    tcp_get_stats(&after);
+    if (syn_acks != 1 + TCP_MAX_RETRANSMITS || after.timeouts != before.timeouts + TCP_MAX_RETRANSMITS) result = FAIL;
+
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+/**
+ * ACKs for a batch of segments are coalesced, a lone small segment is acknowledged after the
+ * delayed ACK timeout, every second full sized segment and every segment out of order at once.
+ */
+TestResult test_delayed_ack() {
+    printf("Testing delayed ACK...\t");
+    TestResult result = PASS;
+    IpHeader out;
+    char payload[IP_MAX_MTU];
+    TcpHeader* seg = (TcpHeader *) payload;
+    char msg[1500] = { 0 };
+    uint32_t iss, irs = 20000, mss = ip_get_mtu() - sizeof(IpHeader) - sizeof(TcpHeader);
+    TcpStats before, after;
+
+    if (mss > sizeof(msg)) mss = sizeof(msg);
+    pop_segments(0, &out, payload);
+    Tcb* conn = accept_connection(84, irs, &iss);
+    if (conn == NULL) return FAIL;
+    uint32_t seq = irs + 1;
+
+    // a batch of ten segments: one ACK
+    tcp_get_stats(&before);
+    for (int i = 0; i < 10; i++, seq += 100) queue_segment(84, TCP_ACK, seq, iss + 1, msg, 100);
+    tcp_process_events();
+    tcp_tick(test_clock += TCP_DELACK_US);
+    if (pop_segments(84, &out, payload) != 1 || seg->ack_number != seq) result = FAIL;
+    tcp_get_stats(&after);
+    if (after.pure_acks != before.pure_acks + 1) result = FAIL;
+
+    // a lone small segment waits for the delayed ACK timer
+    inject_segment(84, TCP_ACK, seq, iss + 1, msg, 100);
+    seq += 100;
+    tcp_tick(test_clock += TCP_DELACK_US - TW_TICK_US);
+    if (pop_segments(84, &out, payload) != 0) result = FAIL;
+    tcp_tick(test_clock += TW_TICK_US);
+    if (pop_segments(84, &out, payload) != 1 || seg->ack_number != seq) result = FAIL;
+
+    // full sized segments: the second one is acknowledged at once
+    inject_segment(84, TCP_ACK, seq, iss + 1, msg, mss);
+    seq += mss;
+    if (pop_segments(84, &out, payload) != 0) result = FAIL;
+    inject_segment(84, TCP_ACK, seq, iss + 1, msg, mss);
+    seq += mss;
+    if (pop_segments(84, &out, payload) != 1 || seg->ack_number != seq) result = FAIL;
+
+    // out of order: a duplicate ACK at once, and once the gap is filled an ACK of both at once
+    inject_segment(84, TCP_ACK, seq + 100, iss + 1, msg, 100);
+    if (pop_segments(84, &out, payload) != 1 || seg->ack_number != seq) result = FAIL;
+    inject_segment(84, TCP_ACK, seq, iss + 1, msg, 100);
+    seq += 200;
+    if (pop_segments(84, &out, payload) != 1 || seg->ack_number != seq) result = FAIL;
+
+    // data to send carries the ACK
+    inject_segment(84, TCP_ACK, seq, iss + 1, msg, 100);
+    seq += 100;
+    SEND(conn, msg, 10);
+    tcp_process_events();
+    if (pop_segments(84, &out, payload) != 1 || seg->ack_number != seq || out.len != sizeof(IpHeader) + sizeof(TcpHeader) + 10) result = FAIL;
+    tcp_tick(test_clock += TCP_DELACK_US);
+    if (pop_segments(84, &out, payload) != 0) result = FAIL;
+
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+/**
+ * Option parsing and writing, the sender's scoreboard, then SACK blocks sent for out of order
+ * data, and only the holes retransmitted in recovery.
+ */
+TestResult test_sack() {
+    printf("Testing SACK...\t");
+    TestResult result = PASS;
+    char hdr_buf[sizeof(TcpHeader) + TCP_MAX_OPTIONS_LEN] __attribute__((aligned(4))) = { 0 };
+    TcpHeader* hdr = (TcpHeader *) hdr_buf;
+    char* opt = (char *) (hdr + 1);
+    TcpOptions opts = { .sack_permitted = true, .nsack = 3 }, parsed;
+
+    // options: written aligned, parsed back; malformed ones rejected
+    opts.sack[0] = (SackBlock) { 100, 200 };
+    opts.sack[1] = (SackBlock) { 300, 400 };
+    opts.sack[2] = (SackBlock) { 0xfffffff0, 16 };
+    uint8_t len = tcp_write_options(opt, &opts);
+    if (len != tcp_options_len(&opts) || len != 32 || len % 4 != 0) result = FAIL;
+    hdr->data_offset = (sizeof(TcpHeader) + len) / 4;
+    if (tcp_parse_options(hdr, &parsed) != 0 || !parsed.sack_permitted || parsed.nsack != 3) result = FAIL;
+    if (memcmp(parsed.sack, opts.sack, sizeof(opts.sack[0]) * 3) != 0) result = FAIL;
+    memcpy(opt, "\x01\x08\x0a\x00", 4);           // NOP, an unknown option running past the end
+    hdr->data_offset = 6;
+    if (tcp_parse_options(hdr, &parsed) != -1) result = FAIL;
+    memcpy(opt, "\x04\x03\x00\x00", 4);           // SACK-permitted of the wrong length
+    if (tcp_parse_options(hdr, &parsed) != -1) result = FAIL;
+    memcpy(opt, "\x01\x01\x00\x04", 4);           // NOPs, then EOL ends the list
+    if (tcp_parse_options(hdr, &parsed) != 0 || parsed.sack_permitted) result = FAIL;
+
+    // scoreboard: ranges merge, holes lie below the highest SACKed octet
+    SackScoreboard sb;
+    SackBlock hole;
+    sack_clear(&sb);
+    sack_add(&sb, 100, 200);
+    sack_add(&sb, 300, 400);
+    sack_add(&sb, 200, 300);
+    sack_add(&sb, 500, 600);
+    if (sb.n != 2 || sb.blocks[0].start != 100 || sb.blocks[0].end != 400) result = FAIL;
+    if (sack_high(&sb, 50) != 600 || sack_covered(&sb, 150, 550) != 300) result = FAIL;
+    if (!sack_next_hole(&sb, 50, &hole) || hole.start != 50 || hole.end != 100) result = FAIL;
+    if (!sack_next_hole(&sb, 100, &hole) || hole.start != 400 || hole.end != 500) result = FAIL;
+    if (sack_next_hole(&sb, 500, &hole)) result = FAIL;
+    sack_trim(&sb, 450);
+    if (sb.n != 1 || sb.blocks[0].start != 500 || sack_covered(&sb, 450, 600) != 100) result = FAIL;
+
+    // receiver: SACK agreed on in the handshake
+    IpHeader out;
+    char payload[IP_MAX_MTU];
+    TcpHeader* seg = (TcpHeader *) payload;
+    char msg[400], got[400];
+    Tcb* listener, *conn;
+    uint32_t iss, irs = 30000;
+    TcpOptions sack_permitted = { .sack_permitted = true, .has_mss = true, .mss = ip_get_mtu() - sizeof(IpHeader) - sizeof(TcpHeader) };
+
+    for (size_t i = 0; i < sizeof(msg); i++) msg[i] = 'a' + i % 26;
+    pop_segments(0, &out, payload);
+    if (OPEN(0x0a000001, 85, 0, 0, &listener) != TCP_SUCCESS) return FAIL;
+    tcp_process_events();
+    peer_options = &sack_permitted;
+    inject_segment(85, TCP_SYN, irs, 0, NULL, 0);
+    peer_options = NULL;
+    if (pop_segments(85, &out, payload) != 1) return FAIL;
+    if (tcp_parse_options(seg, &parsed) != 0 || !parsed.sack_permitted) result = FAIL;
+    iss = seg->seq_number;
+    inject_segment(85, TCP_ACK, irs + 1, iss + 1, NULL, 0);
+    conn = tcp_accept(listener);
+
+    // out of order segments: SACK blocks, the latest first; filling the gaps merges them
+    uint32_t s = irs + 1;
+    uint32_t order[] = { 100, 300, 200, 0 };
+    for (int i = 0; i < 4; i++) {
+        inject_segment(85, TCP_ACK, s + order[i], iss + 1, msg + order[i], 100);
+        if (pop_segments(85, &out, payload) != 1 || tcp_parse_options(seg, &parsed) != 0) return FAIL;
+        SackBlock* b = parsed.sack;
+        switch (i) {
+            case 0: if (seg->ack_number != s || parsed.nsack != 1 || b[0].start != s + 100 || b[0].end != s + 200) result = FAIL; break;
+            case 1: if (parsed.nsack != 2 || b[0].start != s + 300 || b[1].start != s + 100) result = FAIL; break;
+            case 2: if (parsed.nsack != 1 || b[0].start != s + 100 || b[0].end != s + 400) result = FAIL; break;
+            case 3: if (seg->ack_number != s + 400 || parsed.nsack != 0) result = FAIL; break;
+        }
+    }
+    if (RECEIVE(conn, got, sizeof(got)) != sizeof(msg) || memcmp(got, msg, sizeof(msg)) != 0) result = FAIL;
+    tcp_process_events();
+
+    // sender: segments 1 and 4 of 10 are lost, the others SACKed; only those two are resent
+    char data[15000] = { 0 };
+    TcpStats before, after;
+    TcpOptions acks = { .nsack = 2 };
+    uint32_t mss = ip_get_mtu() - sizeof(IpHeader) - sizeof(TcpHeader);
+    uint32_t una = iss + 1, rcv = s + 400;
+
+    if (tcp_cwnd(conn) < 10 * mss || 10 * mss > sizeof(data)) return FAIL;
+    SEND(conn, data, 10 * mss);
+    tcp_process_events();
+    pop_segments(0, &out, payload);
+    tcp_get_stats(&before);
+    peer_options = &acks;
+    acks.sack[1] = (SackBlock) { una + 2 * mss, una + 4 * mss };
+    uint32_t arrived[] = { 2, 3, 5, 6, 7, 8, 9 };
+    for (int i = 0; i < 7; i++) {           // a duplicate ACK per segment, its range reported first
+        uint32_t end = una + (arrived[i] + 1) * mss;
+        acks.nsack = arrived[i] < 5 ? 1 : 2;
+        acks.sack[0] = (SackBlock) { una + (arrived[i] < 5 ? 2 : 5) * mss, end };
+        queue_segment(85, TCP_ACK, rcv, una + mss, NULL, 0);
+    }
+    tcp_process_events();
+    peer_options = NULL;
+    tcp_get_stats(&after);
+    if (after.fast_retransmits != before.fast_retransmits + 2) result = FAIL;
+    uint32_t resent = 0;
+    while (!out_pool_empty()) {
+        pop_segment(&out, payload);
+        uint32_t seg_len = out.len - sizeof(IpHeader) - seg->data_offset * 4;
+        if (seg_len == 0) continue;
+        if (seg_len != mss || (seg->seq_number != una + mss && seg->seq_number != una + 4 * mss)) result = FAIL;
+        resent++;
+    }
+    if (resent != 2) result = FAIL;
+
+    inject_segment(85, TCP_ACK, rcv, una + 10 * mss, NULL, 0);      // recovery is over
+    if (tcp_state(conn) != TCP_ESTAB) result = FAIL;
+    pop_segments(0, &out, payload);
+
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+/**
+ * Option parsing and writing, then a connection with window scaling and timestamps: scaled
+ * windows both ways, segments sized to the peer's MSS less the options, RTT measured from the
+ * echoed timestamps, and an old duplicate rejected by PAWS. Last, a peer without options.
+ */
+TestResult test_tcp_options() {
+    printf("Testing TCP options...\t");
+    TestResult result = PASS;
+    char hdr_buf[sizeof(TcpHeader) + TCP_MAX_OPTIONS_LEN] __attribute__((aligned(4))) = { 0 };
+    TcpHeader* hdr = (TcpHeader *) hdr_buf;
+    char* opt = (char *) (hdr + 1);
+    TcpOptions syn = { .has_mss = true, .mss = 1000, .has_wscale = true, .wscale = 7, .sack_permitted = true,
+                       .has_timestamp = true, .ts_val = 5000 }, parsed;
+
+    // every option of a SYN, then timestamps alone, read by the fast path
+    uint8_t len = tcp_write_options(opt, &syn);
+    hdr->data_offset = (sizeof(TcpHeader) + len) / 4;
+    if (len != 24 || tcp_parse_options(hdr, &parsed) != 0) result = FAIL;
+    if (!parsed.has_mss || parsed.mss != 1000 || !parsed.has_wscale || parsed.wscale != 7) result = FAIL;
+    if (!parsed.sack_permitted || !parsed.has_timestamp || parsed.ts_val != 5000 || parsed.ts_ecr != 0) result = FAIL;
+    TcpOptions ts = { .has_timestamp = true, .ts_val = 7, .ts_ecr = 0x80000001 };
+    hdr->data_offset = (sizeof(TcpHeader) + tcp_write_options(opt, &ts)) / 4;
+    if (tcp_parse_options(hdr, &parsed) != 0 || parsed.has_mss || parsed.ts_val != 7 || parsed.ts_ecr != 0x80000001) result = FAIL;
+    memcpy(opt, "\x03\x03\x20\x00", 4);           // shift beyond 14 is taken as 14
+    hdr->data_offset = 6;
+    if (tcp_parse_options(hdr, &parsed) != 0 || parsed.wscale != TCP_MAX_WSCALE) result = FAIL;
+    memcpy(opt, "\x02\x03\x05\x00", 4);           // MSS of the wrong length
+    if (tcp_parse_options(hdr, &parsed) != -1) result = FAIL;
+
+    // fields are big endian on the wire: the options of the SYN captured from Linux, then ours
+    if (tcp_parse_options((const TcpHeader *) (linux_syn + 20), &parsed) != 0) result = FAIL;
+    if (!parsed.has_mss || parsed.mss != 1460 || !parsed.has_wscale || parsed.wscale != 10) result = FAIL;
+    if (!parsed.sack_permitted || !parsed.has_timestamp || parsed.ts_val != 0xeb8412b3 || parsed.ts_ecr != 0) result = FAIL;
+    TcpOptions wire = { .has_mss = true, .mss = 1460, .has_timestamp = true, .ts_val = 0x01020304, .ts_ecr = 0x05060708,
+                        .nsack = 1, .sack = { { .start = 0x11121314, .end = 0x15161718 } } };
+    if (tcp_write_options(opt, &wire) != 28) result = FAIL;
+    if (memcmp(opt, "\x02\x04\x05\xb4\x01\x01\x08\x0a\x01\x02\x03\x04\x05\x06\x07\x08"
+                    "\x01\x01\x05\x0a\x11\x12\x13\x14\x15\x16\x17\x18", 28) != 0) result = FAIL;
+
+    // active open: our SYN offers everything
+    IpHeader out;
+    char payload[IP_MAX_MTU];
+    TcpHeader* seg = (TcpHeader *) payload;
+    char msg[20000] = { 0 };
+    Tcb* conn;
+    uint32_t irs = 40000;
+
+    pop_segments(0, &out, payload);
+    if (OPEN(0x0a000001, 87, 0x0a000002, 4000, &conn) != TCP_SUCCESS) return FAIL;
+    tcp_process_events();
+    if (pop_segments(87, &out, payload) != 1 || tcp_parse_options(seg, &parsed) != 0) return FAIL;
+    uint32_t iss = seg->seq_number, our_ts = parsed.ts_val;
+    if (!parsed.has_mss || parsed.mss != ip_get_mtu() - sizeof(IpHeader) - sizeof(TcpHeader)) result = FAIL;
+    if (!parsed.has_wscale || (TCP_RCV_BUF >> parsed.wscale) > TCP_MAX_WINDOW || !parsed.has_timestamp) result = FAIL;
+    uint8_t rcv_shift = parsed.wscale;
+
+    // the SYN-ACK, 10 ms later, takes scaling and timestamps, with an MSS of 1000
+    tcp_tick(test_clock += 10 * TW_TICK_US);
+    peer_options = &syn;
+    syn.ts_ecr = our_ts;
+    inject_segment(87, TCP_SYN | TCP_ACK, irs, iss + 1, NULL, 0);
+    if (tcp_state(conn) != TCP_ESTAB || pop_segments(87, &out, payload) != 1) return FAIL;
+    if (tcp_parse_options(seg, &parsed) != 0 || !parsed.has_timestamp || parsed.ts_ecr != 5000) result = FAIL;
+    if (seg->window != (TCP_RCV_BUF >> rcv_shift > TCP_MAX_WINDOW ? TCP_MAX_WINDOW : TCP_RCV_BUF >> rcv_shift)) result = FAIL;
+
+    // a window of 50 << 7: 6400 octets go out, in segments of 1000 less the timestamps
+    ts = (TcpOptions) { .has_timestamp = true, .ts_val = 5001, .ts_ecr = our_ts };
+    peer_options = &ts;
+    peer_window = 50;
+    inject_segment(87, TCP_ACK, irs + 1, iss + 1, NULL, 0);
+    SEND(conn, msg, sizeof(msg));
+    tcp_process_events();
+    uint32_t sent = 0;
+    while (!out_pool_empty()) {
+        pop_segment(&out, payload);
+        uint32_t seg_len = out.len - sizeof(IpHeader) - seg->data_offset * 4;
+        if (seg_len > 1000 - TCP_TIMESTAMP_LEN || tcp_parse_options(seg, &parsed) != 0 || !parsed.has_timestamp) result = FAIL;
+        our_ts = parsed.ts_val;
+        sent += seg_len;
+    }
+    if (sent != 50 << 7) result = FAIL;
+
+    // the round trip is timed from the echoed timestamp, here 10 ms older than the data: 40 ms
+    tcp_tick(test_clock += 30 * TW_TICK_US);
+    ts.ts_ecr = our_ts - 10;
+    peer_window = 0;
+    inject_segment(87, TCP_ACK, irs + 1, iss + 1 + sent, NULL, 0);
+    if (tcp_srtt(conn) != (7 * 10000 + 40000) / 8) result = FAIL;
+
+    // PAWS: an older timestamp is a duplicate from the past, answered but not taken
+    char got[100];
+    ts.ts_val = 4000;
+    pop_segments(0, &out, payload);
+    inject_segment(87, TCP_ACK, irs + 1, iss + 1 + sent, "stale", 5);
+    if (pop_segments(87, &out, payload) != 1 || seg->ack_number != irs + 1) result = FAIL;
+    if (RECEIVE(conn, got, sizeof(got)) != 0) result = FAIL;
+    ts.ts_val = 5002;
+    inject_segment(87, TCP_ACK, irs + 1, iss + 1 + sent, "fresh", 5);
+    if (RECEIVE(conn, got, sizeof(got)) != 5 || memcmp(got, "fresh", 5) != 0) result = FAIL;
+    tcp_process_events();
+    peer_options = NULL;
+    peer_window = TCP_MAX_WINDOW;
+    tcp_tick(test_clock += TCP_DELACK_US);
+    pop_segments(0, &out, payload);
+
+    // a peer without options: no scaling, no timestamps, segments of the default MSS
+    TcpOptions none = { 0 };
+    Tcb* listener;
+    if (OPEN(0x0a000001, 88, 0, 0, &listener) != TCP_SUCCESS) return FAIL;
+    tcp_process_events();
+    peer_options = &none;
+    inject_segment(88, TCP_SYN, irs, 0, NULL, 0);
+    if (pop_segments(88, &out, payload) != 1 || tcp_parse_options(seg, &parsed) != 0) return FAIL;
+    if (!parsed.has_mss || parsed.has_wscale || parsed.has_timestamp || parsed.sack_permitted) result = FAIL;
+    iss = seg->seq_number;
+    inject_segment(88, TCP_ACK, irs + 1, iss + 1, NULL, 0);
+    peer_options = NULL;
+    conn = tcp_accept(listener);
+    SEND(conn, msg, 2000);
+    tcp_process_events();
+    while (!out_pool_empty()) {
+        pop_segment(&out, payload);
+        if (seg->data_offset != 5 || out.len - sizeof(IpHeader) - sizeof(TcpHeader) > TCP_DEFAULT_MSS) result = FAIL;
+    }
+
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+/**
+ * Rings of the connections a listener spawns: set per listener, and no larger than the windows
+ * the handshake settled on.
+ */
+TestResult test_tcp_buffers() {
+    printf("Testing TCP buffers...\t");
+    TestResult result = PASS;
+    IpHeader out;
+    char payload[IP_MAX_MTU];
+    TcpHeader* seg = (TcpHeader *) payload;
+    char* msg = calloc(1, 1 << 17);
+    TcpOptions scaled = { .has_mss = true, .mss = 1000, .has_wscale = true, .wscale = 7 }, none = { 0 };
+    Tcb* listener, *conn;
+    uint32_t irs = 50000, iss;
+
+    // set on the listener
+    pop_segments(0, &out, payload);
+    if (OPEN(0x0a000001, 91, 0, 0, &listener) != TCP_SUCCESS) return FAIL;
+    tcp_process_events();
+    if (tcp_set_buffers(listener, 3000, 8192) != TCP_ERR) result = FAIL;
+    if (tcp_set_buffers(listener, 4096, 8192) != TCP_SUCCESS) result = FAIL;
+    peer_options = &scaled;
+    inject_segment(91, TCP_SYN, irs, 0, NULL, 0);
+    if (pop_segments(91, &out, payload) != 1 || seg->window != 8192) result = FAIL;
+    iss = seg->seq_number;
+    peer_options = NULL;
+    inject_segment(91, TCP_ACK, irs + 1, iss + 1, NULL, 0);
+    conn = tcp_accept(listener);
+    if (tcp_set_buffers(conn, 4096, 8192) != TCP_ERR) result = FAIL;
+    if (SEND(conn, msg, 10000) != 4096) result = FAIL;
+    tcp_process_events();
+    pop_segments(0, &out, payload);
+
+    // a peer that cannot scale never fills more than a 64K ring
+    if (OPEN(0x0a000001, 92, 0, 0, &listener) != TCP_SUCCESS) return FAIL;
+    tcp_process_events();
+    peer_options = &none;
+    inject_segment(92, TCP_SYN, irs, 0, NULL, 0);
+    if (pop_segments(92, &out, payload) != 1 || seg->window != TCP_MAX_WINDOW) result = FAIL;
+    iss = seg->seq_number;
+    inject_segment(92, TCP_ACK, irs + 1, iss + 1, NULL, 0);
+    peer_options = NULL;
+    conn = tcp_accept(listener);
+    if (SEND(conn, msg, 1 << 17) != TCP_MAX_WINDOW + 1) result = FAIL;
+    tcp_process_events();
+    pop_segments(0, &out, payload);
+
+    free(msg);
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+/**
+ * The out of order queue: ranges merge, SACK blocks come latest first, and filling a gap takes
+ * every range it reaches at once. Then a connection holding more gaps than one ACK can report.
+ */
+TestResult test_ooo_queue() {
+    printf("Testing out of order queue...\t");
+    TestResult result = PASS;
+    OooQueue q;
+    SackBlock b[4];
+
+    ooo_clear(&q);
+    ooo_add(&q, 300, 400);
+    ooo_add(&q, 100, 200);
+    ooo_add(&q, 500, 600);
+    ooo_add(&q, 200, 250);          // grows the range of 100
+    if (q.n != 3 || q.ranges[0].start != 100 || q.ranges[0].end != 250) result = FAIL;
+    if (ooo_sack(&q, b, 4) != 3 || b[0].start != 100 || b[1].start != 500 || b[2].start != 300) result = FAIL;
+    if (ooo_sack(&q, b, 1) != 1 || b[0].start != 100) result = FAIL;
+    if (ooo_take(&q, 50) != 50 || ooo_take(&q, 120) != 250 || q.n != 2) result = FAIL;
+    ooo_add(&q, 250, 300);
+    if (ooo_take(&q, 250) != 400 || q.n != 1 || q.ranges[0].start != 500) result = FAIL;
+    for (uint32_t i = 1; i < OOO_QUEUE_SIZE; i++) ooo_add(&q, 1000 + 20 * i, 1010 + 20 * i);
+    if (q.n != OOO_QUEUE_SIZE || ooo_add(&q, 5000, 5010)) result = FAIL;
+    if (!ooo_add(&q, 1015, 1020)) result = FAIL;    // merges, so it still fits
+
+    // five gaps: the ACK reports the latest four, then the data comes out in order
+    IpHeader out;
+    char payload[IP_MAX_MTU];
+    TcpHeader* seg = (TcpHeader *) payload;
+    TcpOptions parsed;
+    char msg[1000], got[1000];
+    uint32_t iss, irs = 50000;
+
+    for (size_t i = 0; i < sizeof(msg); i++) msg[i] = 'a' + i % 26;
+    pop_segments(0, &out, payload);
+    TcpOptions sack_permitted = { .sack_permitted = true, .has_mss = true, .mss = ip_get_mtu() - sizeof(IpHeader) - sizeof(TcpHeader) };
+    peer_options = &sack_permitted;
+    Tcb* conn = accept_connection(89, irs, &iss);
+    peer_options = NULL;
+    if (conn == NULL) return FAIL;
+    uint32_t s = irs + 1;
+    for (int i = 1; i < 10; i += 2) queue_segment(89, TCP_ACK, s + 100 * i, iss + 1, msg + 100 * i, 100);
+    queue_segment(89, TCP_ACK, s + 100000, iss + 1, msg, 100);     // beyond the window: not kept
+    tcp_process_events();
+    if (pop_segments(89, &out, payload) != 1 || tcp_parse_options(seg, &parsed) != 0) return FAIL;
+    if (seg->ack_number != s || parsed.nsack != 4) result = FAIL;
+    for (int i = 0; i < parsed.nsack; i++) {
+        if (parsed.sack[i].start != s + 100 * (9 - 2 * i) || parsed.sack[i].end != s + 100 * (10 - 2 * i)) result = FAIL;
+    }
+
+    inject_segment(89, TCP_ACK, s, iss + 1, msg, 100);               // the first gap: up to the second
+    if (pop_segments(89, &out, payload) != 1 || seg->ack_number != s + 200) result = FAIL;
+    for (int i = 2; i < 10; i += 2) queue_segment(89, TCP_ACK, s + 100 * i, iss + 1, msg + 100 * i, 100);
+    tcp_process_events();
+    if (pop_segments(89, &out, payload) != 1 || seg->ack_number != s + 1000) result = FAIL;
+    if (tcp_parse_options(seg, &parsed) != 0 || parsed.nsack != 0) result = FAIL;
+    if (RECEIVE(conn, got, sizeof(got)) != sizeof(msg) || memcmp(got, msg, sizeof(msg)) != 0) result = FAIL;
+    tcp_process_events();
+
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
+/**
+ * Feed the SYN captured from Linux through the IP input path, and check the SYN-ACK octet by
+ * octet as it would go out on the wire.
+ */
+TestResult test_tcp_wire() {
+    printf("Testing TCP on the wire...\t");
+    TestResult result = PASS;
+    IpHeader out;
+    unsigned char seg[IP_MAX_MTU];
+    Tcb* listener;
+
+    pop_segments(0, &out, (char *) seg);
+    if (OPEN(0x0a090002, 80, 0, 0, &listener) != TCP_SUCCESS) return FAIL;
+    tcp_process_events();
+    in_pool_push((char *) linux_syn, sizeof(linux_syn));
+    tcp_process_events();
+    if (out_pool_empty()) return FAIL;
+    out_pool_pop(&out, (char *) seg);               // the IP header in host order, the segment as sent
+    uint16_t tcp_len = out.len - sizeof(IpHeader);
+
+    if (out.proto != IP_PROTO_TCP || out.saddr != 0x0a090002 || out.daddr != 0x0a090001) result = FAIL;
+    if (ip_checksum(&out, sizeof(out)) != 0) result = FAIL;
+    if (memcmp(seg, "\x00\x50\x9d\x9a", 4) != 0) result = FAIL;              // ports
+    if (memcmp(seg + 8, "\x03\x86\xe0\x14", 4) != 0) result = FAIL;          // acknowledges their ISN + 1
+    if (seg[12] >> 4 != tcp_len / 4 || (seg[12] & 0xf) != 0) result = FAIL;     // data offset, reserved
+    if (seg[13] != 0x12) result = FAIL;                                         // SYN and ACK
+    if (seg[14] != 0xff || seg[15] != 0xff || seg[18] != 0 || seg[19] != 0) result = FAIL;
+    if ((seg[22] << 8 | seg[23]) != ip_get_mtu() - 40) result = FAIL;               // our MSS
+    if (memcmp(seg + 40, "\xeb\x84\x12\xb3", 4) != 0) result = FAIL;         // echoes their TSval
+    uint32_t sum = tcp_pseudo_sum(out.saddr, out.daddr, tcp_len, 0);
+    if (csum_fold(csum_partial(seg, tcp_len, sum)) != 0) result = FAIL;
+
+    printf(result == PASS ? "PASS\n" : "FAIL\n");
+    return result;
+}
+
 int main() {
     ip_init();
+    ras_init(&rs);
     test_out_pool();
+    test_out_pool_wrap();
     test_fragmentation();
+    test_fragmentation_zc();
+    test_mtu();
+    test_checksum();
+    test_byte_order();
+    test_truncated();
     test_ras();
+    test_ras_interleaved();
+    test_ras_out_of_order();
+    test_ras_growth();
+    test_ras_take();
+    test_ras_expiry();
+    test_ras_limits();
+    test_flow_hash();
+    test_tcb_table();
+    test_mpsc_queue();
+    test_event_pool();
+    test_tcp_data();
+    test_tcp_input();
+    test_congestion();
+    test_timer_wheel();
+    test_tcp_timers();
+    test_delayed_ack();
+    test_sack();
+    test_tcp_options();
+    test_tcp_buffers();
+    test_ooo_queue();
+    test_tcp_wire();
+    ras_kill(rs);
     release();
 }
 
@@ -0,0 +1,152 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "timer_wheel.h"
+
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_SPAN(level) (1ULL << (TW_SLOT_BITS * (level)))       // ticks covered by a slot of level
+
+/**
+ * Sets up an empty wheel.
+ * @param now_us: current time, the wheel starts at its tick.
+ */
+void tw_init(TimerWheel* tw, uint64_t now_us) {
+    memset(tw, 0, sizeof(TimerWheel));
+    tw->now = now_us / TW_TICK_US;
+}
+
+/**
+ * Sets up a timer that is not armed.
+ * @param fire: called by tw_advance once the timer expires; it may arm the timer again.
+ */
+void tw_timer_init(TimerNode* t, void (*fire)(TimerNode* t)) {
+    t->next = NULL;
+    t->pprev = NULL;
+    t->fire = fire;
+}
+
+bool tw_armed(TimerNode* t) {
+    return t->pprev != NULL;
+}
+
+/**
+ * Links a timer into the slot its expiry falls in: the lowest level whose range reaches it.
+ */
+void tw_link(TimerWheel* tw, TimerNode* t) {
+    uint64_t delta = t->expires - tw->now;
+    int level = 0;
+
+    while (level < TW_LEVELS - 1 && delta >= TW_SPAN(level + 1)) level++;
+    if (delta >= TW_SPAN(TW_LEVELS)) t->expires = tw->now + TW_SPAN(TW_LEVELS) - 1;
+
+    t->level = level;
+    t->slot = (t->expires >> (TW_SLOT_BITS * level)) & TW_MASK;
+    TimerNode** head = &tw->slots[level][t->slot];
+    t->next = *head;
+    if (t->next != NULL) t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+    tw->occupied[level] |= 1ULL << t->slot;
+}
+
+void tw_unlink(TimerWheel* tw, TimerNode* t) {
+    *t->pprev = t->next;
+    if (t->next != NULL) t->next->pprev = t->pprev;
+    if (tw->slots[t->level][t->slot] == NULL) tw->occupied[t->level] &= ~(1ULL << t->slot);
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+/**
+ * Arms a timer, or moves it if it is armed already.
+ * @param expires_us: time to fire at, rounded up to the next tick. Times in the past fire on the
+ *                    next tick.
+ */
+void tw_arm(TimerWheel* tw, TimerNode* t, uint64_t expires_us) {
+    if (tw_armed(t)) tw_unlink(tw, t);
+    else tw->count++;
+    t->expires = (expires_us + TW_TICK_US - 1) / TW_TICK_US;
+    if (t->expires <= tw->now) t->expires = tw->now + 1;
+    tw_link(tw, t);
+}
+
+/**
+ * Disarms a timer; does nothing if it is not armed.
+ */
+void tw_cancel(TimerWheel* tw, TimerNode* t) {
+    if (!tw_armed(t)) return;
+    tw_unlink(tw, t);
+    tw->count--;
+}
+
+/**
+ * Spreads the timers of the slot of level the wheel just reached over the levels below. Carries
+ * on to the next level up when this one wrapped around as well.
+ */
+void tw_cascade(TimerWheel* tw) {
+    for (int level = 1; level < TW_LEVELS; level++) {
+        int slot = (tw->now >> (TW_SLOT_BITS * level)) & TW_MASK;
+        TimerNode* t = tw->slots[level][slot];
+
+        tw->slots[level][slot] = NULL;
+        tw->occupied[level] &= ~(1ULL << slot);
+        while (t != NULL) {
+            TimerNode* next = t->next;
+            tw_link(tw, t);
+            t = next;
+        }
+        if (slot != 0) break;
+    }
+}
+
+/**
+ * First tick after now at which the wheel has work to do: a level 0 slot to fire, or an occupied
+ * slot of a higher level to cascade. Slot s of level l is reached at the next tick that is a
+ * multiple of 64^l and falls in s.
+ * @return the tick, UINT64_MAX if no timer is armed.
+ */
+uint64_t tw_next_tick(TimerWheel* tw) {
+    uint64_t next = UINT64_MAX;
+
+    for (int level = 0; level < TW_LEVELS; level++) {
+        if (tw->occupied[level] == 0) continue;
+        uint64_t k = (tw->now >> (TW_SLOT_BITS * level)) + 1;
+        int from = k & TW_MASK;
+        uint64_t rotated = (tw->occupied[level] >> from) | (from ? tw->occupied[level] << (TW_SLOTS - from) : 0);
+        uint64_t tick = (k + __builtin_ctzll(rotated)) << (TW_SLOT_BITS * level);
+        if (tick < next) next = tick;
+    }
+    return next;
+}
+
+/**
+ * Moves the wheel to the given time, firing every timer that expired on the way, in order of
+ * expiry tick. Ticks with nothing to fire or cascade are skipped.
+ */
+void tw_advance(TimerWheel* tw, uint64_t now_us) {
+    uint64_t target = now_us / TW_TICK_US;
+    uint64_t next;
+
+    while ((next = tw_next_tick(tw)) <= target) {
+        tw->now = next;
+        if ((tw->now & TW_MASK) == 0) tw_cascade(tw);
+
+        int slot = tw->now & TW_MASK;
+        TimerNode* t;
+        while ((t = tw->slots[0][slot]) != NULL) {      // fire may arm timers in this very slot
+            tw_unlink(tw, t);
+            tw->count--;
+            t->fire(t);
+        }
+    }
+    if (tw->now < target) tw->now = target;
+}
+
+/**
+ * Time until the wheel next has work to do, which callers can sleep.
+ * @return microseconds, -1 if no timer is armed.
+ */
+int64_t tw_next_us(TimerWheel* tw) {
+    uint64_t next = tw_next_tick(tw);
+    return next == UINT64_MAX ? -1 : (int64_t) ((next - tw->now) * TW_TICK_US);
+}
@@ -0,0 +1,46 @@
+#ifndef TIMER_WHEEL
+#define TIMER_WHEEL
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TW_TICK_US 1000             // resolution of the wheel
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1 << TW_SLOT_BITS)   // slots per level
+#define TW_LEVELS 4                 // 64^4 ticks, about 4.6 hours at 1 ms per tick
+
+/*
+ * Intrusive timer. Structures that need a timer embed a TimerNode and get back to themselves
+ * from the node passed to fire.
+ */
+typedef struct TimerNode {
+    struct TimerNode* next;
+    struct TimerNode** pprev;       // NULL while the timer is not armed
+    uint64_t expires;               // tick the timer fires at
+    uint8_t level;
+    uint8_t slot;
+    void (*fire)(struct TimerNode* t);
+} TimerNode;
+
+/*
+ * Hierarchical timing wheel (Varghese and Lauck). Level 0 has a slot per tick; a slot of level l
+ * spans 64^l ticks and is spread over the level below when the wheel reaches it. Arming and
+ * cancelling are O(1), and a bitmap of the occupied slots per level lets the wheel skip ahead
+ * over empty ticks. A wheel belongs to one thread and takes no locks.
+ */
+typedef struct {
+    uint64_t now;                   // last tick processed
+    uint64_t occupied[TW_LEVELS];   // bit i set if slot i of the level holds a timer
+    TimerNode* slots[TW_LEVELS][TW_SLOTS];
+    uint64_t count;                 // armed timers
+} TimerWheel;
+
+void tw_init(TimerWheel* tw, uint64_t now_us);
+void tw_timer_init(TimerNode* t, void (*fire)(TimerNode* t));
+void tw_arm(TimerWheel* tw, TimerNode* t, uint64_t expires_us);
+void tw_cancel(TimerWheel* tw, TimerNode* t);
+bool tw_armed(TimerNode* t);
+void tw_advance(TimerWheel* tw, uint64_t now_us);
+int64_t tw_next_us(TimerWheel* tw);
+
+#endif
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tun_io.h"
+
+/*
+ * Batched I/O backend for the traffic manager. Reads and writes are queued on an io_uring
+ * submission queue and handed to the kernel with a single io_uring_enter per traffic manager
+ * cycle. The pool memory is registered with the ring, so the kernel reads and writes the pool
+ * slots directly.
+ *
+ * A tun fd delivers exactly one packet per read/readv and accepts one per write/writev, so
+ * there is no vectored fallback that moves several packets per syscall: without io_uring the
+ * traffic manager keeps issuing one read/write per packet.
+ */
+
+/**
+ * Given a TioStatus, prints the associated error message.
+ * @param s: TioStatus to be decoded.
+ */
+void tio_error_message(TioStatus s) {
+    switch (s) {
+        case TIO_ERR_UNSUPPORTED: printf("TIO: io_uring not supported."); break;
+        case TIO_ERR_SETUP: printf("TIO: Ring setup failed."); break;
+        case TIO_ERR_QUEUE_FULL: printf("TIO: Submission queue full."); break;
+        case TIO_ERR_SUBMIT: printf("TIO: Submission failed."); break;
+        case TIO_SUCCESS: break;
+    }
+}
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/**
+ * Sets up the ring for the given tun fd, and registers bufs as fixed buffers. If registering fails
+ * (e.g. because of RLIMIT_MEMLOCK), the ring is still used, just without fixed buffers.
+ * @param tio: ring to be set up, one per tun queue.
+ * @param fd: tun fd to read from and write to.
+ * @param bufs: memory regions the buffers passed to tio_prep_* are in, indexed by buf_index.
+ * @param nbufs: number of regions in bufs.
+ */
+TioStatus tio_init(TioRing* tio, int fd, struct iovec* bufs, unsigned nbufs) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    tio->ring_fd = syscall(__NR_io_uring_setup, TIO_QUEUE_DEPTH, &p);
+    if (tio->ring_fd < 0) return TIO_ERR_UNSUPPORTED;
+
+    tio->fd = fd;
+    tio->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    tio->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (tio->cq_sz > tio->sq_sz) tio->sq_sz = tio->cq_sz;
+        tio->cq_sz = tio->sq_sz;
+    }
+
+    tio->sq_ptr = mmap(NULL, tio->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, tio->ring_fd, IORING_OFF_SQ_RING);
+    if (tio->sq_ptr == MAP_FAILED) goto err_close;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        tio->cq_ptr = tio->sq_ptr;
+    } else {
+        tio->cq_ptr = mmap(NULL, tio->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, tio->ring_fd, IORING_OFF_CQ_RING);
+        if (tio->cq_ptr == MAP_FAILED) goto err_unmap_sq;
+    }
+
+    tio->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    tio->sqes = mmap(NULL, tio->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, tio->ring_fd, IORING_OFF_SQES);
+    if (tio->sqes == MAP_FAILED) goto err_unmap_cq;
+
+    tio->sq_head = (unsigned *) ((char *) tio->sq_ptr + p.sq_off.head);
+    tio->sq_tail = (unsigned *) ((char *) tio->sq_ptr + p.sq_off.tail);
+    tio->sq_mask = (unsigned *) ((char *) tio->sq_ptr + p.sq_off.ring_mask);
+    tio->sq_array = (unsigned *) ((char *) tio->sq_ptr + p.sq_off.array);
+    tio->sq_entries = p.sq_entries;
+    tio->to_submit = 0;
+
+    tio->cq_head = (unsigned *) ((char *) tio->cq_ptr + p.cq_off.head);
+    tio->cq_tail = (unsigned *) ((char *) tio->cq_ptr + p.cq_off.tail);
+    tio->cq_mask = (unsigned *) ((char *) tio->cq_ptr + p.cq_off.ring_mask);
+    tio->cqes = (struct io_uring_cqe *) ((char *) tio->cq_ptr + p.cq_off.cqes);
+
+    tio->fixed = syscall(__NR_io_uring_register, tio->ring_fd, IORING_REGISTER_BUFFERS, bufs, nbufs) == 0;
+
+    tio->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (tio->efd < 0) goto err_unmap_sqes;
+    if (syscall(__NR_io_uring_register, tio->ring_fd, IORING_REGISTER_EVENTFD, &tio->efd, 1) < 0) goto err_close_efd;
+
+    return TIO_SUCCESS;
+
+err_close_efd:
+    close(tio->efd);
+    tio->efd = -1;
+err_unmap_sqes:
+    munmap(tio->sqes, tio->sqes_sz);
+err_unmap_cq:
+    if (tio->cq_ptr != tio->sq_ptr) munmap(tio->cq_ptr, tio->cq_sz);
+err_unmap_sq:
+    munmap(tio->sq_ptr, tio->sq_sz);
+err_close:
+    close(tio->ring_fd);
+    tio->ring_fd = -1;
+    return TIO_ERR_SETUP;
+}
+
+/**
+ * Tears down the ring. Requests still in flight are cancelled by the kernel.
+ */
+void tio_kill(TioRing* tio) {
+    if (tio->ring_fd < 0) return;
+    close(tio->efd);
+    tio->efd = -1;
+    munmap(tio->sqes, tio->sqes_sz);
+    if (tio->cq_ptr != tio->sq_ptr) munmap(tio->cq_ptr, tio->cq_sz);
+    munmap(tio->sq_ptr, tio->sq_sz);
+    close(tio->ring_fd);
+    tio->ring_fd = -1;
+}
+
+/**
+ * Returns a non-blocking eventfd that becomes readable whenever a request completes, so the
+ * caller can wait for completions together with other fds.
+ */
+int tio_event_fd(TioRing* tio) {
+    return tio->efd;
+}
+
+TioStatus tio_prep(TioRing* tio, uint8_t op, char* buf, size_t len, int buf_index, uint64_t tag) {
+    unsigned tail = *tio->sq_tail + tio->to_submit;
+    if (tail - __atomic_load_n(tio->sq_head, __ATOMIC_ACQUIRE) >= tio->sq_entries) return TIO_ERR_QUEUE_FULL;
+
+    unsigned idx = tail & *tio->sq_mask;
+    struct io_uring_sqe* sqe = &tio->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = tio->fd;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = len;
+    sqe->off = -1;                                  // tun is not seekable: use the file position
+    sqe->user_data = tag;
+    if (tio->fixed && op != IORING_OP_WRITEV) {
+        sqe->opcode = op == IORING_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+        sqe->buf_index = buf_index;
+    } else {
+        sqe->opcode = op;
+    }
+    tio->sq_array[idx] = idx;
+    tio->to_submit++;
+    return TIO_SUCCESS;
+}
+
+/**
+ * Queues a read of one packet into buf. Nothing is handed to the kernel until tio_submit.
+ * @param buf: destination, must lie in region buf_index passed to tio_init.
+ * @param len: size of buf.
+ * @param buf_index: index of the registered region buf lies in.
+ * @param tag: value returned by tio_reap for this request.
+ */
+TioStatus tio_prep_read(TioRing* tio, char* buf, size_t len, int buf_index, uint64_t tag) {
+    return tio_prep(tio, IORING_OP_READ, buf, len, buf_index, tag);
+}
+
+/**
+ * Queues a write of the packet in buf. Nothing is handed to the kernel until tio_submit.
+ * @param buf: packet to be written, must lie in region buf_index passed to tio_init.
+ * @param len: length of the packet.
+ * @param buf_index: index of the registered region buf lies in.
+ * @param tag: value returned by tio_reap for this request.
+ */
+TioStatus tio_prep_write(TioRing* tio, char* buf, size_t len, int buf_index, uint64_t tag) {
+    return tio_prep(tio, IORING_OP_WRITE, buf, len, buf_index, tag);
+}
+
+/**
+ * Queues a write of a packet gathered from several buffers, which need not be registered.
+ * @param iov: buffers of the packet, must stay valid until the write completes.
+ * @param iovcnt: number of buffers.
+ * @param tag: value returned by tio_reap for this request.
+ */
+TioStatus tio_prep_writev(TioRing* tio, const struct iovec* iov, unsigned iovcnt, uint64_t tag) {
+    return tio_prep(tio, IORING_OP_WRITEV, (char *) iov, iovcnt, 0, tag);
+}
+
+/**
+ * Hands all queued requests to the kernel with one syscall, and waits until at least wait_nr 
+ * completions are available.
+ * @param wait_nr: number of completions to wait for, 0 to return immediately.
+ */
+TioStatus tio_submit(TioRing* tio, unsigned wait_nr) {
+    if (tio->to_submit == 0 && wait_nr == 0) return TIO_SUCCESS;
+
+    __atomic_store_n(tio->sq_tail, *tio->sq_tail + tio->to_submit, __ATOMIC_RELEASE);
+    unsigned n = tio->to_submit;
+    tio->to_submit = 0;
+
+    if (syscall(__NR_io_uring_enter, tio->ring_fd, n, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0)
+        return TIO_ERR_SUBMIT;
+    return TIO_SUCCESS;
+}
+
+/**
+ * Collects up to max completions without entering the kernel.
+ * @param tags: filled with the tags of the completed requests.
+ * @param res: filled with the results (bytes transferred or -errno) of the completed requests.
+ * @param max: capacity of tags and res.
+ * @return number of completions collected.
+ */
+int tio_reap(TioRing* tio, uint64_t* tags, int* res, int max) {
+    unsigned head = *tio->cq_head;
+    unsigned tail = __atomic_load_n(tio->cq_tail, __ATOMIC_ACQUIRE);
+    int n = 0;
+
+    while (head != tail && n < max) {
+        struct io_uring_cqe* cqe = &tio->cqes[head & *tio->cq_mask];
+        tags[n] = cqe->user_data;
+        res[n] = cqe->res;
+        n++;
+        head++;
+    }
+    __atomic_store_n(tio->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+#else
+
+TioStatus tio_init(TioRing* tio, int fd, struct iovec* bufs, unsigned nbufs) { return TIO_ERR_UNSUPPORTED; }
+void tio_kill(TioRing* tio) {}
+int tio_event_fd(TioRing* tio) { return -1; }
+TioStatus tio_prep_read(TioRing* tio, char* buf, size_t len, int buf_index, uint64_t tag) { return TIO_ERR_UNSUPPORTED; }
+TioStatus tio_prep_write(TioRing* tio, char* buf, size_t len, int buf_index, uint64_t tag) { return TIO_ERR_UNSUPPORTED; }
+TioStatus tio_prep_writev(TioRing* tio, const struct iovec* iov, unsigned iovcnt, uint64_t tag) { return TIO_ERR_UNSUPPORTED; }
+TioStatus tio_submit(TioRing* tio, unsigned wait_nr) { return TIO_ERR_UNSUPPORTED; }
+int tio_reap(TioRing* tio, uint64_t* tags, int* res, int max) { return 0; }
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef TUN_IO
+#define TUN_IO
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define TIO_QUEUE_DEPTH 64          // submission queue entries, must be a power of two
+#define TIO_WRITE_TAG (1ULL << 63)  // set on the tag of write requests
+
+typedef enum {
+    TIO_ERR_UNSUPPORTED,            // No io_uring support on this platform / kernel
+    TIO_ERR_SETUP,                  // Setting up or mapping the ring failed
+    TIO_ERR_QUEUE_FULL,             // No free submission queue entry
+    TIO_ERR_SUBMIT,                 // io_uring_enter failed
+    TIO_SUCCESS,
+} TioStatus;
+
+void tio_error_message(TioStatus s);
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/*
+ * One io_uring instance, driving a single tun queue. Only used by the thread owning the queue.
+ */
+typedef struct {
+    int ring_fd;
+    int fd;                         // tun fd all requests go to
+    int fixed;                      // 1 if the pool buffers are registered with the ring
+    int efd;                        // eventfd signalled on every completion
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned sq_entries;
+    unsigned to_submit;             // prepared but not yet submitted entries
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ptr;
+    size_t sq_sz;
+    void* cq_ptr;
+    size_t cq_sz;
+    size_t sqes_sz;
+} TioRing;
+
+TioStatus tio_init(TioRing* tio, int fd, struct iovec* bufs, unsigned nbufs);
+void tio_kill(TioRing* tio);
+int tio_event_fd(TioRing* tio);
+TioStatus tio_prep_read(TioRing* tio, char* buf, size_t len, int buf_index, uint64_t tag);
+TioStatus tio_prep_write(TioRing* tio, char* buf, size_t len, int buf_index, uint64_t tag);
+TioStatus tio_prep_writev(TioRing* tio, const struct iovec* iov, unsigned iovcnt, uint64_t tag);
+TioStatus tio_submit(TioRing* tio, unsigned wait_nr);
+int tio_reap(TioRing* tio, uint64_t* tags, int* res, int max);
+
+#endif